@@ -2091,7 +2091,8 @@ static void bfq_add_request(struct request *rq)
 	bfqq->queued[rq_is_sync(rq)]++;
 	bfqd->queued++;
 
-	if (bfq_bfqq_sync(bfqq) && RQ_BIC(rq)->requests <= 1) {
+	if (!bfqd->flash_mode && bfq_bfqq_sync(bfqq) &&
+	    RQ_BIC(rq)->requests <= 1) {
 		bfq_check_waker(bfqd, bfqq, now_ns);
 
 		/*
@@ -2757,6 +2758,10 @@ bfq_setup_cooperator(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 	if (bfqq->new_bfqq)
 		return bfqq->new_bfqq;
 
+	/* queue merging only pays off with seeks to avoid */
+	if (bfqd->flash_mode)
+		return NULL;
+
 	/*
 	 * Check delayed stable merge for rotational or non-queueing
 	 * devs. For this branch to be executed, bfqq must not be
@@ -4454,6 +4459,9 @@ static bool bfq_better_to_idle(struct bfq_queue *bfqq)
 	if (unlikely(bfqd->strict_guarantees))
 		return true;
 
+	if (bfqd->flash_mode)
+		return false;
+
 	/*
 	 * Idling is performed only if slice_idle > 0. In addition, we
 	 * do not idle if
@@ -4608,6 +4616,20 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 	if (!bfqq)
 		goto new_queue;
 
+	/*
+	 * In flash mode, reuse the last decision for a batch of
+	 * dispatches, as long as the in-service queue has a request
+	 * that fits in its budget. Budget timeouts are then only
+	 * checked once per batch.
+	 */
+	if (bfqd->flash_mode && bfqd->flash_batch_left && bfqq->next_rq &&
+	    !bfq_bfqq_wait_request(bfqq) &&
+	    bfq_serv_to_charge(bfqq->next_rq, bfqq) <=
+	    bfq_bfqq_budget_left(bfqq)) {
+		bfqd->flash_batch_left--;
+		return bfqq;
+	}
+
 	bfq_log_bfqq(bfqd, bfqq, "select_queue: already in-service queue");
 
 	/*
@@ -4819,6 +4841,9 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 	else
 		bfq_log(bfqd, "select_queue: no queue returned");
 
+	if (bfqq && bfqq == bfqd->in_service_queue)
+		bfqd->flash_batch_left = bfqd->flash_batch - 1;
+
 	return bfqq;
 }
 
@@ -5942,9 +5967,11 @@ static bool __bfq_insert_request(struct bfq_data *bfqd, struct request *rq)
 		bfqq = new_bfqq;
 	}
 
-	bfq_update_io_thinktime(bfqd, bfqq);
-	bfq_update_has_short_ttime(bfqd, bfqq, RQ_BIC(rq));
-	bfq_update_io_seektime(bfqd, bfqq, rq);
+	if (!bfqd->flash_mode) {
+		bfq_update_io_thinktime(bfqd, bfqq);
+		bfq_update_has_short_ttime(bfqd, bfqq, RQ_BIC(rq));
+		bfq_update_io_seektime(bfqd, bfqq, rq);
+	}
 
 	waiting = bfqq && bfq_bfqq_wait_request(bfqq);
 	bfq_add_request(rq);
@@ -7005,6 +7032,8 @@ static int bfq_init_queue(struct request_queue *q, struct elevator_type *e)
 
 	bfqd->low_latency = true;
 
+	bfqd->flash_batch = 8;
+
 	/*
 	 * Trade-off between responsiveness and fairness.
 	 */
@@ -7112,6 +7141,8 @@ SHOW_FUNCTION(bfq_max_budget_show, bfqd->bfq_user_max_budget, 0);
 SHOW_FUNCTION(bfq_timeout_sync_show, bfqd->bfq_timeout, 1);
 SHOW_FUNCTION(bfq_strict_guarantees_show, bfqd->strict_guarantees, 0);
 SHOW_FUNCTION(bfq_low_latency_show, bfqd->low_latency, 0);
+SHOW_FUNCTION(bfq_flash_mode_show, bfqd->flash_mode, 0);
+SHOW_FUNCTION(bfq_flash_batch_show, bfqd->flash_batch, 0);
 #undef SHOW_FUNCTION
 
 #define USEC_SHOW_FUNCTION(__FUNC, __VAR)				\
@@ -7156,6 +7187,7 @@ STORE_FUNCTION(bfq_back_seek_max_store, &bfqd->bfq_back_max, 0, INT_MAX, 0);
 STORE_FUNCTION(bfq_back_seek_penalty_store, &bfqd->bfq_back_penalty, 1,
 		INT_MAX, 0);
 STORE_FUNCTION(bfq_slice_idle_store, &bfqd->bfq_slice_idle, 0, INT_MAX, 2);
+STORE_FUNCTION(bfq_flash_batch_store, &bfqd->flash_batch, 1, 64, 0);
 #undef STORE_FUNCTION
 
 #define USEC_STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)			\
@@ -7272,6 +7304,25 @@ static ssize_t bfq_low_latency_store(struct elevator_queue *e,
 	return count;
 }
 
+static ssize_t bfq_flash_mode_store(struct elevator_queue *e,
+				    const char *page, size_t count)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	unsigned long __data;
+	int ret;
+
+	ret = bfq_var_store(&__data, (page));
+	if (ret)
+		return ret;
+
+	if (__data > 1)
+		__data = 1;
+	bfqd->flash_mode = __data;
+	bfqd->flash_batch_left = 0;
+
+	return count;
+}
+
 #define BFQ_ATTR(name) \
 	__ATTR(name, 0644, bfq_##name##_show, bfq_##name##_store)
 
@@ -7286,6 +7337,8 @@ static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(timeout_sync),
 	BFQ_ATTR(strict_guarantees),
 	BFQ_ATTR(low_latency),
+	BFQ_ATTR(flash_mode),
+	BFQ_ATTR(flash_batch),
 	__ATTR_NULL
 };
 
@@ -684,6 +684,19 @@ struct bfq_data {
 	 */
 	bool strict_guarantees;
 
+	/*
+	 * Low overhead mode for flash: no device idling, no queue
+	 * merging, no I/O injection and none of the seek and think
+	 * time statistics these heuristics need. Weight raising is
+	 * kept. In addition, the in-service queue is kept for up to
+	 * flash_batch dispatches before bfq_select_queue() evaluates
+	 * it again.
+	 */
+	bool flash_mode;
+	unsigned int flash_batch;
+	/* dispatches left before the in-service queue is evaluated again */
+	unsigned int flash_batch_left;
+
 	/*
 	 * Last time at which a queue entered the current burst of
 	 * queues being activated shortly after each other; for more
@@ -32,6 +32,7 @@
 #include <linux/psi.h>
 #include "blk.h"
 #include "blk-ioprio.h"
+#include "blk-lat-hist.h"
 
 /*
  * blkcg_pol_mutex protects blkcg_policy[] and policy [de]activation.
@@ -82,6 +83,7 @@ static void blkg_free(struct blkcg_gq *blkg)
 			blkcg_policy[i]->pd_free_fn(blkg->pd[i]);
 
 	free_percpu(blkg->iostat_cpu);
+	blk_lat_hist_exit_blkg(blkg);
 	percpu_ref_exit(&blkg->refcnt);
 	kfree(blkg);
 }
@@ -166,6 +168,9 @@ static struct blkcg_gq *blkg_alloc(struct blkcg *blkcg, struct request_queue *q,
 	if (!blkg->iostat_cpu)
 		goto err_free;
 
+	if (blk_lat_hist_init_blkg(blkg, gfp_mask))
+		goto err_free;
+
 	blkg->q = q;
 	INIT_LIST_HEAD(&blkg->q_node);
 	spin_lock_init(&blkg->async_bio_lock);
@@ -473,6 +478,7 @@ static int blkcg_reset_stats(struct cgroup_subsys_state *css,
 			memset(bis, 0, sizeof(*bis));
 		}
 		memset(&blkg->iostat, 0, sizeof(blkg->iostat));
+		blk_lat_hist_reset_blkg(blkg);
 
 		for (i = 0; i < BLKCG_MAX_POLS; i++) {
 			struct blkcg_policy *pol = blkcg_policy[i];
@@ -965,6 +971,12 @@ static struct cftype blkcg_files[] = {
 		.name = "stat",
 		.seq_show = blkcg_print_stat,
 	},
+#ifdef CONFIG_BLK_LAT_HIST
+	{
+		.name = "latency_hist",
+		.seq_show = blk_lat_hist_blkcg_show,
+	},
+#endif
 	{ }	/* terminate */
 };
 
@@ -973,6 +985,12 @@ static struct cftype blkcg_legacy_files[] = {
 		.name = "reset_stats",
 		.write_u64 = blkcg_reset_stats,
 	},
+#ifdef CONFIG_BLK_LAT_HIST
+	{
+		.name = "latency_hist",
+		.seq_show = blk_lat_hist_blkcg_show,
+	},
+#endif
 	{ }	/* terminate */
 };
 
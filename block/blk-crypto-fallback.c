@@ -13,10 +13,12 @@
 #include <linux/blk-cgroup.h>
 #include <linux/blk-crypto.h>
 #include <linux/blkdev.h>
+#include <linux/cpuhotplug.h>
 #include <linux/crypto.h>
 #include <linux/keyslot-manager.h>
 #include <linux/mempool.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/random.h>
 
 #include "blk-crypto-internal.h"
@@ -31,6 +33,18 @@ module_param_named(num_keyslots, blk_crypto_num_keyslots, uint, 0);
 MODULE_PARM_DESC(num_keyslots,
 		 "Number of keyslots for the blk-crypto crypto API fallback");
 
+#define BLK_CRYPTO_MAX_PCP_BOUNCE_PG	64
+
+static unsigned int num_pcp_bounce_pg = 16;
+
+#define BLK_CRYPTO_MAX_JOBS		16
+#define BLK_CRYPTO_MIN_JOB_BYTES	(16 * 1024)
+
+static unsigned int max_crypt_workers;
+module_param(max_crypt_workers, uint, 0644);
+MODULE_PARM_DESC(max_crypt_workers,
+		 "Maximum number of CPUs en/decrypting a single bio (0 = number of online CPUs, 1 = no parallelism)");
+
 static unsigned int num_prealloc_fallback_crypt_ctxs = 128;
 module_param(num_prealloc_fallback_crypt_ctxs, uint, 0);
 MODULE_PARM_DESC(num_prealloc_crypt_fallback_ctxs,
@@ -79,9 +93,49 @@ static struct blk_crypto_keyslot {
 
 static struct blk_keyslot_manager blk_crypto_ksm;
 static struct workqueue_struct *blk_crypto_wq;
+static struct workqueue_struct *blk_crypto_job_wq;
 static mempool_t *blk_crypto_bounce_page_pool;
 static struct bio_set crypto_bio_split;
 
+/*
+ * Bounce pages are recycled through a small per-CPU cache in front of the
+ * mempool, so that writes don't go to the page allocator (or contend on the
+ * mempool lock) for every page.  The mempool reserve is always refilled
+ * first, so caching pages per CPU can't starve mempool_alloc().
+ */
+struct blk_crypto_page_cache {
+	unsigned int nr;
+	struct page *pages[BLK_CRYPTO_MAX_PCP_BOUNCE_PG];
+};
+
+static struct blk_crypto_page_cache __percpu *blk_crypto_page_caches;
+static int blk_crypto_page_cache_hp_state;
+
+/*
+ * Part of a bio en/decrypted by one CPU.  Encryption jobs own a range of the
+ * bounce bio's bvecs, decryption jobs a range of the bio's data.
+ */
+struct blk_crypto_fallback_job {
+	struct work_struct work;
+	struct completion done;
+	void (*fn)(struct blk_crypto_fallback_job *job);
+	struct blk_ksm_keyslot *slot;
+	unsigned int data_unit_size;
+	u64 dun[BLK_CRYPTO_DUN_ARRAY_SIZE];
+	union {
+		struct {
+			struct bio_vec *bvecs;
+			unsigned int nr_bvecs;
+			unsigned int nr_done;	/* bvecs given a bounce page */
+		};
+		struct {
+			struct bio *bio;
+			struct bvec_iter iter;
+		};
+	};
+	blk_status_t status;
+};
+
 /*
  * This is the key we set when evicting a keyslot. This *should* be the all 0's
  * key, but AES-XTS rejects that key, so we use some random bytes instead.
@@ -144,14 +198,94 @@ static const struct blk_ksm_ll_ops blk_crypto_ksm_ll_ops = {
 	.keyslot_evict		= blk_crypto_keyslot_evict,
 };
 
+static struct page *blk_crypto_alloc_bounce_page(void)
+{
+	struct blk_crypto_page_cache *pc;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(blk_crypto_page_caches);
+	if (pc->nr)
+		page = pc->pages[--pc->nr];
+	local_irq_restore(flags);
+
+	return page ?: mempool_alloc(blk_crypto_bounce_page_pool, GFP_NOIO);
+}
+
+static void blk_crypto_free_bounce_page(struct page *page)
+{
+	mempool_t *pool = blk_crypto_bounce_page_pool;
+	struct blk_crypto_page_cache *pc;
+	unsigned long flags;
+
+	if (READ_ONCE(pool->curr_nr) >= pool->min_nr) {
+		unsigned int max = min_t(unsigned int,
+					 READ_ONCE(num_pcp_bounce_pg),
+					 BLK_CRYPTO_MAX_PCP_BOUNCE_PG);
+
+		local_irq_save(flags);
+		pc = this_cpu_ptr(blk_crypto_page_caches);
+		if (pc->nr < max) {
+			pc->pages[pc->nr++] = page;
+			page = NULL;
+		}
+		local_irq_restore(flags);
+		if (!page)
+			return;
+	}
+
+	mempool_free(page, pool);
+}
+
+/* Called with interrupts disabled, or on a CPU that is dead */
+static void blk_crypto_trim_page_cache(struct blk_crypto_page_cache *pc,
+				       unsigned int max)
+{
+	while (pc->nr > max)
+		mempool_free(pc->pages[--pc->nr], blk_crypto_bounce_page_pool);
+}
+
+static void blk_crypto_trim_local_page_cache(void *unused)
+{
+	blk_crypto_trim_page_cache(this_cpu_ptr(blk_crypto_page_caches),
+				   READ_ONCE(num_pcp_bounce_pg));
+}
+
+static int blk_crypto_page_cache_dead(unsigned int cpu)
+{
+	blk_crypto_trim_page_cache(per_cpu_ptr(blk_crypto_page_caches, cpu), 0);
+	return 0;
+}
+
+static int num_pcp_bounce_pg_set(const char *val,
+				 const struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	/* Don't keep more pages cached than the new limit allows */
+	if (!ret && READ_ONCE(blk_crypto_page_caches))
+		on_each_cpu(blk_crypto_trim_local_page_cache, NULL, 1);
+	return ret;
+}
+
+static const struct kernel_param_ops num_pcp_bounce_pg_ops = {
+	.set	= num_pcp_bounce_pg_set,
+	.get	= param_get_uint,
+};
+
+module_param_cb(num_pcp_bounce_pg, &num_pcp_bounce_pg_ops,
+		&num_pcp_bounce_pg, 0644);
+MODULE_PARM_DESC(num_pcp_bounce_pg,
+		 "Number of bounce pages cached per CPU for the blk-crypto crypto API fallback (max 64)");
+
 static void blk_crypto_fallback_encrypt_endio(struct bio *enc_bio)
 {
 	struct bio *src_bio = enc_bio->bi_private;
 	int i;
 
 	for (i = 0; i < enc_bio->bi_vcnt; i++)
-		mempool_free(enc_bio->bi_io_vec[i].bv_page,
-			     blk_crypto_bounce_page_pool);
+		blk_crypto_free_bounce_page(enc_bio->bi_io_vec[i].bv_page);
 
 	src_bio->bi_status = enc_bio->bi_status;
 
@@ -255,25 +389,197 @@ static void blk_crypto_dun_to_iv(const u64 dun[BLK_CRYPTO_DUN_ARRAY_SIZE],
 		iv->dun[i] = cpu_to_le64(dun[i]);
 }
 
+static unsigned int blk_crypto_fallback_nr_jobs(unsigned int bytes)
+{
+	unsigned int workers = READ_ONCE(max_crypt_workers) ?: num_online_cpus();
+
+	return clamp(bytes / BLK_CRYPTO_MIN_JOB_BYTES, 1U,
+		     min_t(unsigned int, workers, BLK_CRYPTO_MAX_JOBS));
+}
+
+/*
+ * Allocate up to *nr_jobs jobs, falling back to the caller's single on-stack
+ * job if that fails.
+ */
+static struct blk_crypto_fallback_job *
+blk_crypto_fallback_alloc_jobs(unsigned int *nr_jobs,
+			       struct blk_crypto_fallback_job *onstack)
+{
+	struct blk_crypto_fallback_job *jobs = NULL;
+
+	if (*nr_jobs > 1)
+		jobs = kcalloc(*nr_jobs, sizeof(*jobs),
+			       GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+	if (!jobs) {
+		memset(onstack, 0, sizeof(*onstack));
+		*nr_jobs = 1;
+		return onstack;
+	}
+	return jobs;
+}
+
+static void blk_crypto_fallback_job_work(struct work_struct *work)
+{
+	struct blk_crypto_fallback_job *job =
+		container_of(work, struct blk_crypto_fallback_job, work);
+
+	job->fn(job);
+	complete(&job->done);
+}
+
+/*
+ * Run the first job in the caller's context and the others on
+ * blk_crypto_job_wq, and wait for all of them.  The jobs never wait for other
+ * work on blk_crypto_wq or blk_crypto_job_wq.  Encryption jobs can block in
+ * mempool_alloc() for a bounce page, but those are given back by completing
+ * writes, not by work on these workqueues, and blk_crypto_job_wq has a
+ * rescuer.  So the jobs can't deadlock against callers that are running on
+ * blk_crypto_wq.  Returns the first error.
+ */
+static blk_status_t blk_crypto_fallback_run(struct blk_crypto_fallback_job *jobs,
+					    unsigned int nr_jobs)
+{
+	blk_status_t status = BLK_STS_OK;
+	unsigned int i;
+
+	for (i = 1; i < nr_jobs; i++) {
+		INIT_WORK(&jobs[i].work, blk_crypto_fallback_job_work);
+		init_completion(&jobs[i].done);
+		queue_work(blk_crypto_job_wq, &jobs[i].work);
+	}
+
+	jobs[0].fn(&jobs[0]);
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (i)
+			wait_for_completion(&jobs[i].done);
+		if (!status)
+			status = jobs[i].status;
+	}
+	return status;
+}
+
+/*
+ * Encrypt the job's bvecs of the bounce bio, replacing each plaintext page
+ * with a freshly encrypted bounce page.
+ */
+static void blk_crypto_fallback_encrypt_job(struct blk_crypto_fallback_job *job)
+{
+	const unsigned int data_unit_size = job->data_unit_size;
+	struct skcipher_request *ciph_req = NULL;
+	DECLARE_CRYPTO_WAIT(wait);
+	struct scatterlist src, dst;
+	union blk_crypto_iv iv;
+	unsigned int j;
+
+	if (!blk_crypto_alloc_cipher_req(job->slot, &ciph_req, &wait)) {
+		job->status = BLK_STS_RESOURCE;
+		return;
+	}
+
+	sg_init_table(&src, 1);
+	sg_init_table(&dst, 1);
+
+	skcipher_request_set_crypt(ciph_req, &src, &dst, data_unit_size,
+				   iv.bytes);
+
+	/* Encrypt each page in the job */
+	for (job->nr_done = 0; job->nr_done < job->nr_bvecs; ) {
+		struct bio_vec *enc_bvec = &job->bvecs[job->nr_done];
+		struct page *plaintext_page = enc_bvec->bv_page;
+		struct page *ciphertext_page = blk_crypto_alloc_bounce_page();
+
+		if (!ciphertext_page) {
+			job->status = BLK_STS_RESOURCE;
+			goto out;
+		}
+
+		enc_bvec->bv_page = ciphertext_page;
+		job->nr_done++;
+
+		sg_set_page(&src, plaintext_page, data_unit_size,
+			    enc_bvec->bv_offset);
+		sg_set_page(&dst, ciphertext_page, data_unit_size,
+			    enc_bvec->bv_offset);
+
+		/* Encrypt each data unit in this page */
+		for (j = 0; j < enc_bvec->bv_len; j += data_unit_size) {
+			blk_crypto_dun_to_iv(job->dun, &iv);
+			if (crypto_wait_req(crypto_skcipher_encrypt(ciph_req),
+					    &wait)) {
+				job->status = BLK_STS_IOERR;
+				goto out;
+			}
+			bio_crypt_dun_increment(job->dun, 1);
+			src.offset += data_unit_size;
+			dst.offset += data_unit_size;
+		}
+	}
+out:
+	skcipher_request_free(ciph_req);
+}
+
+/* Decrypt the job's part of the bio in place */
+static void blk_crypto_fallback_decrypt_job(struct blk_crypto_fallback_job *job)
+{
+	const unsigned int data_unit_size = job->data_unit_size;
+	struct skcipher_request *ciph_req = NULL;
+	DECLARE_CRYPTO_WAIT(wait);
+	union blk_crypto_iv iv;
+	struct scatterlist sg;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned int i;
+
+	if (!blk_crypto_alloc_cipher_req(job->slot, &ciph_req, &wait)) {
+		job->status = BLK_STS_RESOURCE;
+		return;
+	}
+
+	sg_init_table(&sg, 1);
+	skcipher_request_set_crypt(ciph_req, &sg, &sg, data_unit_size,
+				   iv.bytes);
+
+	/* Decrypt each segment in the job */
+	__bio_for_each_segment(bv, job->bio, iter, job->iter) {
+		struct page *page = bv.bv_page;
+
+		sg_set_page(&sg, page, data_unit_size, bv.bv_offset);
+
+		/* Decrypt each data unit in the segment */
+		for (i = 0; i < bv.bv_len; i += data_unit_size) {
+			blk_crypto_dun_to_iv(job->dun, &iv);
+			if (crypto_wait_req(crypto_skcipher_decrypt(ciph_req),
+					    &wait)) {
+				job->status = BLK_STS_IOERR;
+				goto out;
+			}
+			bio_crypt_dun_increment(job->dun, 1);
+			sg.offset += data_unit_size;
+		}
+	}
+out:
+	skcipher_request_free(ciph_req);
+}
+
 /*
  * The crypto API fallback's encryption routine.
  * Allocate a bounce bio for encryption, encrypt the input bio using crypto API,
  * and replace *bio_ptr with the bounce bio. May split input bio if it's too
- * large. Returns true on success. Returns false and sets bio->bi_status on
- * error.
+ * large. Large bios are encrypted by several CPUs in parallel, each taking a
+ * contiguous range of pages. Returns true on success. Returns false and sets
+ * bio->bi_status on error.
  */
 static bool blk_crypto_fallback_encrypt_bio(struct bio **bio_ptr)
 {
 	struct bio *src_bio, *enc_bio;
 	struct bio_crypt_ctx *bc;
 	struct blk_ksm_keyslot *slot;
+	struct blk_crypto_fallback_job onstack, *jobs;
+	unsigned int nr_jobs, per_job;
 	int data_unit_size;
-	struct skcipher_request *ciph_req = NULL;
-	DECLARE_CRYPTO_WAIT(wait);
 	u64 curr_dun[BLK_CRYPTO_DUN_ARRAY_SIZE];
-	struct scatterlist src, dst;
-	union blk_crypto_iv iv;
-	unsigned int i, j;
+	unsigned int i, j, k;
 	bool ret = false;
 	blk_status_t blk_st;
 
@@ -302,51 +608,36 @@ static bool blk_crypto_fallback_encrypt_bio(struct bio **bio_ptr)
 		goto out_put_enc_bio;
 	}
 
-	/* and then allocate an skcipher_request for it */
-	if (!blk_crypto_alloc_cipher_req(slot, &ciph_req, &wait)) {
-		src_bio->bi_status = BLK_STS_RESOURCE;
-		goto out_release_keyslot;
-	}
+	/* Hand each job a contiguous range of pages and its starting DUN */
+	nr_jobs = blk_crypto_fallback_nr_jobs(enc_bio->bi_iter.bi_size);
+	jobs = blk_crypto_fallback_alloc_jobs(&nr_jobs, &onstack);
+	per_job = DIV_ROUND_UP(enc_bio->bi_vcnt, nr_jobs);
 
 	memcpy(curr_dun, bc->bc_dun, sizeof(curr_dun));
-	sg_init_table(&src, 1);
-	sg_init_table(&dst, 1);
-
-	skcipher_request_set_crypt(ciph_req, &src, &dst, data_unit_size,
-				   iv.bytes);
-
-	/* Encrypt each page in the bounce bio */
-	for (i = 0; i < enc_bio->bi_vcnt; i++) {
-		struct bio_vec *enc_bvec = &enc_bio->bi_io_vec[i];
-		struct page *plaintext_page = enc_bvec->bv_page;
-		struct page *ciphertext_page =
-			mempool_alloc(blk_crypto_bounce_page_pool, GFP_NOIO);
-
-		enc_bvec->bv_page = ciphertext_page;
-
-		if (!ciphertext_page) {
-			src_bio->bi_status = BLK_STS_RESOURCE;
-			goto out_free_bounce_pages;
-		}
-
-		sg_set_page(&src, plaintext_page, data_unit_size,
-			    enc_bvec->bv_offset);
-		sg_set_page(&dst, ciphertext_page, data_unit_size,
-			    enc_bvec->bv_offset);
+	for (i = 0, j = 0; i < enc_bio->bi_vcnt; i += per_job, j++) {
+		struct blk_crypto_fallback_job *job = &jobs[j];
+
+		job->fn = blk_crypto_fallback_encrypt_job;
+		job->slot = slot;
+		job->data_unit_size = data_unit_size;
+		memcpy(job->dun, curr_dun, sizeof(curr_dun));
+		job->bvecs = &enc_bio->bi_io_vec[i];
+		job->nr_bvecs = min(per_job, enc_bio->bi_vcnt - i);
+		for (k = 0; k < job->nr_bvecs; k++)
+			bio_crypt_dun_increment(curr_dun,
+					job->bvecs[k].bv_len / data_unit_size);
+	}
 
-		/* Encrypt each data unit in this page */
-		for (j = 0; j < enc_bvec->bv_len; j += data_unit_size) {
-			blk_crypto_dun_to_iv(curr_dun, &iv);
-			if (crypto_wait_req(crypto_skcipher_encrypt(ciph_req),
-					    &wait)) {
-				i++;
-				src_bio->bi_status = BLK_STS_IOERR;
-				goto out_free_bounce_pages;
-			}
-			bio_crypt_dun_increment(curr_dun, 1);
-			src.offset += data_unit_size;
-			dst.offset += data_unit_size;
+	blk_st = blk_crypto_fallback_run(jobs, j);
+	if (blk_st != BLK_STS_OK) {
+		/* Free the bounce pages of all jobs, not just the failed one */
+		src_bio->bi_status = blk_st;
+		while (j--) {
+			for (k = 0; k < jobs[j].nr_done; k++)
+				blk_crypto_free_bounce_page(
+					jobs[j].bvecs[k].bv_page);
 		}
+		goto out_free_jobs;
 	}
 
 	enc_bio->bi_private = src_bio;
@@ -355,15 +646,10 @@ static bool blk_crypto_fallback_encrypt_bio(struct bio **bio_ptr)
 	ret = true;
 
 	enc_bio = NULL;
-	goto out_free_ciph_req;
 
-out_free_bounce_pages:
-	while (i > 0)
-		mempool_free(enc_bio->bi_io_vec[--i].bv_page,
-			     blk_crypto_bounce_page_pool);
-out_free_ciph_req:
-	skcipher_request_free(ciph_req);
-out_release_keyslot:
+out_free_jobs:
+	if (jobs != &onstack)
+		kfree(jobs);
 	blk_ksm_put_slot(slot);
 out_put_enc_bio:
 	if (enc_bio)
@@ -374,7 +660,8 @@ static bool blk_crypto_fallback_encrypt_bio(struct bio **bio_ptr)
 
 /*
  * The crypto API fallback's main decryption routine.
- * Decrypts input bio in place, and calls bio_endio on the bio.
+ * Decrypts input bio in place, and calls bio_endio on the bio. Large bios are
+ * split into jobs that are decrypted by several CPUs in parallel.
  */
 static void blk_crypto_fallback_decrypt_bio(struct work_struct *work)
 {
@@ -383,15 +670,11 @@ static void blk_crypto_fallback_decrypt_bio(struct work_struct *work)
 	struct bio *bio = f_ctx->bio;
 	struct bio_crypt_ctx *bc = &f_ctx->crypt_ctx;
 	struct blk_ksm_keyslot *slot;
-	struct skcipher_request *ciph_req = NULL;
-	DECLARE_CRYPTO_WAIT(wait);
+	struct blk_crypto_fallback_job onstack, *jobs;
+	struct bvec_iter iter = f_ctx->crypt_iter;
 	u64 curr_dun[BLK_CRYPTO_DUN_ARRAY_SIZE];
-	union blk_crypto_iv iv;
-	struct scatterlist sg;
-	struct bio_vec bv;
-	struct bvec_iter iter;
 	const int data_unit_size = bc->bc_key->crypto_cfg.data_unit_size;
-	unsigned int i;
+	unsigned int nr_jobs, per_job, i;
 	blk_status_t blk_st;
 
 	/*
@@ -404,38 +687,36 @@ static void blk_crypto_fallback_decrypt_bio(struct work_struct *work)
 		goto out_no_keyslot;
 	}
 
-	/* and then allocate an skcipher_request for it */
-	if (!blk_crypto_alloc_cipher_req(slot, &ciph_req, &wait)) {
-		bio->bi_status = BLK_STS_RESOURCE;
-		goto out;
-	}
+	/*
+	 * Split at data unit boundaries; data units never straddle segments,
+	 * so neither do the jobs' data units.
+	 */
+	nr_jobs = blk_crypto_fallback_nr_jobs(iter.bi_size);
+	jobs = blk_crypto_fallback_alloc_jobs(&nr_jobs, &onstack);
+	per_job = round_up(DIV_ROUND_UP(iter.bi_size, nr_jobs), data_unit_size);
 
 	memcpy(curr_dun, bc->bc_dun, sizeof(curr_dun));
-	sg_init_table(&sg, 1);
-	skcipher_request_set_crypt(ciph_req, &sg, &sg, data_unit_size,
-				   iv.bytes);
-
-	/* Decrypt each segment in the bio */
-	__bio_for_each_segment(bv, bio, iter, f_ctx->crypt_iter) {
-		struct page *page = bv.bv_page;
-
-		sg_set_page(&sg, page, data_unit_size, bv.bv_offset);
-
-		/* Decrypt each data unit in the segment */
-		for (i = 0; i < bv.bv_len; i += data_unit_size) {
-			blk_crypto_dun_to_iv(curr_dun, &iv);
-			if (crypto_wait_req(crypto_skcipher_decrypt(ciph_req),
-					    &wait)) {
-				bio->bi_status = BLK_STS_IOERR;
-				goto out;
-			}
-			bio_crypt_dun_increment(curr_dun, 1);
-			sg.offset += data_unit_size;
-		}
+	for (i = 0; iter.bi_size; i++) {
+		struct blk_crypto_fallback_job *job = &jobs[i];
+
+		job->fn = blk_crypto_fallback_decrypt_job;
+		job->slot = slot;
+		job->data_unit_size = data_unit_size;
+		memcpy(job->dun, curr_dun, sizeof(curr_dun));
+		job->bio = bio;
+		job->iter = iter;
+		job->iter.bi_size = min(per_job, iter.bi_size);
+		bio_advance_iter(bio, &iter, job->iter.bi_size);
+		bio_crypt_dun_increment(curr_dun,
+					job->iter.bi_size / data_unit_size);
 	}
 
-out:
-	skcipher_request_free(ciph_req);
+	blk_st = blk_crypto_fallback_run(jobs, i);
+	if (blk_st != BLK_STS_OK)
+		bio->bi_status = blk_st;
+
+	if (jobs != &onstack)
+		kfree(jobs);
 	blk_ksm_put_slot(slot);
 out_no_keyslot:
 	mempool_free(f_ctx, bio_fallback_crypt_ctx_pool);
@@ -566,20 +847,38 @@ static int blk_crypto_fallback_init(void)
 	if (!blk_crypto_wq)
 		goto fail_free_ksm;
 
+	blk_crypto_job_wq = alloc_workqueue("blk_crypto_job_wq",
+					    WQ_UNBOUND | WQ_HIGHPRI |
+					    WQ_MEM_RECLAIM, 0);
+	if (!blk_crypto_job_wq)
+		goto fail_free_wq;
+
 	blk_crypto_keyslots = kcalloc(blk_crypto_num_keyslots,
 				      sizeof(blk_crypto_keyslots[0]),
 				      GFP_KERNEL);
 	if (!blk_crypto_keyslots)
-		goto fail_free_wq;
+		goto fail_free_job_wq;
 
 	blk_crypto_bounce_page_pool =
 		mempool_create_page_pool(num_prealloc_bounce_pg, 0);
 	if (!blk_crypto_bounce_page_pool)
 		goto fail_free_keyslots;
 
+	blk_crypto_page_caches = alloc_percpu(struct blk_crypto_page_cache);
+	if (!blk_crypto_page_caches)
+		goto fail_free_bounce_page_pool;
+
+	err = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN,
+					"block/crypto-fallback:dead", NULL,
+					blk_crypto_page_cache_dead);
+	if (err < 0)
+		goto fail_free_page_caches;
+	blk_crypto_page_cache_hp_state = err;
+	err = -ENOMEM;
+
 	bio_fallback_crypt_ctx_cache = KMEM_CACHE(bio_fallback_crypt_ctx, 0);
 	if (!bio_fallback_crypt_ctx_cache)
-		goto fail_free_bounce_page_pool;
+		goto fail_remove_hp_state;
 
 	bio_fallback_crypt_ctx_pool =
 		mempool_create_slab_pool(num_prealloc_fallback_crypt_ctxs,
@@ -592,10 +891,17 @@ static int blk_crypto_fallback_init(void)
 	return 0;
 fail_free_crypt_ctx_cache:
 	kmem_cache_destroy(bio_fallback_crypt_ctx_cache);
+fail_remove_hp_state:
+	cpuhp_remove_state_nocalls(blk_crypto_page_cache_hp_state);
+fail_free_page_caches:
+	free_percpu(blk_crypto_page_caches);
+	blk_crypto_page_caches = NULL;
 fail_free_bounce_page_pool:
 	mempool_destroy(blk_crypto_bounce_page_pool);
 fail_free_keyslots:
 	kfree(blk_crypto_keyslots);
+fail_free_job_wq:
+	destroy_workqueue(blk_crypto_job_wq);
 fail_free_wq:
 	destroy_workqueue(blk_crypto_wq);
 fail_free_ksm:
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Request latency histograms
+ *
+ * Every completed request is accounted in log2 buckets, by operation, for
+ * three stages: the time from allocation to dispatch to the driver (queue),
+ * from dispatch to completion (device), and the total. Histograms are kept
+ * per-cpu for each hardware queue and, with blk-cgroup, for each blkg.
+ */
+#include <linux/blk-cgroup.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "blk-lat-hist.h"
+
+static const char *const blk_lat_op_name[BLK_LAT_NR_OPS] = {
+	[BLK_LAT_READ]		= "read",
+	[BLK_LAT_WRITE]		= "write",
+	[BLK_LAT_FLUSH]		= "flush",
+	[BLK_LAT_DISCARD]	= "discard",
+};
+
+static const char *const blk_lat_stage_name[BLK_LAT_NR_STAGES] = {
+	[BLK_LAT_QUEUE]		= "queue",
+	[BLK_LAT_DEVICE]	= "device",
+	[BLK_LAT_TOTAL]		= "total",
+};
+
+static int blk_lat_op(struct request *rq)
+{
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return BLK_LAT_READ;
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+	case REQ_OP_WRITE_ZEROES:
+		return BLK_LAT_WRITE;
+	case REQ_OP_FLUSH:
+		return BLK_LAT_FLUSH;
+	case REQ_OP_DISCARD:
+	case REQ_OP_SECURE_ERASE:
+		return BLK_LAT_DISCARD;
+	default:
+		return -1;
+	}
+}
+
+static inline unsigned int blk_lat_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(ns >> 10), BLK_LAT_BUCKETS - 1);
+}
+
+static void blk_lat_hist_add(struct blk_lat_hist __percpu *hist, int op,
+			     struct request *rq, u64 now)
+{
+	/* this_cpu_inc() is safe against completions in interrupts */
+	if (rq->start_time_ns && rq->io_start_time_ns >= rq->start_time_ns)
+		this_cpu_inc(hist->buckets[op][BLK_LAT_QUEUE][blk_lat_bucket(
+				rq->io_start_time_ns - rq->start_time_ns)]);
+	if (rq->io_start_time_ns && now >= rq->io_start_time_ns)
+		this_cpu_inc(hist->buckets[op][BLK_LAT_DEVICE][blk_lat_bucket(
+				now - rq->io_start_time_ns)]);
+	if (rq->start_time_ns && now >= rq->start_time_ns)
+		this_cpu_inc(hist->buckets[op][BLK_LAT_TOTAL][blk_lat_bucket(
+				now - rq->start_time_ns)]);
+}
+
+/* Called from __blk_mq_end_request() with the completion time stamp */
+void blk_lat_hist_done(struct request *rq, u64 now)
+{
+	int op = blk_lat_op(rq);
+
+	if (op < 0 || !now)
+		return;
+
+	if (rq->mq_hctx)
+		blk_lat_hist_add(rq->mq_hctx->lat_hist, op, rq, now);
+#ifdef CONFIG_BLK_CGROUP
+	if (rq->lat_blkg)
+		blk_lat_hist_add(rq->lat_blkg->lat_hist, op, rq, now);
+#endif
+}
+
+static void blk_lat_hist_sum(struct blk_lat_hist __percpu *hist,
+			     struct blk_lat_hist *sum)
+{
+	int cpu, op, stage, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct blk_lat_hist *h = per_cpu_ptr(hist, cpu);
+
+		for (op = 0; op < BLK_LAT_NR_OPS; op++)
+			for (stage = 0; stage < BLK_LAT_NR_STAGES; stage++)
+				for (i = 0; i < BLK_LAT_BUCKETS; i++)
+					sum->buckets[op][stage][i] +=
+						READ_ONCE(h->buckets[op][stage][i]);
+	}
+}
+
+static void blk_lat_hist_reset(struct blk_lat_hist __percpu *hist)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0, sizeof(struct blk_lat_hist));
+}
+
+static bool blk_lat_hist_empty(struct blk_lat_hist *sum, int op, int stage)
+{
+	int i;
+
+	for (i = 0; i < BLK_LAT_BUCKETS; i++)
+		if (sum->buckets[op][stage][i])
+			return false;
+	return true;
+}
+
+int blk_lat_hist_init_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	hctx->lat_hist = alloc_percpu_gfp(struct blk_lat_hist,
+					  GFP_NOIO | __GFP_NOWARN |
+					  __GFP_NORETRY);
+	return hctx->lat_hist ? 0 : -ENOMEM;
+}
+
+void blk_lat_hist_exit_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	free_percpu(hctx->lat_hist);
+	hctx->lat_hist = NULL;
+}
+
+/*
+ * One line per operation and stage that saw any I/O:
+ *   <op> <stage> <bucket 0> .. <bucket 21>
+ * Bucket 0 counts requests under 1us, bucket n those under 2^n us, the last
+ * one is open ended.
+ */
+ssize_t blk_lat_hist_hctx_show(struct blk_mq_hw_ctx *hctx, char *page)
+{
+	struct blk_lat_hist *sum;
+	int op, stage, i, len = 0;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	blk_lat_hist_sum(hctx->lat_hist, sum);
+	for (op = 0; op < BLK_LAT_NR_OPS; op++) {
+		for (stage = 0; stage < BLK_LAT_NR_STAGES; stage++) {
+			if (blk_lat_hist_empty(sum, op, stage))
+				continue;
+			len += sysfs_emit_at(page, len, "%s %s",
+					     blk_lat_op_name[op],
+					     blk_lat_stage_name[stage]);
+			for (i = 0; i < BLK_LAT_BUCKETS; i++)
+				len += sysfs_emit_at(page, len, " %llu",
+						sum->buckets[op][stage][i]);
+			len += sysfs_emit_at(page, len, "\n");
+		}
+	}
+	kfree(sum);
+	return len;
+}
+
+void blk_lat_hist_hctx_reset(struct blk_mq_hw_ctx *hctx)
+{
+	blk_lat_hist_reset(hctx->lat_hist);
+}
+
+#ifdef CONFIG_BLK_CGROUP
+int blk_lat_hist_init_blkg(struct blkcg_gq *blkg, gfp_t gfp)
+{
+	blkg->lat_hist = alloc_percpu_gfp(struct blk_lat_hist, gfp);
+	return blkg->lat_hist ? 0 : -ENOMEM;
+}
+
+void blk_lat_hist_exit_blkg(struct blkcg_gq *blkg)
+{
+	free_percpu(blkg->lat_hist);
+	blkg->lat_hist = NULL;
+}
+
+void blk_lat_hist_reset_blkg(struct blkcg_gq *blkg)
+{
+	blk_lat_hist_reset(blkg->lat_hist);
+}
+
+/* Same format as the hardware queue file, prefixed by the device name */
+int blk_lat_hist_blkcg_show(struct seq_file *sf, void *v)
+{
+	struct blkcg *blkcg = css_to_blkcg(seq_css(sf));
+	struct blk_lat_hist *sum;
+	struct blkcg_gq *blkg;
+	int op, stage, i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(blkg, &blkcg->blkg_list, blkcg_node) {
+		const char *dname;
+
+		spin_lock_irq(&blkg->q->queue_lock);
+		dname = blkg_dev_name(blkg);
+		if (!dname || !blkg->online)
+			goto next;
+
+		blk_lat_hist_sum(blkg->lat_hist, sum);
+		for (op = 0; op < BLK_LAT_NR_OPS; op++) {
+			for (stage = 0; stage < BLK_LAT_NR_STAGES; stage++) {
+				if (blk_lat_hist_empty(sum, op, stage))
+					continue;
+				seq_printf(sf, "%s %s %s", dname,
+					   blk_lat_op_name[op],
+					   blk_lat_stage_name[stage]);
+				for (i = 0; i < BLK_LAT_BUCKETS; i++)
+					seq_printf(sf, " %llu",
+						   sum->buckets[op][stage][i]);
+				seq_putc(sf, '\n');
+			}
+		}
+next:
+		spin_unlock_irq(&blkg->q->queue_lock);
+	}
+	rcu_read_unlock();
+
+	kfree(sum);
+	return 0;
+}
+#endif /* CONFIG_BLK_CGROUP */
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef BLK_LAT_HIST_H
+#define BLK_LAT_HIST_H
+
+#include <linux/blk-cgroup.h>
+#include <linux/blk-mq.h>
+
+struct blkcg_gq;
+struct seq_file;
+
+#ifdef CONFIG_BLK_LAT_HIST
+
+enum blk_lat_op {
+	BLK_LAT_READ,
+	BLK_LAT_WRITE,
+	BLK_LAT_FLUSH,
+	BLK_LAT_DISCARD,
+	BLK_LAT_NR_OPS,
+};
+
+enum blk_lat_stage {
+	BLK_LAT_QUEUE,		/* allocation to dispatch to the driver */
+	BLK_LAT_DEVICE,		/* dispatch to completion */
+	BLK_LAT_TOTAL,		/* allocation to completion */
+	BLK_LAT_NR_STAGES,
+};
+
+#define BLK_LAT_BUCKETS		22	/* <1us .. >=1s */
+
+struct blk_lat_hist {
+	u64 buckets[BLK_LAT_NR_OPS][BLK_LAT_NR_STAGES][BLK_LAT_BUCKETS];
+};
+
+int blk_lat_hist_init_hctx(struct blk_mq_hw_ctx *hctx);
+void blk_lat_hist_exit_hctx(struct blk_mq_hw_ctx *hctx);
+ssize_t blk_lat_hist_hctx_show(struct blk_mq_hw_ctx *hctx, char *page);
+void blk_lat_hist_hctx_reset(struct blk_mq_hw_ctx *hctx);
+void blk_lat_hist_done(struct request *rq, u64 now);
+
+#ifdef CONFIG_BLK_CGROUP
+int blk_lat_hist_init_blkg(struct blkcg_gq *blkg, gfp_t gfp);
+void blk_lat_hist_exit_blkg(struct blkcg_gq *blkg);
+void blk_lat_hist_reset_blkg(struct blkcg_gq *blkg);
+int blk_lat_hist_blkcg_show(struct seq_file *sf, void *v);
+
+static inline void blk_lat_hist_bio_to_request(struct request *rq,
+					       struct bio *bio)
+{
+	if (bio->bi_blkg) {
+		blkg_get(bio->bi_blkg);
+		rq->lat_blkg = bio->bi_blkg;
+	}
+}
+
+static inline void blk_lat_hist_free_request(struct request *rq)
+{
+	if (rq->lat_blkg) {
+		blkg_put(rq->lat_blkg);
+		rq->lat_blkg = NULL;
+	}
+}
+#else
+static inline int blk_lat_hist_init_blkg(struct blkcg_gq *blkg, gfp_t gfp)
+{
+	return 0;
+}
+static inline void blk_lat_hist_exit_blkg(struct blkcg_gq *blkg) { }
+static inline void blk_lat_hist_reset_blkg(struct blkcg_gq *blkg) { }
+static inline void blk_lat_hist_bio_to_request(struct request *rq,
+					       struct bio *bio) { }
+static inline void blk_lat_hist_free_request(struct request *rq) { }
+#endif /* CONFIG_BLK_CGROUP */
+
+#else
+static inline int blk_lat_hist_init_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	return 0;
+}
+static inline void blk_lat_hist_exit_hctx(struct blk_mq_hw_ctx *hctx) { }
+static inline void blk_lat_hist_done(struct request *rq, u64 now) { }
+static inline int blk_lat_hist_init_blkg(struct blkcg_gq *blkg, gfp_t gfp)
+{
+	return 0;
+}
+static inline void blk_lat_hist_exit_blkg(struct blkcg_gq *blkg) { }
+static inline void blk_lat_hist_reset_blkg(struct blkcg_gq *blkg) { }
+static inline void blk_lat_hist_bio_to_request(struct request *rq,
+					       struct bio *bio) { }
+static inline void blk_lat_hist_free_request(struct request *rq) { }
+#endif /* CONFIG_BLK_LAT_HIST */
+
+#endif
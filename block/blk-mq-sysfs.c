@@ -14,6 +14,7 @@
 #include "blk.h"
 #include "blk-mq.h"
 #include "blk-mq-tag.h"
+#include "blk-lat-hist.h"
 
 static void blk_mq_sysfs_release(struct kobject *kobj)
 {
@@ -39,6 +40,7 @@ static void blk_mq_hw_sysfs_release(struct kobject *kobj)
 	if (hctx->flags & BLK_MQ_F_BLOCKING)
 		cleanup_srcu_struct(hctx->srcu);
 	blk_free_flush_queue(hctx->fq);
+	blk_lat_hist_exit_hctx(hctx);
 	sbitmap_free(&hctx->ctx_map);
 	free_cpumask_var(hctx->cpumask);
 	kfree(hctx->ctxs);
@@ -129,6 +131,17 @@ static ssize_t blk_mq_hw_sysfs_cpus_show(struct blk_mq_hw_ctx *hctx, char *page)
 	return pos + ret;
 }
 
+#ifdef CONFIG_BLK_LAT_HIST
+static ssize_t blk_mq_hw_sysfs_latency_hist_store(struct blk_mq_hw_ctx *hctx,
+						  const char *page,
+						  size_t length)
+{
+	/* Any write resets the histograms */
+	blk_lat_hist_hctx_reset(hctx);
+	return length;
+}
+#endif
+
 static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_nr_tags = {
 	.attr = {.name = "nr_tags", .mode = 0444 },
 	.show = blk_mq_hw_sysfs_nr_tags_show,
@@ -141,11 +154,21 @@ static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_cpus = {
 	.attr = {.name = "cpu_list", .mode = 0444 },
 	.show = blk_mq_hw_sysfs_cpus_show,
 };
+#ifdef CONFIG_BLK_LAT_HIST
+static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_latency_hist = {
+	.attr = {.name = "latency_hist", .mode = 0644 },
+	.show = blk_lat_hist_hctx_show,
+	.store = blk_mq_hw_sysfs_latency_hist_store,
+};
+#endif
 
 static struct attribute *default_hw_ctx_attrs[] = {
 	&blk_mq_hw_sysfs_nr_tags.attr,
 	&blk_mq_hw_sysfs_nr_reserved_tags.attr,
 	&blk_mq_hw_sysfs_cpus.attr,
+#ifdef CONFIG_BLK_LAT_HIST
+	&blk_mq_hw_sysfs_latency_hist.attr,
+#endif
 	NULL,
 };
 ATTRIBUTE_GROUPS(default_hw_ctx);
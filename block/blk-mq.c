@@ -36,6 +36,7 @@
 #include "blk-mq.h"
 #include "blk-mq-debugfs.h"
 #include "blk-mq-tag.h"
+#include "blk-lat-hist.h"
 #include "blk-pm.h"
 #include "blk-stat.h"
 #include "blk-mq-sched.h"
@@ -276,11 +277,12 @@ void blk_mq_wake_waiters(struct request_queue *q)
 
 /*
  * Only need start/end time stamping if we have iostat or
- * blk stats enabled, or using an IO scheduler.
+ * blk stats enabled, latency histograms, or using an IO scheduler.
  */
 static inline bool blk_mq_need_time_stamp(struct request *rq)
 {
-	return (rq->rq_flags & (RQF_IO_STAT | RQF_STATS)) || rq->q->elevator;
+	return (rq->rq_flags & (RQF_IO_STAT | RQF_STATS)) || rq->q->elevator ||
+		IS_ENABLED(CONFIG_BLK_LAT_HIST);
 }
 
 static struct request *blk_mq_rq_ctx_init(struct blk_mq_alloc_data *data,
@@ -320,6 +322,9 @@ static struct request *blk_mq_rq_ctx_init(struct blk_mq_alloc_data *data,
 	else
 		rq->start_time_ns = 0;
 	rq->io_start_time_ns = 0;
+#if defined(CONFIG_BLK_LAT_HIST) && defined(CONFIG_BLK_CGROUP)
+	rq->lat_blkg = NULL;
+#endif
 	rq->stats_sectors = 0;
 	rq->nr_phys_segments = 0;
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
@@ -507,6 +512,7 @@ static void __blk_mq_free_request(struct request *rq)
 	const int sched_tag = rq->internal_tag;
 
 	blk_crypto_free_request(rq);
+	blk_lat_hist_free_request(rq);
 	blk_pm_mark_last_busy(rq);
 	rq->mq_hctx = NULL;
 	if (rq->tag != BLK_MQ_NO_TAG)
@@ -563,6 +569,7 @@ inline void __blk_mq_end_request(struct request *rq, blk_status_t error)
 	blk_mq_sched_completed_request(rq, now);
 
 	blk_account_io_done(rq, now);
+	blk_lat_hist_done(rq, now);
 
 	if (rq->end_io) {
 		rq_qos_done(rq->q, rq);
@@ -733,6 +740,8 @@ void blk_mq_start_request(struct request *rq)
 		rq->stats_sectors = blk_rq_sectors(rq);
 		rq->rq_flags |= RQF_STATS;
 		rq_qos_issue(q, rq);
+	} else if (IS_ENABLED(CONFIG_BLK_LAT_HIST)) {
+		rq->io_start_time_ns = ktime_get_ns();
 	}
 
 	WARN_ON_ONCE(blk_mq_rq_state(rq) != MQ_RQ_IDLE);
@@ -1970,6 +1979,7 @@ static void blk_mq_bio_to_request(struct request *rq, struct bio *bio,
 	err = blk_crypto_rq_bio_prep(rq, bio, GFP_NOIO);
 	WARN_ON_ONCE(err);
 
+	blk_lat_hist_bio_to_request(rq, bio);
 	blk_account_io_start(rq);
 }
 
@@ -2813,12 +2823,17 @@ blk_mq_alloc_hctx(struct request_queue *q, struct blk_mq_tag_set *set,
 	if (!hctx->fq)
 		goto free_bitmap;
 
+	if (blk_lat_hist_init_hctx(hctx))
+		goto free_fq;
+
 	if (hctx->flags & BLK_MQ_F_BLOCKING)
 		init_srcu_struct(hctx->srcu);
 	blk_mq_hctx_kobj_init(hctx);
 
 	return hctx;
 
+ free_fq:
+	blk_free_flush_queue(hctx->fq);
  free_bitmap:
 	sbitmap_free(&hctx->ctx_map);
  free_ctxs:
@@ -23,6 +23,7 @@
 #include <linux/uaccess.h>
 #include <linux/highmem.h>
 #include <linux/sizes.h>
+#include <linux/log2.h>
 #include "binder_alloc.h"
 #include "binder_trace.h"
 #include <trace/hooks/binder.h>
@@ -66,18 +67,29 @@ static size_t binder_alloc_buffer_size(struct binder_alloc *alloc,
 	return binder_buffer_next(buffer)->user_data - buffer->user_data;
 }
 
+static unsigned int binder_free_bucket(size_t size)
+{
+	return min_t(unsigned int, ilog2(size), BINDER_FREE_BUCKETS - 1);
+}
+
 static void binder_insert_free_buffer(struct binder_alloc *alloc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &alloc->free_buffers.rb_node;
+	struct rb_root_cached *root;
+	struct rb_node **p;
 	struct rb_node *parent = NULL;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
 	size_t new_buffer_size;
+	unsigned int bucket;
+	bool leftmost = true;
 
 	BUG_ON(!new_buffer->free);
 
 	new_buffer_size = binder_alloc_buffer_size(alloc, new_buffer);
+	bucket = binder_free_bucket(new_buffer_size);
+	root = &alloc->free_buckets[bucket];
+	p = &root->rb_root.rb_node;
 
 	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "%d: add free buffer, size %zd, at %pK\n",
@@ -90,13 +102,74 @@ static void binder_insert_free_buffer(struct binder_alloc *alloc,
 
 		buffer_size = binder_alloc_buffer_size(alloc, buffer);
 
-		if (new_buffer_size < buffer_size)
+		if (new_buffer_size < buffer_size) {
 			p = &parent->rb_left;
-		else
+		} else {
 			p = &parent->rb_right;
+			leftmost = false;
+		}
 	}
 	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &alloc->free_buffers);
+	rb_insert_color_cached(&new_buffer->rb_node, root, leftmost);
+	__set_bit(bucket, alloc->free_bucket_map);
+}
+
+/*
+ * Must be called while @buffer is still linked into alloc->buffers with
+ * the neighbours it had when it was inserted, since the bucket is derived
+ * from its current size.
+ */
+static void binder_erase_free_buffer(struct binder_alloc *alloc,
+				     struct binder_buffer *buffer)
+{
+	unsigned int bucket;
+	struct rb_root_cached *root;
+
+	bucket = binder_free_bucket(binder_alloc_buffer_size(alloc, buffer));
+	root = &alloc->free_buckets[bucket];
+	rb_erase_cached(&buffer->rb_node, root);
+	if (RB_EMPTY_ROOT(&root->rb_root))
+		__clear_bit(bucket, alloc->free_bucket_map);
+}
+
+/*
+ * Best fit lookup: only the bucket that @size falls into needs an actual
+ * tree search, every buffer in a higher non-empty bucket is large enough
+ * so the smallest one there (the cached leftmost node) is the best fit.
+ */
+static struct binder_buffer *binder_find_free_buffer(struct binder_alloc *alloc,
+						     size_t size)
+{
+	unsigned int bucket = binder_free_bucket(size);
+	struct rb_node *n = alloc->free_buckets[bucket].rb_root.rb_node;
+	struct rb_node *best_fit = NULL;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+		buffer_size = binder_alloc_buffer_size(alloc, buffer);
+
+		if (size < buffer_size) {
+			best_fit = n;
+			n = n->rb_left;
+		} else if (size > buffer_size) {
+			n = n->rb_right;
+		} else {
+			best_fit = n;
+			break;
+		}
+	}
+
+	if (!best_fit) {
+		bucket = find_next_bit(alloc->free_bucket_map,
+				       BINDER_FREE_BUCKETS, bucket + 1);
+		if (bucket >= BINDER_FREE_BUCKETS)
+			return NULL;
+		best_fit = rb_first_cached(&alloc->free_buckets[bucket]);
+	}
+	return rb_entry(best_fit, struct binder_buffer, rb_node);
 }
 
 static void binder_insert_allocated_buffer_locked(
@@ -369,19 +442,15 @@ static bool debug_low_async_space_locked(struct binder_alloc *alloc, int pid)
 
 static struct binder_buffer *binder_alloc_new_buf_locked(
 				struct binder_alloc *alloc,
-				size_t data_size,
-				size_t offsets_size,
-				size_t extra_buffers_size,
+				size_t size,
 				int is_async,
 				int pid)
 {
-	struct rb_node *n = alloc->free_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
 	void __user *has_page_addr;
 	void __user *end_page_addr;
-	size_t size, data_offsets_size;
 	int ret;
 
 	/* Check binder_alloc is fully initialized */
@@ -392,22 +461,6 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 		return ERR_PTR(-ESRCH);
 	}
 
-	data_offsets_size = ALIGN(data_size, sizeof(void *)) +
-		ALIGN(offsets_size, sizeof(void *));
-
-	if (data_offsets_size < data_size || data_offsets_size < offsets_size) {
-		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
-				"%d: got transaction with invalid size %zd-%zd\n",
-				alloc->pid, data_size, offsets_size);
-		return ERR_PTR(-EINVAL);
-	}
-	size = data_offsets_size + ALIGN(extra_buffers_size, sizeof(void *));
-	if (size < data_offsets_size || size < extra_buffers_size) {
-		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
-				"%d: got transaction with invalid extra_buffers_size %zd\n",
-				alloc->pid, extra_buffers_size);
-		return ERR_PTR(-EINVAL);
-	}
 	trace_android_vh_binder_alloc_new_buf_locked(size, &alloc->free_async_space, is_async);
 	if (is_async &&
 	    alloc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -420,28 +473,15 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 	/* Pad 0-size buffers so they get assigned unique addresses */
 	size = max(size, sizeof(void *));
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_alloc_buffer_size(alloc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
+	buffer = binder_find_free_buffer(alloc, size);
+	if (buffer == NULL) {
 		size_t allocated_buffers = 0;
 		size_t largest_alloc_size = 0;
 		size_t total_alloc_size = 0;
 		size_t free_buffers = 0;
 		size_t largest_free_size = 0;
 		size_t total_free_size = 0;
+		unsigned int bucket;
 
 		for (n = rb_first(&alloc->allocated_buffers); n != NULL;
 		     n = rb_next(n)) {
@@ -452,14 +492,19 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 			if (buffer_size > largest_alloc_size)
 				largest_alloc_size = buffer_size;
 		}
-		for (n = rb_first(&alloc->free_buffers); n != NULL;
-		     n = rb_next(n)) {
-			buffer = rb_entry(n, struct binder_buffer, rb_node);
-			buffer_size = binder_alloc_buffer_size(alloc, buffer);
-			free_buffers++;
-			total_free_size += buffer_size;
-			if (buffer_size > largest_free_size)
-				largest_free_size = buffer_size;
+		for_each_set_bit(bucket, alloc->free_bucket_map,
+				 BINDER_FREE_BUCKETS) {
+			for (n = rb_first_cached(&alloc->free_buckets[bucket]);
+			     n != NULL; n = rb_next(n)) {
+				buffer = rb_entry(n, struct binder_buffer,
+						  rb_node);
+				buffer_size = binder_alloc_buffer_size(alloc,
+								       buffer);
+				free_buffers++;
+				total_free_size += buffer_size;
+				if (buffer_size > largest_free_size)
+					largest_free_size = buffer_size;
+			}
 		}
 		binder_alloc_debug(BINDER_DEBUG_USER_ERROR,
 				   "%d: binder_alloc_buf size %zd failed, no address space\n",
@@ -471,18 +516,21 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 				   free_buffers, largest_free_size);
 		return ERR_PTR(-ENOSPC);
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_alloc_buffer_size(alloc, buffer);
-	}
+	buffer_size = binder_alloc_buffer_size(alloc, buffer);
 
 	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "%d: binder_alloc_buf size %zd got buffer %pK size %zd\n",
 		      alloc->pid, size, buffer, buffer_size);
 
+	/* Only left empty by a racing split, so rarely allocated here */
+	if (buffer_size != size && !alloc->spare_buffer) {
+		alloc->spare_buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+		if (!alloc->spare_buffer)
+			return ERR_PTR(-ENOMEM);
+	}
+
 	has_page_addr = (void __user *)
 		(((uintptr_t)buffer->user_data + buffer_size) & PAGE_MASK);
-	WARN_ON(n && buffer_size != size);
 	end_page_addr =
 		(void __user *)PAGE_ALIGN((uintptr_t)buffer->user_data + size);
 	if (end_page_addr > has_page_addr)
@@ -492,32 +540,26 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 	if (ret)
 		return ERR_PTR(ret);
 
+	/* Unlink from the free index before the split changes our size */
+	binder_erase_free_buffer(alloc, buffer);
+
 	if (buffer_size != size) {
-		struct binder_buffer *new_buffer;
+		struct binder_buffer *split = alloc->spare_buffer;
 
-		new_buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
-		if (!new_buffer) {
-			pr_err("%s: %d failed to alloc new buffer struct\n",
-			       __func__, alloc->pid);
-			goto err_alloc_buf_struct_failed;
-		}
-		new_buffer->user_data = (u8 __user *)buffer->user_data + size;
-		list_add(&new_buffer->entry, &buffer->entry);
-		new_buffer->free = 1;
-		binder_insert_free_buffer(alloc, new_buffer);
+		alloc->spare_buffer = NULL;
+		split->user_data = (u8 __user *)buffer->user_data + size;
+		list_add(&split->entry, &buffer->entry);
+		split->free = 1;
+		binder_insert_free_buffer(alloc, split);
 	}
 
-	rb_erase(best_fit, &alloc->free_buffers);
 	buffer->free = 0;
 	buffer->allow_user_free = 0;
 	binder_insert_allocated_buffer_locked(alloc, buffer);
 	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "%d: binder_alloc_buf size %zd got %pK\n",
 		      alloc->pid, size, buffer);
-	buffer->data_size = data_size;
-	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
-	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->pid = pid;
 	buffer->oneway_spam_suspect = false;
 	if (is_async) {
@@ -537,12 +579,6 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
 		}
 	}
 	return buffer;
-
-err_alloc_buf_struct_failed:
-	binder_update_page_range(alloc, 0, (void __user *)
-				 PAGE_ALIGN((uintptr_t)buffer->user_data),
-				 end_page_addr);
-	return ERR_PTR(-ENOMEM);
 }
 
 /**
@@ -559,6 +595,11 @@ static struct binder_buffer *binder_alloc_new_buf_locked(
  * is the sum of the three given sizes (each rounded up to
  * pointer-sized boundary)
  *
+ * Size validation is done before taking alloc->mutex to keep the hold
+ * time short. A split uses the spare bookkeeping struct kept in
+ * alloc->spare_buffer, which is refilled here, outside the lock, only
+ * after a split has used it and no merge has given one back.
+ *
  * Return:	The allocated buffer or %NULL if error
  */
 struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
@@ -568,12 +609,49 @@ struct binder_buffer *binder_alloc_new_buf(struct binder_alloc *alloc,
 					   int is_async,
 					   int pid)
 {
-	struct binder_buffer *buffer;
+	struct binder_buffer *buffer, *new_buffer;
+	size_t size, data_offsets_size;
+
+	data_offsets_size = ALIGN(data_size, sizeof(void *)) +
+		ALIGN(offsets_size, sizeof(void *));
+
+	if (data_offsets_size < data_size || data_offsets_size < offsets_size) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				"%d: got transaction with invalid size %zd-%zd\n",
+				alloc->pid, data_size, offsets_size);
+		return ERR_PTR(-EINVAL);
+	}
+	size = data_offsets_size + ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < data_offsets_size || size < extra_buffers_size) {
+		binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				"%d: got transaction with invalid extra_buffers_size %zd\n",
+				alloc->pid, extra_buffers_size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	new_buffer = NULL;
+	if (!READ_ONCE(alloc->spare_buffer)) {
+		new_buffer = kzalloc(sizeof(*new_buffer), GFP_KERNEL);
+		if (!new_buffer) {
+			pr_err("%s: %d failed to alloc new buffer struct\n",
+			       __func__, alloc->pid);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
 
 	mutex_lock(&alloc->mutex);
-	buffer = binder_alloc_new_buf_locked(alloc, data_size, offsets_size,
-					     extra_buffers_size, is_async, pid);
+	if (new_buffer && !alloc->spare_buffer) {
+		alloc->spare_buffer = new_buffer;
+		new_buffer = NULL;
+	}
+	buffer = binder_alloc_new_buf_locked(alloc, size, is_async, pid);
+	if (!IS_ERR(buffer)) {
+		buffer->data_size = data_size;
+		buffer->offsets_size = offsets_size;
+		buffer->extra_buffers_size = extra_buffers_size;
+	}
 	mutex_unlock(&alloc->mutex);
+	kfree(new_buffer);
 	return buffer;
 }
 
@@ -634,7 +712,12 @@ static void binder_delete_free_buffer(struct binder_alloc *alloc,
 					 buffer_start_page(buffer) + PAGE_SIZE);
 	}
 	list_del(&buffer->entry);
-	kfree(buffer);
+	if (!alloc->spare_buffer) {
+		memset(buffer, 0, sizeof(*buffer));
+		alloc->spare_buffer = buffer;
+	} else {
+		kfree(buffer);
+	}
 }
 
 static void binder_free_buf_locked(struct binder_alloc *alloc,
@@ -677,7 +760,7 @@ static void binder_free_buf_locked(struct binder_alloc *alloc,
 		struct binder_buffer *next = binder_buffer_next(buffer);
 
 		if (next->free) {
-			rb_erase(&next->rb_node, &alloc->free_buffers);
+			binder_erase_free_buffer(alloc, next);
 			binder_delete_free_buffer(alloc, next);
 		}
 	}
@@ -685,8 +768,8 @@ static void binder_free_buf_locked(struct binder_alloc *alloc,
 		struct binder_buffer *prev = binder_buffer_prev(buffer);
 
 		if (prev->free) {
+			binder_erase_free_buffer(alloc, prev);
 			binder_delete_free_buffer(alloc, buffer);
-			rb_erase(&prev->rb_node, &alloc->free_buffers);
 			buffer = prev;
 		}
 	}
@@ -838,6 +921,8 @@ void binder_alloc_deferred_release(struct binder_alloc *alloc)
 		WARN_ON_ONCE(!list_empty(&alloc->buffers));
 		kfree(buffer);
 	}
+	kfree(alloc->spare_buffer);
+	alloc->spare_buffer = NULL;
 
 	page_count = 0;
 	if (alloc->pages) {
@@ -1074,17 +1159,25 @@ static struct shrinker binder_shrinker = {
  */
 void binder_alloc_init(struct binder_alloc *alloc)
 {
+	int i;
+
 	alloc->pid = current->group_leader->pid;
 	alloc->vma_vm_mm = current->mm;
 	mmgrab(alloc->vma_vm_mm);
 	mutex_init(&alloc->mutex);
 	INIT_LIST_HEAD(&alloc->buffers);
+	for (i = 0; i < BINDER_FREE_BUCKETS; i++)
+		alloc->free_buckets[i] = RB_ROOT_CACHED;
+	bitmap_zero(alloc->free_bucket_map, BINDER_FREE_BUCKETS);
 }
 
 int binder_alloc_shrinker_init(void)
 {
-	int ret = list_lru_init(&binder_alloc_lru);
+	int ret;
+
+	BUILD_BUG_ON(BINDER_FREE_BUCKETS != ilog2(SZ_4M) + 1);
 
+	ret = list_lru_init(&binder_alloc_lru);
 	if (ret == 0) {
 		ret = register_shrinker(&binder_shrinker);
 		if (ret)
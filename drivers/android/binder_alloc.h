@@ -18,10 +18,17 @@
 extern struct list_lru binder_alloc_lru;
 struct binder_transaction;
 
+/*
+ * Free buffers are segregated by size into power-of-two buckets, so
+ * bucket n holds buffers whose size is in [2^n, 2^(n+1)). The mmap'd
+ * area is capped at SZ_4M, so the last bucket covers the whole space.
+ */
+#define BINDER_FREE_BUCKETS	23	/* ilog2(SZ_4M) + 1 */
+
 /**
  * struct binder_buffer - buffer used for binder transactions
  * @entry:              entry alloc->buffers
- * @rb_node:            node for allocated_buffers/free_buffers rb trees
+ * @rb_node:            node for allocated_buffers/free_buckets rb trees
  * @free:               %true if buffer is free
  * @clear_on_free:      %true if buffer must be zeroed after use
  * @allow_user_free:    %true if user is allowed to free buffer
@@ -81,9 +88,11 @@ struct binder_lru_page {
  * @vma_vm_mm:          copy of vma->vm_mm (invarient after mmap)
  * @buffer:             base of per-proc address space mapped via mmap
  * @buffers:            list of all buffers for this proc
- * @free_buffers:       rb tree of buffers available for allocation
- *                      sorted by size
+ * @free_buckets:       size-segregated rb trees of buffers available for
+ *                      allocation, each sorted by size
+ * @free_bucket_map:    bitmap of non-empty entries in @free_buckets
  * @allocated_buffers:  rb tree of allocated buffers sorted by address
+ * @spare_buffer:       unused struct binder_buffer kept for the next split
  * @free_async_space:   VA space available for async buffers. This is
  *                      initialized at mmap time to 1/2 the full VA space
  * @pages:              array of binder_lru_page
@@ -104,8 +113,10 @@ struct binder_alloc {
 	struct mm_struct *vma_vm_mm;
 	void __user *buffer;
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct rb_root_cached free_buckets[BINDER_FREE_BUCKETS];
+	DECLARE_BITMAP(free_bucket_map, BINDER_FREE_BUCKETS);
 	struct rb_root allocated_buffers;
+	struct binder_buffer *spare_buffer;
 	size_t free_async_space;
 	struct binder_lru_page *pages;
 	size_t buffer_size;
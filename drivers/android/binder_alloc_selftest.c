@@ -10,11 +10,17 @@
 
 #include <linux/mm_types.h>
 #include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/prandom.h>
+#include <linux/sort.h>
 #include "binder_alloc.h"
 
 #define BUFFER_NUM 5
 #define BUFFER_MIN_SIZE (PAGE_SIZE / 8)
 
+#define STRESS_ITERATIONS 4096
+#define STRESS_LIVE_BUFFERS 256
+
 static bool binder_selftest_run = true;
 static int binder_selftest_failures;
 static DEFINE_MUTEX(binder_selftest_lock);
@@ -271,6 +277,83 @@ static void binder_selftest_alloc_offset(struct binder_alloc *alloc,
 	}
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * binder_selftest_alloc_stress() - Benchmark allocation under fragmentation.
+ * @alloc: Pointer to alloc struct.
+ *
+ * Keep up to STRESS_LIVE_BUFFERS buffers of random size outstanding, half
+ * of them async, freeing a random one whenever the limit is reached, the
+ * way a process with many in-flight oneway transactions fragments its
+ * space. Report the latency percentiles of binder_alloc_new_buf().
+ */
+static void binder_selftest_alloc_stress(struct binder_alloc *alloc)
+{
+	struct binder_buffer **live;
+	struct binder_buffer *buffer;
+	size_t max_size;
+	int nr_live = 0;
+	int nr_lat = 0;
+	int nr_nospc = 0;
+	u64 *lat;
+	u64 start;
+	int i;
+
+	live = kcalloc(STRESS_LIVE_BUFFERS, sizeof(*live), GFP_KERNEL);
+	lat = kvmalloc_array(STRESS_ITERATIONS, sizeof(*lat), GFP_KERNEL);
+	if (!live || !lat) {
+		pr_err("stress: failed to allocate bookkeeping\n");
+		binder_selftest_failures++;
+		goto out;
+	}
+
+	max_size = alloc->buffer_size / STRESS_LIVE_BUFFERS;
+	for (i = 0; i < STRESS_ITERATIONS; i++) {
+		if (nr_live == STRESS_LIVE_BUFFERS) {
+			int victim = prandom_u32_max(nr_live);
+
+			binder_alloc_free_buf(alloc, live[victim]);
+			live[victim] = live[--nr_live];
+		}
+
+		start = ktime_get_ns();
+		buffer = binder_alloc_new_buf(alloc,
+					      prandom_u32_max(max_size) + 1,
+					      0, 0, i & 1, 0);
+		lat[nr_lat++] = ktime_get_ns() - start;
+
+		if (IS_ERR(buffer)) {
+			if (PTR_ERR(buffer) != -ENOSPC) {
+				pr_err("stress: alloc failed %ld\n",
+				       PTR_ERR(buffer));
+				binder_selftest_failures++;
+				break;
+			}
+			nr_nospc++;
+			continue;
+		}
+		live[nr_live++] = buffer;
+	}
+
+	while (nr_live)
+		binder_alloc_free_buf(alloc, live[--nr_live]);
+	binder_selftest_free_page(alloc);
+
+	sort(lat, nr_lat, sizeof(*lat), cmp_u64, NULL);
+	pr_info("stress: %d allocs (%d ENOSPC), latency ns p50 %llu p90 %llu p99 %llu max %llu\n",
+		nr_lat, nr_nospc, lat[nr_lat / 2], lat[nr_lat * 9 / 10],
+		lat[nr_lat * 99 / 100], lat[nr_lat - 1]);
+out:
+	kvfree(lat);
+	kfree(live);
+}
+
 /**
  * binder_selftest_alloc() - Test alloc and free of buffer pages.
  * @alloc: Pointer to alloc struct.
@@ -278,7 +361,8 @@ static void binder_selftest_alloc_offset(struct binder_alloc *alloc,
  * Allocate BUFFER_NUM buffers to cover all page alignment cases,
  * then free them in all orders possible. Check that pages are
  * correctly allocated, put onto lru when buffers are freed, and
- * are freed when binder_alloc_free_page is called.
+ * are freed when binder_alloc_free_page is called. Finish with a
+ * randomized stress run that reports allocation latency percentiles.
  */
 void binder_selftest_alloc(struct binder_alloc *alloc)
 {
@@ -291,6 +375,7 @@ void binder_selftest_alloc(struct binder_alloc *alloc)
 		goto done;
 	pr_info("STARTED\n");
 	binder_selftest_alloc_offset(alloc, end_offset, 0);
+	binder_selftest_alloc_stress(alloc);
 	binder_selftest_run = false;
 	if (binder_selftest_failures > 0)
 		pr_info("%d tests FAILED\n", binder_selftest_failures);
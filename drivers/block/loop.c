@@ -135,6 +135,14 @@ static void loop_global_unlock(struct loop_device *lo, bool global)
 static int max_part;
 static int part_shift;
 
+static unsigned int nr_hw_queues = 4;
+module_param(nr_hw_queues, uint, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues per loop device (default: 4)");
+
+static bool dio_default = true;
+module_param(dio_default, bool, 0644);
+MODULE_PARM_DESC(dio_default, "Use direct I/O to the backing file whenever its alignment allows (default: true)");
+
 static int transfer_xor(struct loop_device *lo, int cmd,
 			struct page *raw_page, unsigned raw_off,
 			struct page *loop_page, unsigned loop_off,
@@ -1063,8 +1071,11 @@ static void loop_queue_work(struct loop_device *lo, struct loop_cmd *cmd)
 		work = &worker->work;
 		cmd_list = &worker->cmd_list;
 	} else {
-		work = &lo->rootcg_work;
-		cmd_list = &lo->rootcg_cmd_list;
+		struct loop_hctx *lh =
+			blk_mq_rq_from_pdu(cmd)->mq_hctx->driver_data;
+
+		work = &lh->rootcg_work;
+		cmd_list = &lh->rootcg_cmd_list;
 	}
 	list_add_tail(&cmd->list_entry, cmd_list);
 	queue_work(lo->workqueue, work);
@@ -1207,6 +1218,7 @@ static int loop_configure(struct loop_device *lo, fmode_t mode,
 	bool partscan;
 	unsigned short bsize;
 	bool is_loop;
+	bool want_dio;
 
 	if (!file)
 		return -EBADF;
@@ -1274,13 +1286,14 @@ static int loop_configure(struct loop_device *lo, fmode_t mode,
 	disk_force_media_change(lo->lo_disk, DISK_EVENT_MEDIA_CHANGE);
 	set_disk_ro(lo->lo_disk, (lo->lo_flags & LO_FLAGS_READ_ONLY) != 0);
 
-	INIT_WORK(&lo->rootcg_work, loop_rootcg_workfn);
-	INIT_LIST_HEAD(&lo->rootcg_cmd_list);
 	INIT_LIST_HEAD(&lo->idle_worker_list);
 	lo->worker_tree = RB_ROOT;
 	timer_setup(&lo->timer, loop_free_idle_workers,
 		TIMER_DEFERRABLE);
-	lo->use_dio = lo->lo_flags & LO_FLAGS_DIRECT_IO;
+	want_dio = dio_default || (lo->lo_flags & LO_FLAGS_DIRECT_IO) ||
+		   (file->f_flags & O_DIRECT);
+	lo->use_dio = false;
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
 	lo->lo_device = bdev;
 	lo->lo_backing_file = file;
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
@@ -1303,7 +1316,7 @@ static int loop_configure(struct loop_device *lo, fmode_t mode,
 
 	loop_config_discard(lo);
 	loop_update_rotational(lo);
-	loop_update_dio(lo);
+	__loop_update_dio(lo, want_dio);
 	loop_sysfs_init(lo);
 
 	size = get_loop_size(lo, file);
@@ -2303,9 +2316,9 @@ static void loop_workfn(struct work_struct *work)
 
 static void loop_rootcg_workfn(struct work_struct *work)
 {
-	struct loop_device *lo =
-		container_of(work, struct loop_device, rootcg_work);
-	loop_process_work(NULL, &lo->rootcg_cmd_list, lo);
+	struct loop_hctx *lh =
+		container_of(work, struct loop_hctx, rootcg_work);
+	loop_process_work(NULL, &lh->rootcg_cmd_list, lh->lo);
 }
 
 static void loop_free_idle_workers(struct timer_list *timer)
@@ -2329,9 +2342,36 @@ static void loop_free_idle_workers(struct timer_list *timer)
 	spin_unlock_irq(&lo->lo_work_lock);
 }
 
+/*
+ * Each hardware queue has its own worker for root cgroup I/O, so that
+ * requests on different queues are issued to the backing file in parallel.
+ */
+static int loop_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int hctx_idx)
+{
+	struct loop_hctx *lh;
+
+	lh = kzalloc_node(sizeof(*lh), GFP_KERNEL, hctx->numa_node);
+	if (!lh)
+		return -ENOMEM;
+	INIT_WORK(&lh->rootcg_work, loop_rootcg_workfn);
+	INIT_LIST_HEAD(&lh->rootcg_cmd_list);
+	lh->lo = data;
+	hctx->driver_data = lh;
+	return 0;
+}
+
+static void loop_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
+}
+
 static const struct blk_mq_ops loop_mq_ops = {
 	.queue_rq       = loop_queue_rq,
 	.complete	= lo_complete_rq,
+	.init_hctx	= loop_init_hctx,
+	.exit_hctx	= loop_exit_hctx,
 };
 
 static int loop_add(int i)
@@ -2365,7 +2405,8 @@ static int loop_add(int i)
 
 	err = -ENOMEM;
 	lo->tag_set.ops = &loop_mq_ops;
-	lo->tag_set.nr_hw_queues = 1;
+	lo->tag_set.nr_hw_queues = clamp_t(unsigned int, nr_hw_queues, 1,
+					   nr_cpu_ids);
 	lo->tag_set.queue_depth = 128;
 	lo->tag_set.numa_node = NUMA_NO_NODE;
 	lo->tag_set.cmd_size = sizeof(struct loop_cmd);
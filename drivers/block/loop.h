@@ -56,8 +56,6 @@ struct loop_device {
 	int			lo_state;
 	spinlock_t              lo_work_lock;
 	struct workqueue_struct *workqueue;
-	struct work_struct      rootcg_work;
-	struct list_head        rootcg_cmd_list;
 	struct list_head        idle_worker_list;
 	struct rb_root          worker_tree;
 	struct timer_list       timer;
@@ -71,6 +69,12 @@ struct loop_device {
 	bool			idr_visible;
 };
 
+struct loop_hctx {
+	struct work_struct	rootcg_work;
+	struct list_head	rootcg_cmd_list;
+	struct loop_device	*lo;
+};
+
 struct loop_cmd {
 	struct list_head list_entry;
 	bool use_aio; /* use AIO interface to handle I/O */
@@ -9,6 +9,7 @@
 
 #include <linux/crc32.h>
 #include <linux/dm-bufio.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 
 #define DM_MSG_PREFIX "bow"
@@ -92,6 +93,27 @@ struct bow_context {
 	struct log_sector *log_sector;
 	struct list_head trimmed_list;
 	bool forward_trims;
+
+	/*
+	 * Checkpoint writes are queued here and handled in batches by a single
+	 * work item, see bow_write()
+	 */
+	spinlock_t write_lock;
+	struct bio_list write_list;
+	struct work_struct write_work;
+
+	/* Set while a batch defers its backup and log writes */
+	bool defer_writes;
+	bool log_dirty;
+
+	/* Checkpoint statistics, under ranges_lock */
+	ktime_t checkpoint_start;
+	u64 writes;
+	u64 write_bytes;
+	u64 backups;
+	u64 backup_bytes;
+	u64 batches;
+	u64 log_writes;
 };
 
 sector_t range_top(struct bow_range *br)
@@ -316,7 +338,8 @@ static int copy_data(struct bow_context const *bc,
 		dm_bufio_release(read_buffer);
 	}
 
-	dm_bufio_write_dirty_buffers(bc->bufio);
+	if (!bc->defer_writes)
+		dm_bufio_write_dirty_buffers(bc->bufio);
 	return BLK_STS_OK;
 }
 
@@ -324,6 +347,7 @@ static int copy_data(struct bow_context const *bc,
 
 static int add_log_entry(struct bow_context *bc, sector_t source, sector_t dest,
 			 unsigned int size, u32 checksum);
+static int flush_batch(struct bow_context *bc);
 
 static int backup_log_sector(struct bow_context *bc)
 {
@@ -373,39 +397,78 @@ static int backup_log_sector(struct bow_context *bc)
 	return BLK_STS_OK;
 }
 
-static int add_log_entry(struct bow_context *bc, sector_t source, sector_t dest,
-			 unsigned int size, u32 checksum)
+static int write_log_sector(struct bow_context *bc)
 {
 	struct dm_buffer *sector_buffer;
 	u8 *sector;
 
+	sector = dm_bufio_new(bc->bufio, 0, &sector_buffer);
+	if (IS_ERR(sector)) {
+		DMERR("Cannot write boot sector");
+		return BLK_STS_NOSPC;
+	}
+
+	memcpy(sector, bc->log_sector, bc->block_size);
+	dm_bufio_mark_buffer_dirty(sector_buffer);
+	dm_bufio_release(sector_buffer);
+	dm_bufio_write_dirty_buffers(bc->bufio);
+	bc->log_writes++;
+	return BLK_STS_OK;
+}
+
+static int add_log_entry(struct bow_context *bc, sector_t source, sector_t dest,
+			 unsigned int size, u32 checksum)
+{
 	if (sizeof(struct log_sector)
 	    + sizeof(struct log_entry) * (bc->log_sector->count + 1)
 		> bc->block_size) {
-		int ret = backup_log_sector(bc);
+		int ret;
+
+		/*
+		 * The full log sector is about to be backed up, which reads
+		 * it through bufio, so it has to be written out first.
+		 */
+		if (bc->defer_writes) {
+			ret = flush_batch(bc);
+			if (ret)
+				return ret;
+		}
 
+		ret = backup_log_sector(bc);
 		if (ret)
 			return ret;
 	}
 
-	sector = dm_bufio_new(bc->bufio, 0, &sector_buffer);
-	if (IS_ERR(sector)) {
-		DMERR("Cannot write boot sector");
-		dm_bufio_release(sector_buffer);
-		return BLK_STS_NOSPC;
-	}
-
 	bc->log_sector->entries[bc->log_sector->count].source = source;
 	bc->log_sector->entries[bc->log_sector->count].dest = dest;
 	bc->log_sector->entries[bc->log_sector->count].size = size;
 	bc->log_sector->entries[bc->log_sector->count].checksum = checksum;
 	bc->log_sector->count++;
 
-	memcpy(sector, bc->log_sector, bc->block_size);
-	dm_bufio_mark_buffer_dirty(sector_buffer);
-	dm_bufio_release(sector_buffer);
-	dm_bufio_write_dirty_buffers(bc->bufio);
-	return BLK_STS_OK;
+	if (bc->defer_writes) {
+		bc->log_dirty = true;
+		return BLK_STS_OK;
+	}
+
+	return write_log_sector(bc);
+}
+
+/*
+ * Write out the backups made by the current batch, and only then the log
+ * sector that records them, so that the log never refers to a backup that
+ * is not on disk. Neither is ordered against the batch's own writes, which
+ * are not submitted until this returns.
+ */
+static int flush_batch(struct bow_context *bc)
+{
+	if (dm_bufio_write_dirty_buffers(bc->bufio))
+		return BLK_STS_IOERR;
+
+	if (!bc->log_dirty)
+		return BLK_STS_OK;
+
+	bc->log_dirty = false;
+	return write_log_sector(bc);
 }
 
 static int prepare_log(struct bow_context *bc)
@@ -556,6 +619,8 @@ static ssize_t state_store(struct kobject *kobj, struct kobj_attribute *attr,
 			goto bad;
 		}
 	}
+	if (state == CHECKPOINT)
+		bc->checkpoint_start = ktime_get();
 	atomic_inc(&bc->state);
 	ret = count;
 
@@ -578,12 +643,43 @@ static ssize_t free_show(struct kobject *kobj, struct kobj_attribute *attr,
 	return scnprintf(buf, PAGE_SIZE, "%llu\n", trims_total);
 }
 
+/*
+ * Writes seen in checkpoint state, how much of the device had to be backed
+ * up for them, and how many batches and log sector writes that took.
+ * checkpoint_ms is the time spent in checkpoint state so far.
+ */
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr,
+			  char *buf)
+{
+	struct bow_context *bc = container_of(kobj, struct bow_context,
+					      kobj_holder.kobj);
+	s64 checkpoint_ms = 0;
+	ssize_t len;
+
+	mutex_lock(&bc->ranges_lock);
+	if (atomic_read(&bc->state) == CHECKPOINT)
+		checkpoint_ms = ktime_ms_delta(ktime_get(),
+					       bc->checkpoint_start);
+	len = scnprintf(buf, PAGE_SIZE,
+			"writes %llu\nwrite_bytes %llu\nbackups %llu\n"
+			"backup_bytes %llu\nbatches %llu\nlog_writes %llu\n"
+			"checkpoint_ms %lld\n",
+			bc->writes, bc->write_bytes, bc->backups,
+			bc->backup_bytes, bc->batches, bc->log_writes,
+			checkpoint_ms);
+	mutex_unlock(&bc->ranges_lock);
+
+	return len;
+}
+
 static struct kobj_attribute attr_state = __ATTR_RW(state);
 static struct kobj_attribute attr_free = __ATTR_RO(free);
+static struct kobj_attribute attr_stats = __ATTR_RO(stats);
 
 static struct attribute *bow_attrs[] = {
 	&attr_state.attr,
 	&attr_free.attr,
+	&attr_stats.attr,
 	NULL
 };
 
@@ -595,6 +691,8 @@ static struct kobj_type bow_ktype = {
 
 /****** constructor/destructor ******/
 
+static void bow_write(struct work_struct *work);
+
 static void dm_bow_dtr(struct dm_target *ti)
 {
 	struct bow_context *bc = (struct bow_context *) ti->private;
@@ -735,6 +833,9 @@ static int dm_bow_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 
 	init_completion(&bc->kobj_holder.completion);
 	mutex_init(&bc->ranges_lock);
+	spin_lock_init(&bc->write_lock);
+	bio_list_init(&bc->write_list);
+	INIT_WORK(&bc->write_work, bow_write);
 	bc->ranges = RB_ROOT;
 	bc->bufio = dm_bufio_client_create(bc->dev->bdev, bc->block_size, 1, 0,
 					   NULL, NULL);
@@ -851,6 +952,8 @@ static int prepare_unchanged_range(struct bow_context *bc, struct bow_range *br,
 	ret = copy_data(bc, br, backup_br, record_checksum ? &checksum : NULL);
 	if (ret)
 		return ret;
+	bc->backups++;
+	bc->backup_bytes += range_size(br);
 
 	/* Add an entry to the log */
 	log_source = br->sector;
@@ -940,23 +1043,11 @@ static int prepare_one_range(struct bow_context *bc,
 	}
 }
 
-struct write_work {
-	struct work_struct work;
-	struct bow_context *bc;
-	struct bio *bio;
-};
-
-static void bow_write(struct work_struct *work)
+static int prepare_bio(struct bow_context *bc, struct bio *bio)
 {
-	struct write_work *ww = container_of(work, struct write_work, work);
-	struct bow_context *bc = ww->bc;
-	struct bio *bio = ww->bio;
 	struct bvec_iter bi_iter = bio->bi_iter;
-	int ret = BLK_STS_OK;
-
-	kfree(ww);
+	int ret;
 
-	mutex_lock(&bc->ranges_lock);
 	do {
 		ret = prepare_one_range(bc, &bi_iter);
 		bi_iter.bi_sector += bi_iter.bi_size / SECTOR_SIZE;
@@ -965,31 +1056,69 @@ static void bow_write(struct work_struct *work)
 			  * SECTOR_SIZE;
 	} while (!ret && bi_iter.bi_size);
 
+	return ret;
+}
+
+/*
+ * Handles every write queued since the last run as one batch. The ranges of
+ * all of them are backed up with the backup and log writes deferred, then a
+ * single flush_batch() writes the backups followed by one log sector update
+ * before the writes themselves are submitted. Writes that arrive while a
+ * batch is being flushed make up the next one.
+ */
+static void bow_write(struct work_struct *work)
+{
+	struct bow_context *bc = container_of(work, struct bow_context,
+					      write_work);
+	struct bio_list bios, ready;
+	struct bio *bio;
+	int ret;
+
+	bio_list_init(&bios);
+	bio_list_init(&ready);
+	spin_lock_irq(&bc->write_lock);
+	bio_list_merge(&bios, &bc->write_list);
+	bio_list_init(&bc->write_list);
+	spin_unlock_irq(&bc->write_lock);
+
+	mutex_lock(&bc->ranges_lock);
+	bc->defer_writes = true;
+	bc->batches++;
+	while ((bio = bio_list_pop(&bios))) {
+		ret = prepare_bio(bc, bio);
+		if (ret) {
+			DMERR("Write failure with error %d", -ret);
+			bio->bi_status = ret;
+			bio_endio(bio);
+			continue;
+		}
+		bc->writes++;
+		bc->write_bytes += bio->bi_iter.bi_size;
+		bio_list_add(&ready, bio);
+	}
+	ret = flush_batch(bc);
+	bc->defer_writes = false;
 	mutex_unlock(&bc->ranges_lock);
 
-	if (!ret) {
-		bio_set_dev(bio, bc->dev->bdev);
-		submit_bio(bio);
-	} else {
-		DMERR("Write failure with error %d", -ret);
-		bio->bi_status = ret;
-		bio_endio(bio);
+	while ((bio = bio_list_pop(&ready))) {
+		if (!ret) {
+			bio_set_dev(bio, bc->dev->bdev);
+			submit_bio(bio);
+		} else {
+			DMERR("Write failure with error %d", -ret);
+			bio->bi_status = ret;
+			bio_endio(bio);
+		}
 	}
 }
 
 static int queue_write(struct bow_context *bc, struct bio *bio)
 {
-	struct write_work *ww = kmalloc(sizeof(*ww), GFP_NOIO | __GFP_NORETRY
-					| __GFP_NOMEMALLOC | __GFP_NOWARN);
-	if (!ww) {
-		DMERR("Failed to allocate write_work");
-		return -ENOMEM;
-	}
+	spin_lock_irq(&bc->write_lock);
+	bio_list_add(&bc->write_list, bio);
+	spin_unlock_irq(&bc->write_lock);
 
-	INIT_WORK(&ww->work, bow_write);
-	ww->bc = bc;
-	ww->bio = bio;
-	queue_work(bc->workqueue, &ww->work);
+	queue_work(bc->workqueue, &bc->write_work);
 	return DM_MAPIO_SUBMITTED;
 }
 
@@ -1276,7 +1405,7 @@ static int dm_bow_iterate_devices(struct dm_target *ti,
 
 static struct target_type bow_target = {
 	.name   = "bow",
-	.version = {1, 2, 0},
+	.version = {1, 3, 0},
 	.features = DM_TARGET_PASSES_CRYPTO,
 	.module = THIS_MODULE,
 	.ctr    = dm_bow_ctr,
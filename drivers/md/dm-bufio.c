@@ -66,9 +66,20 @@
 #define LIST_DIRTY	1
 #define LIST_SIZE	2
 
+/*
+ * The buffer index is split into this many trees, by block number, each
+ * with its own lock.
+ */
+#define DM_BUFIO_TREE_SHARDS	64
+
 /*
  * Linking of buffers:
- *	All buffers are linked to buffer_tree with their node field.
+ *	All buffers are linked to one of the buffer trees with their node
+ *	field.  The trees are only changed with both c->lock and the tree's
+ *	write lock held.  dm_bufio_get/read/new look up existing buffers
+ *	and take a hold on them under the tree's read lock only, so anyone
+ *	who frees a buffer must recheck hold_count under the write lock
+ *	(__try_unlink_buffer).
  *
  *	Clean buffers that are not being written (B_WRITING not set)
  *	are linked to lru[LIST_CLEAN] with their lru_list field.
@@ -81,6 +92,11 @@
  *	dirty_lru too.  They are later added to lru in the process
  *	context.
  */
+struct buffer_tree {
+	rwlock_t lock;
+	struct rb_root root;
+} ____cacheline_aligned_in_smp;
+
 struct dm_bufio_client {
 	struct mutex lock;
 
@@ -102,8 +118,9 @@ struct dm_bufio_client {
 
 	unsigned minimum_buffers;
 
-	struct rb_root buffer_tree;
+	struct buffer_tree trees[DM_BUFIO_TREE_SHARDS];
 	wait_queue_head_t free_buffer_wait;
+	atomic_t nr_waiters;
 
 	sector_t start;
 
@@ -146,7 +163,8 @@ struct dm_buffer {
 	blk_status_t read_error;
 	blk_status_t write_error;
 	unsigned accessed;
-	unsigned hold_count;
+	bool referenced;
+	atomic_t hold_count;
 	unsigned long state;
 	unsigned long last_accessed;
 	unsigned dirty_start;
@@ -248,11 +266,17 @@ static void buffer_record_stack(struct dm_buffer *b)
 #endif
 
 /*----------------------------------------------------------------
- * A red/black tree acts as an index for all the buffers.
+ * Red/black trees, sharded by block number, act as an index for all
+ * the buffers.
  *--------------------------------------------------------------*/
+static struct buffer_tree *buffer_tree(struct dm_bufio_client *c, sector_t block)
+{
+	return &c->trees[block & (DM_BUFIO_TREE_SHARDS - 1)];
+}
+
 static struct dm_buffer *__find(struct dm_bufio_client *c, sector_t block)
 {
-	struct rb_node *n = c->buffer_tree.rb_node;
+	struct rb_node *n = buffer_tree(c, block)->root.rb_node;
 	struct dm_buffer *b;
 
 	while (n) {
@@ -267,9 +291,9 @@ static struct dm_buffer *__find(struct dm_bufio_client *c, sector_t block)
 	return NULL;
 }
 
-static struct dm_buffer *__find_next(struct dm_bufio_client *c, sector_t block)
+static struct dm_buffer *__find_next_in_tree(struct buffer_tree *t, sector_t block)
 {
-	struct rb_node *n = c->buffer_tree.rb_node;
+	struct rb_node *n = t->root.rb_node;
 	struct dm_buffer *b;
 	struct dm_buffer *best = NULL;
 
@@ -290,17 +314,37 @@ static struct dm_buffer *__find_next(struct dm_bufio_client *c, sector_t block)
 	return best;
 }
 
+/*
+ * The lowest block >= "block" over all the trees.
+ */
+static struct dm_buffer *__find_next(struct dm_bufio_client *c, sector_t block)
+{
+	struct dm_buffer *b, *best = NULL;
+	unsigned i;
+
+	for (i = 0; i < DM_BUFIO_TREE_SHARDS; i++) {
+		b = __find_next_in_tree(&c->trees[i], block);
+		if (b && (!best || b->block < best->block))
+			best = b;
+	}
+
+	return best;
+}
+
 static void __insert(struct dm_bufio_client *c, struct dm_buffer *b)
 {
-	struct rb_node **new = &c->buffer_tree.rb_node, *parent = NULL;
+	struct buffer_tree *t = buffer_tree(c, b->block);
+	struct rb_node **new = &t->root.rb_node, *parent = NULL;
 	struct dm_buffer *found;
 
+	write_lock(&t->lock);
+
 	while (*new) {
 		found = container_of(*new, struct dm_buffer, node);
 
 		if (found->block == b->block) {
 			BUG_ON(found != b);
-			return;
+			goto out;
 		}
 
 		parent = *new;
@@ -309,12 +353,18 @@ static void __insert(struct dm_bufio_client *c, struct dm_buffer *b)
 	}
 
 	rb_link_node(&b->node, parent, new);
-	rb_insert_color(&b->node, &c->buffer_tree);
+	rb_insert_color(&b->node, &t->root);
+out:
+	write_unlock(&t->lock);
 }
 
 static void __remove(struct dm_bufio_client *c, struct dm_buffer *b)
 {
-	rb_erase(&b->node, &c->buffer_tree);
+	struct buffer_tree *t = buffer_tree(c, b->block);
+
+	write_lock(&t->lock);
+	rb_erase(&b->node, &t->root);
+	write_unlock(&t->lock);
 }
 
 /*----------------------------------------------------------------*/
@@ -516,22 +566,49 @@ static void __link_buffer(struct dm_buffer *b, sector_t block, int dirty)
 	adjust_total_allocated(b, false);
 }
 
-/*
- * Unlink buffer from the buffer tree and dirty or clean queue.
- */
-static void __unlink_buffer(struct dm_buffer *b)
+static void __unlink_lru(struct dm_buffer *b)
 {
 	struct dm_bufio_client *c = b->c;
 
 	BUG_ON(!c->n_buffers[b->list_mode]);
 
 	c->n_buffers[b->list_mode]--;
-	__remove(b->c, b);
 	list_del(&b->lru_list);
 
 	adjust_total_allocated(b, true);
 }
 
+/*
+ * Unlink buffer from the buffer tree and dirty or clean queue.
+ */
+static void __unlink_buffer(struct dm_buffer *b)
+{
+	__remove(b->c, b);
+	__unlink_lru(b);
+}
+
+/*
+ * Unlink the buffer only if it has exactly "holders" holders.  Lockless
+ * lookups take their hold under the tree's read lock, so the check can't
+ * race with them here.
+ */
+static bool __try_unlink_buffer(struct dm_buffer *b, int holders)
+{
+	struct buffer_tree *t = buffer_tree(b->c, b->block);
+
+	write_lock(&t->lock);
+	if (atomic_read(&b->hold_count) != holders) {
+		write_unlock(&t->lock);
+		return false;
+	}
+	rb_erase(&b->node, &t->root);
+	write_unlock(&t->lock);
+
+	__unlink_lru(b);
+
+	return true;
+}
+
 /*
  * Place the buffer to the head of dirty or clean LRU queue.
  */
@@ -550,6 +627,21 @@ static void __relink_lru(struct dm_buffer *b, int dirty)
 	b->last_accessed = jiffies;
 }
 
+/*
+ * Lockless hits can't move the buffer in the LRU, they only mark it
+ * referenced.  Move such a buffer to the head when it reaches the tail.
+ */
+static bool __lru_referenced(struct dm_buffer *b)
+{
+	if (likely(!READ_ONCE(b->referenced)))
+		return false;
+
+	WRITE_ONCE(b->referenced, false);
+	list_move(&b->lru_list, &b->c->lru[b->list_mode]);
+
+	return true;
+}
+
 /*----------------------------------------------------------------
  * Submit I/O on the buffer.
  *
@@ -783,8 +875,6 @@ static void __flush_write_list(struct list_head *write_list)
  */
 static void __make_buffer_clean(struct dm_buffer *b)
 {
-	BUG_ON(b->hold_count);
-
 	if (!b->state)	/* fast case */
 		return;
 
@@ -799,27 +889,33 @@ static void __make_buffer_clean(struct dm_buffer *b)
  */
 static struct dm_buffer *__get_unclaimed_buffer(struct dm_bufio_client *c)
 {
-	struct dm_buffer *b;
+	struct dm_buffer *b, *tmp;
 
-	list_for_each_entry_reverse(b, &c->lru[LIST_CLEAN], lru_list) {
+	list_for_each_entry_safe_reverse(b, tmp, &c->lru[LIST_CLEAN], lru_list) {
 		BUG_ON(test_bit(B_WRITING, &b->state));
 		BUG_ON(test_bit(B_DIRTY, &b->state));
 
-		if (!b->hold_count) {
+		if (__lru_referenced(b))
+			continue;
+
+		if (!atomic_read(&b->hold_count)) {
 			__make_buffer_clean(b);
-			__unlink_buffer(b);
-			return b;
+			if (__try_unlink_buffer(b, 0))
+				return b;
 		}
 		cond_resched();
 	}
 
-	list_for_each_entry_reverse(b, &c->lru[LIST_DIRTY], lru_list) {
+	list_for_each_entry_safe_reverse(b, tmp, &c->lru[LIST_DIRTY], lru_list) {
 		BUG_ON(test_bit(B_READING, &b->state));
 
-		if (!b->hold_count) {
+		if (__lru_referenced(b))
+			continue;
+
+		if (!atomic_read(&b->hold_count)) {
 			__make_buffer_clean(b);
-			__unlink_buffer(b);
-			return b;
+			if (__try_unlink_buffer(b, 0))
+				return b;
 		}
 		cond_resched();
 	}
@@ -832,7 +928,8 @@ static struct dm_buffer *__get_unclaimed_buffer(struct dm_bufio_client *c)
  * some buffer.
  *
  * This function is entered with c->lock held, drops it and regains it
- * before exiting.
+ * before exiting.  The caller must have raised c->nr_waiters before it
+ * checked the condition it waits for, see dm_bufio_release.
  */
 static void __wait_for_free_buffer(struct dm_bufio_client *c)
 {
@@ -908,11 +1005,17 @@ static struct dm_buffer *__alloc_buffer_wait_no_callback(struct dm_bufio_client
 			return b;
 		}
 
+		atomic_inc(&c->nr_waiters);
+		smp_mb__after_atomic();
+
 		b = __get_unclaimed_buffer(c);
-		if (b)
+		if (b) {
+			atomic_dec(&c->nr_waiters);
 			return b;
+		}
 
 		__wait_for_free_buffer(c);
+		atomic_dec(&c->nr_waiters);
 	}
 }
 
@@ -1016,7 +1119,8 @@ static struct dm_buffer *__bufio_new(struct dm_bufio_client *c, sector_t block,
 	__check_watermark(c, write_list);
 
 	b = new_b;
-	b->hold_count = 1;
+	atomic_set(&b->hold_count, 1);
+	b->referenced = false;
 	b->read_error = 0;
 	b->write_error = 0;
 	__link_buffer(b, block, LIST_CLEAN);
@@ -1044,12 +1148,39 @@ static struct dm_buffer *__bufio_new(struct dm_bufio_client *c, sector_t block,
 	if (nf == NF_GET && unlikely(test_bit(B_READING, &b->state)))
 		return NULL;
 
-	b->hold_count++;
+	atomic_inc(&b->hold_count);
 	__relink_lru(b, test_bit(B_DIRTY, &b->state) ||
 		     test_bit(B_WRITING, &b->state));
 	return b;
 }
 
+/*
+ * The hit path: find the buffer and take a hold on it without c->lock.
+ * Returns NULL if the caller has to go through __bufio_new.
+ */
+static struct dm_buffer *find_and_hold_buffer(struct dm_bufio_client *c, sector_t block,
+					      enum new_flag nf)
+{
+	struct buffer_tree *t = buffer_tree(c, block);
+	struct dm_buffer *b;
+
+	read_lock(&t->lock);
+	b = __find(c, block);
+	if (b) {
+		if (nf == NF_GET && unlikely(test_bit(B_READING, &b->state))) {
+			b = NULL;
+		} else {
+			atomic_inc(&b->hold_count);
+			WRITE_ONCE(b->accessed, 1);
+			WRITE_ONCE(b->referenced, true);
+			WRITE_ONCE(b->last_accessed, jiffies);
+		}
+	}
+	read_unlock(&t->lock);
+
+	return b;
+}
+
 /*
  * The endio routine for reading: set the error, clear the bit and wake up
  * anyone waiting on the buffer.
@@ -1081,21 +1212,28 @@ static void *new_read(struct dm_bufio_client *c, sector_t block,
 
 	LIST_HEAD(write_list);
 
-	dm_bufio_lock(c);
-	b = __bufio_new(c, block, nf, &need_submit, &write_list);
+	b = find_and_hold_buffer(c, block, nf);
+	if (!b) {
+		dm_bufio_lock(c);
+		b = __bufio_new(c, block, nf, &need_submit, &write_list);
 #ifdef CONFIG_DM_DEBUG_BLOCK_STACK_TRACING
-	if (b && b->hold_count == 1)
-		buffer_record_stack(b);
+		if (b && atomic_read(&b->hold_count) == 1)
+			buffer_record_stack(b);
 #endif
-	dm_bufio_unlock(c);
+		dm_bufio_unlock(c);
 
-	__flush_write_list(&write_list);
+		__flush_write_list(&write_list);
 
-	if (!b)
-		return NULL;
+		if (!b)
+			return NULL;
 
-	if (need_submit)
-		submit_io(b, REQ_OP_READ, read_endio);
+		if (need_submit)
+			submit_io(b, REQ_OP_READ, read_endio);
+	}
+#ifdef CONFIG_DM_DEBUG_BLOCK_STACK_TRACING
+	else if (atomic_read(&b->hold_count) == 1)
+		buffer_record_stack(b);
+#endif
 
 	wait_on_bit_io(&b->state, B_READING, TASK_UNINTERRUPTIBLE);
 
@@ -1187,12 +1325,27 @@ void dm_bufio_release(struct dm_buffer *b)
 {
 	struct dm_bufio_client *c = b->c;
 
-	dm_bufio_lock(c);
+	BUG_ON(!atomic_read(&b->hold_count));
+
+	/*
+	 * Without errors, dropping the hold doesn't need c->lock.  Anyone
+	 * waiting for a free buffer raises nr_waiters before scanning the
+	 * hold counts, so either they see our decrement or we see them
+	 * and wake them under the lock, after they are on the wait queue.
+	 */
+	if (likely(!b->read_error && !b->write_error)) {
+		if (atomic_dec_and_test(&b->hold_count) &&
+		    unlikely(atomic_read(&c->nr_waiters))) {
+			dm_bufio_lock(c);
+			wake_up(&c->free_buffer_wait);
+			dm_bufio_unlock(c);
+		}
+		return;
+	}
 
-	BUG_ON(!b->hold_count);
+	dm_bufio_lock(c);
 
-	b->hold_count--;
-	if (!b->hold_count) {
+	if (atomic_dec_and_test(&b->hold_count)) {
 		wake_up(&c->free_buffer_wait);
 
 		/*
@@ -1200,13 +1353,11 @@ void dm_bufio_release(struct dm_buffer *b)
 		 * to be written, free the buffer. There is no point in caching
 		 * invalid buffer.
 		 */
-		if ((b->read_error || b->write_error) &&
-		    !test_bit(B_READING, &b->state) &&
+		if (!test_bit(B_READING, &b->state) &&
 		    !test_bit(B_WRITING, &b->state) &&
-		    !test_bit(B_DIRTY, &b->state)) {
-			__unlink_buffer(b);
+		    !test_bit(B_DIRTY, &b->state) &&
+		    __try_unlink_buffer(b, 0))
 			__free_buffer_wake(b);
-		}
 	}
 
 	dm_bufio_unlock(c);
@@ -1292,12 +1443,12 @@ int dm_bufio_write_dirty_buffers(struct dm_bufio_client *c)
 		if (test_bit(B_WRITING, &b->state)) {
 			if (buffers_processed < c->n_buffers[LIST_DIRTY]) {
 				dropped_lock = 1;
-				b->hold_count++;
+				atomic_inc(&b->hold_count);
 				dm_bufio_unlock(c);
 				wait_on_bit_io(&b->state, B_WRITING,
 					       TASK_UNINTERRUPTIBLE);
 				dm_bufio_lock(c);
-				b->hold_count--;
+				atomic_dec(&b->hold_count);
 			} else
 				wait_on_bit_io(&b->state, B_WRITING,
 					       TASK_UNINTERRUPTIBLE);
@@ -1410,53 +1561,61 @@ void dm_bufio_release_move(struct dm_buffer *b, sector_t new_block)
 retry:
 	new = __find(c, new_block);
 	if (new) {
-		if (new->hold_count) {
+		atomic_inc(&c->nr_waiters);
+		smp_mb__after_atomic();
+		if (atomic_read(&new->hold_count)) {
 			__wait_for_free_buffer(c);
+			atomic_dec(&c->nr_waiters);
 			goto retry;
 		}
+		atomic_dec(&c->nr_waiters);
 
 		/*
 		 * FIXME: Is there any point waiting for a write that's going
 		 * to be overwritten in a bit?
 		 */
 		__make_buffer_clean(new);
-		__unlink_buffer(new);
+		if (!__try_unlink_buffer(new, 0))
+			goto retry;
 		__free_buffer_wake(new);
 	}
 
-	BUG_ON(!b->hold_count);
+	BUG_ON(!atomic_read(&b->hold_count));
 	BUG_ON(test_bit(B_READING, &b->state));
 
 	__write_dirty_buffer(b, NULL);
-	if (b->hold_count == 1) {
+	if (atomic_read(&b->hold_count) == 1) {
 		wait_on_bit_io(&b->state, B_WRITING,
 			       TASK_UNINTERRUPTIBLE);
-		set_bit(B_DIRTY, &b->state);
-		b->dirty_start = 0;
-		b->dirty_end = c->block_size;
-		__unlink_buffer(b);
-		__link_buffer(b, new_block, LIST_DIRTY);
-	} else {
+		if (__try_unlink_buffer(b, 1)) {
+			set_bit(B_DIRTY, &b->state);
+			b->dirty_start = 0;
+			b->dirty_end = c->block_size;
+			__link_buffer(b, new_block, LIST_DIRTY);
+			goto out;
+		}
+	}
+
+	{
 		sector_t old_block;
 		wait_on_bit_lock_io(&b->state, B_WRITING,
 				    TASK_UNINTERRUPTIBLE);
 		/*
-		 * Relink buffer to "new_block" so that write_callback
+		 * Set the block number to "new_block" so that write_callback
 		 * sees "new_block" as a block number.
 		 * After the write, link the buffer back to old_block.
-		 * All this must be done in bufio lock, so that block number
-		 * change isn't visible to other threads.
+		 * The buffer is out of the tree meanwhile, so that lockless
+		 * lookups fall back to c->lock and never see the change.
 		 */
 		old_block = b->block;
 		__unlink_buffer(b);
-		__link_buffer(b, new_block, b->list_mode);
+		b->block = new_block;
 		submit_io(b, REQ_OP_WRITE, write_endio);
 		wait_on_bit_io(&b->state, B_WRITING,
 			       TASK_UNINTERRUPTIBLE);
-		__unlink_buffer(b);
 		__link_buffer(b, old_block, b->list_mode);
 	}
-
+out:
 	dm_bufio_unlock(c);
 	dm_bufio_release(b);
 }
@@ -1464,10 +1623,9 @@ EXPORT_SYMBOL_GPL(dm_bufio_release_move);
 
 static void forget_buffer_locked(struct dm_buffer *b)
 {
-	if (likely(!b->hold_count) && likely(!b->state)) {
-		__unlink_buffer(b);
+	if (likely(!atomic_read(&b->hold_count)) && likely(!b->state) &&
+	    __try_unlink_buffer(b, 0))
 		__free_buffer_wake(b);
-	}
 }
 
 /*
@@ -1592,12 +1750,12 @@ static void drop_buffers(struct dm_bufio_client *c)
 		list_for_each_entry(b, &c->lru[i], lru_list) {
 			WARN_ON(!warned);
 			warned = true;
-			DMERR("leaked buffer %llx, hold count %u, list %d",
-			      (unsigned long long)b->block, b->hold_count, i);
+			DMERR("leaked buffer %llx, hold count %d, list %d",
+			      (unsigned long long)b->block, atomic_read(&b->hold_count), i);
 #ifdef CONFIG_DM_DEBUG_BLOCK_STACK_TRACING
 			stack_trace_print(b->stack_entries, b->stack_len, 1);
 			/* mark unclaimed to avoid BUG_ON below */
-			b->hold_count = 0;
+			atomic_set(&b->hold_count, 0);
 #endif
 		}
 
@@ -1629,11 +1787,12 @@ static bool __try_evict_buffer(struct dm_buffer *b, gfp_t gfp)
 			return false;
 	}
 
-	if (b->hold_count)
+	if (atomic_read(&b->hold_count))
 		return false;
 
 	__make_buffer_clean(b);
-	__unlink_buffer(b);
+	if (!__try_unlink_buffer(b, 0))
+		return false;
 	__free_buffer_wake(b);
 
 	return true;
@@ -1745,7 +1904,10 @@ struct dm_bufio_client *dm_bufio_client_create(struct block_device *bdev, unsign
 		r = -ENOMEM;
 		goto bad_client;
 	}
-	c->buffer_tree = RB_ROOT;
+	for (i = 0; i < DM_BUFIO_TREE_SHARDS; i++) {
+		rwlock_init(&c->trees[i].lock);
+		c->trees[i].root = RB_ROOT;
+	}
 
 	c->bdev = bdev;
 	c->block_size = block_size;
@@ -1867,7 +2029,8 @@ void dm_bufio_client_destroy(struct dm_bufio_client *c)
 
 	mutex_unlock(&dm_bufio_clients_lock);
 
-	BUG_ON(!RB_EMPTY_ROOT(&c->buffer_tree));
+	for (i = 0; i < DM_BUFIO_TREE_SHARDS; i++)
+		BUG_ON(!RB_EMPTY_ROOT(&c->trees[i].root));
 	BUG_ON(c->need_reserved_buffers);
 
 	while (!list_empty(&c->reserved_buffers)) {
@@ -1934,8 +2097,11 @@ static void __evict_old_buffers(struct dm_bufio_client *c, unsigned long age_hz)
 		if (count <= retain_target)
 			break;
 
-		if (!older_than(b, age_hz))
+		if (!older_than(b, age_hz)) {
+			if (__lru_referenced(b))
+				continue;
 			break;
+		}
 
 		if (__try_evict_buffer(b, 0))
 			count--;
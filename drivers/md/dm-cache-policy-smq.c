@@ -13,6 +13,8 @@
 #include <linux/jiffies.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
 #include <linux/vmalloc.h>
 #include <linux/math64.h>
 
@@ -574,6 +576,12 @@ struct smq_hash_table {
 	struct entry_space *es;
 	unsigned long long hash_bits;
 	unsigned *buckets;
+
+	/*
+	 * Bumped around every change to the chains, so lookups can be
+	 * done without the policy lock.
+	 */
+	seqcount_t seq;
 };
 
 /*
@@ -595,6 +603,8 @@ static int h_init(struct smq_hash_table *ht, struct entry_space *es, unsigned nr
 	for (i = 0; i < nr_buckets; i++)
 		ht->buckets[i] = INDEXER_NULL;
 
+	seqcount_init(&ht->seq);
+
 	return 0;
 }
 
@@ -622,7 +632,10 @@ static void __h_insert(struct smq_hash_table *ht, unsigned bucket, struct entry
 static void h_insert(struct smq_hash_table *ht, struct entry *e)
 {
 	unsigned h = hash_64(from_oblock(e->oblock), ht->hash_bits);
+
+	write_seqcount_begin(&ht->seq);
 	__h_insert(ht, h, e);
+	write_seqcount_end(&ht->seq);
 }
 
 static struct entry *__h_lookup(struct smq_hash_table *ht, unsigned h, dm_oblock_t oblock,
@@ -664,13 +677,46 @@ static struct entry *h_lookup(struct smq_hash_table *ht, dm_oblock_t oblock)
 		 * Move to the front because this entry is likely
 		 * to be hit again.
 		 */
+		write_seqcount_begin(&ht->seq);
 		__h_unlink(ht, h, e, prev);
 		__h_insert(ht, h, e);
+		write_seqcount_end(&ht->seq);
 	}
 
 	return e;
 }
 
+/*
+ * Longest chain a lockless lookup will walk before giving up.  A walk
+ * racing with a writer can loop, entries are never freed though so it
+ * never touches anything outside the entry space.
+ */
+#define MAX_LOCKLESS_CHAIN 16u
+
+/*
+ * Returns false if the lookup has to be redone under the lock.  The
+ * entry, or NULL, is only valid if it returns true.
+ */
+static bool h_lookup_lockless(struct smq_hash_table *ht, dm_oblock_t oblock,
+			      struct entry **result)
+{
+	struct entry *e;
+	unsigned seq, n = 0;
+	unsigned h = hash_64(from_oblock(oblock), ht->hash_bits);
+
+	seq = read_seqcount_begin(&ht->seq);
+	for (e = h_head(ht, h); e; e = h_next(ht, e)) {
+		if (e->oblock == oblock)
+			break;
+
+		if (++n > MAX_LOCKLESS_CHAIN)
+			return false;
+	}
+
+	*result = e;
+	return !read_seqcount_retry(&ht->seq, seq);
+}
+
 static void h_remove(struct smq_hash_table *ht, struct entry *e)
 {
 	unsigned h = hash_64(from_oblock(e->oblock), ht->hash_bits);
@@ -681,8 +727,11 @@ static void h_remove(struct smq_hash_table *ht, struct entry *e)
 	 * iterate the bucket to remove an item.
 	 */
 	e = __h_lookup(ht, h, e->oblock, &prev);
-	if (e)
+	if (e) {
+		write_seqcount_begin(&ht->seq);
 		__h_unlink(ht, h, e, prev);
+		write_seqcount_end(&ht->seq);
+	}
 }
 
 /*----------------------------------------------------------------*/
@@ -791,6 +840,22 @@ static struct entry *get_entry(struct entry_alloc *ea, unsigned index)
 #define HOTSPOT_UPDATE_PERIOD (HZ)
 #define CACHE_UPDATE_PERIOD (60ul * HZ)
 
+/*
+ * Hits on the cache are recorded in per cpu buffers, without taking the
+ * policy lock, and folded into the queues on the next tick.  Only the
+ * first hit on a block in each cache period needs requeueing, so the
+ * buffers rarely fill; if one does we fall back to the locked path.
+ */
+#define HIT_BUFFER_SIZE 64u
+
+struct hit_buffer {
+	spinlock_t lock;
+	unsigned nr;
+	unsigned hits;
+	unsigned misses;
+	unsigned cblocks[HIT_BUFFER_SIZE];
+};
+
 struct smq_policy {
 	struct dm_cache_policy policy;
 
@@ -827,6 +892,8 @@ struct smq_policy {
 	struct stats hotspot_stats;
 	struct stats cache_stats;
 
+	struct hit_buffer __percpu *hit_buffers;
+
 	/*
 	 * Keeps track of time, incremented by the core.  We use this to
 	 * avoid attributing multiple hits within the same tick.
@@ -1352,6 +1419,7 @@ static void smq_destroy(struct dm_cache_policy *p)
 	struct smq_policy *mq = to_smq_policy(p);
 
 	btracker_destroy(mq->bg_work);
+	free_percpu(mq->hit_buffers);
 	h_exit(&mq->hotspot_table);
 	h_exit(&mq->table);
 	free_bitset(mq->hotspot_hit_bits);
@@ -1397,6 +1465,80 @@ static int __lookup(struct smq_policy *mq, dm_oblock_t oblock, dm_cblock_t *cblo
 	}
 }
 
+static bool hit_buffer_add(struct smq_policy *mq, struct entry *e)
+{
+	bool r = true;
+	unsigned long flags;
+	struct hit_buffer *hb;
+	unsigned cblock = from_cblock(infer_cblock(mq, e));
+
+	local_irq_save(flags);
+	hb = this_cpu_ptr(mq->hit_buffers);
+	spin_lock(&hb->lock);
+
+	if (!test_bit(cblock, mq->cache_hit_bits)) {
+		if (hb->nr == HIT_BUFFER_SIZE) {
+			r = false;
+			goto out;
+		}
+		hb->cblocks[hb->nr++] = cblock;
+	}
+
+	if (e->level >= mq->cache_stats.hit_threshold)
+		hb->hits++;
+	else
+		hb->misses++;
+out:
+	spin_unlock(&hb->lock);
+	local_irq_restore(flags);
+
+	return r;
+}
+
+/*
+ * Called with mq->lock held.  The buffered blocks may have been demoted,
+ * or even reused, since; that only makes the requeue slightly imprecise.
+ */
+static void fold_hit_buffers(struct smq_policy *mq)
+{
+	int cpu;
+	unsigned i;
+
+	for_each_possible_cpu(cpu) {
+		struct hit_buffer *hb = per_cpu_ptr(mq->hit_buffers, cpu);
+
+		spin_lock(&hb->lock);
+		for (i = 0; i < hb->nr; i++) {
+			struct entry *e = get_entry(&mq->cache_alloc, hb->cblocks[i]);
+
+			if (e->allocated)
+				requeue(mq, e);
+		}
+		mq->cache_stats.hits += hb->hits;
+		mq->cache_stats.misses += hb->misses;
+		hb->nr = hb->hits = hb->misses = 0u;
+		spin_unlock(&hb->lock);
+	}
+}
+
+/*
+ * The hit path, no lock is taken unless the hit buffer is full.  Misses
+ * always go through __lookup() since they update the hotspot queue.
+ */
+static bool lookup_lockless(struct smq_policy *mq, dm_oblock_t oblock, dm_cblock_t *cblock)
+{
+	struct entry *e;
+
+	if (!h_lookup_lockless(&mq->table, oblock, &e) || !e)
+		return false;
+
+	if (!hit_buffer_add(mq, e))
+		return false;
+
+	*cblock = infer_cblock(mq, e);
+	return true;
+}
+
 static int smq_lookup(struct dm_cache_policy *p, dm_oblock_t oblock, dm_cblock_t *cblock,
 		      int data_dir, bool fast_copy,
 		      bool *background_work)
@@ -1405,6 +1547,11 @@ static int smq_lookup(struct dm_cache_policy *p, dm_oblock_t oblock, dm_cblock_t
 	unsigned long flags;
 	struct smq_policy *mq = to_smq_policy(p);
 
+	if (lookup_lockless(mq, oblock, cblock)) {
+		*background_work = false;
+		return 0;
+	}
+
 	spin_lock_irqsave(&mq->lock, flags);
 	r = __lookup(mq, oblock, cblock,
 		     data_dir, fast_copy,
@@ -1424,6 +1571,9 @@ static int smq_lookup_with_work(struct dm_cache_policy *p,
 	unsigned long flags;
 	struct smq_policy *mq = to_smq_policy(p);
 
+	if (lookup_lockless(mq, oblock, cblock))
+		return 0;
+
 	spin_lock_irqsave(&mq->lock, flags);
 	r = __lookup(mq, oblock, cblock, data_dir, fast_copy, work, &background_queued);
 	spin_unlock_irqrestore(&mq->lock, flags);
@@ -1620,6 +1770,7 @@ static void smq_tick(struct dm_cache_policy *p, bool can_block)
 
 	spin_lock_irqsave(&mq->lock, flags);
 	mq->tick++;
+	fold_hit_buffers(mq);
 	update_sentinels(mq);
 	end_hotspot_period(mq);
 	end_cache_period(mq);
@@ -1722,6 +1873,7 @@ static struct dm_cache_policy *__smq_create(dm_cblock_t cache_size,
 					    bool mimic_mq,
 					    bool migrations_allowed)
 {
+	int cpu;
 	unsigned i;
 	unsigned nr_sentinels_per_queue = 2u * NR_CACHE_LEVELS;
 	unsigned total_sentinels = 2u * nr_sentinels_per_queue;
@@ -1779,6 +1931,14 @@ static struct dm_cache_policy *__smq_create(dm_cblock_t cache_size,
 	mq->tick = 0;
 	spin_lock_init(&mq->lock);
 
+	mq->hit_buffers = alloc_percpu(struct hit_buffer);
+	if (!mq->hit_buffers) {
+		DMERR("couldn't allocate hit buffers");
+		goto bad_hit_buffers;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(mq->hit_buffers, cpu)->lock);
+
 	q_init(&mq->hotspot, &mq->es, NR_HOTSPOT_LEVELS);
 	mq->hotspot.nr_top_levels = 8;
 	mq->hotspot.nr_in_top_levels = min(mq->nr_hotspot_blocks / NR_HOTSPOT_LEVELS,
@@ -1815,6 +1975,8 @@ static struct dm_cache_policy *__smq_create(dm_cblock_t cache_size,
 bad_alloc_hotspot_table:
 	h_exit(&mq->table);
 bad_alloc_table:
+	free_percpu(mq->hit_buffers);
+bad_hit_buffers:
 	free_bitset(mq->cache_hit_bits);
 bad_cache_hit_bits:
 	free_bitset(mq->hotspot_hit_bits);
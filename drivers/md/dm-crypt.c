@@ -16,6 +16,7 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/mempool.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/workqueue.h>
@@ -79,6 +80,7 @@ struct dm_crypt_io {
 	atomic_t io_pending;
 	blk_status_t error;
 	sector_t sector;
+	u64 start_ns;
 
 	struct rb_node rb_node;
 } CRYPTO_MINALIGN_ATTR;
@@ -141,6 +143,25 @@ enum cipher_flags {
 	CRYPT_ENCRYPT_PREPROCESS,	/* Must preprocess data for encryption (elephant) */
 };
 
+/*
+ * Per-CPU cache of write bounce pages in front of page_pool, so that most
+ * allocations neither touch the shared pool nor the page allocator.
+ */
+#define CRYPT_PCP_PAGES		64
+
+struct crypt_page_cache {
+	unsigned int nr;
+	struct page *pages[CRYPT_PCP_PAGES];
+};
+
+/* Per-CPU counters reported as the target status, indexed by data dir */
+struct crypt_stats {
+	u64 ios[2];
+	u64 bytes[2];
+	u64 crypt_ns[2];	/* time spent submitting to the cipher */
+	u64 latency_ns[2];	/* map to completion of the original bio */
+};
+
 /*
  * The fields in here must be read only after initialization.
  */
@@ -215,6 +236,9 @@ struct crypt_config {
 	mempool_t tag_pool;
 	mempool_t req_pool;
 	mempool_t page_pool;
+	struct crypt_page_cache __percpu *page_cache;
+
+	struct crypt_stats __percpu *stats;
 
 	struct bio_set bs;
 	struct mutex bio_alloc_lock;
@@ -1637,6 +1661,48 @@ static blk_status_t crypt_convert(struct crypt_config *cc,
 
 static void crypt_free_buffer_pages(struct crypt_config *cc, struct bio *clone);
 
+static struct page *crypt_cached_page_alloc(struct crypt_config *cc)
+{
+	struct crypt_page_cache *pc;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(cc->page_cache);
+	if (pc->nr)
+		page = pc->pages[--pc->nr];
+	local_irq_restore(flags);
+
+	return page;
+}
+
+/*
+ * Pages go back to the mempool while its reserve is short, so that the
+ * per-CPU caches can never starve the blocking allocations in
+ * crypt_alloc_buffer().
+ */
+static void crypt_cached_page_free(struct crypt_config *cc, struct page *page)
+{
+	struct crypt_page_cache *pc;
+	unsigned long flags;
+
+	if (READ_ONCE(cc->page_pool.curr_nr) < cc->page_pool.min_nr) {
+		mempool_free(page, &cc->page_pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(cc->page_cache);
+	if (pc->nr < CRYPT_PCP_PAGES) {
+		pc->pages[pc->nr++] = page;
+		page = NULL;
+	}
+	local_irq_restore(flags);
+
+	if (page)
+		mempool_free(page, &cc->page_pool);
+}
+
 /*
  * Generate a new unfragmented bio with the given size
  * This should never violate the device limitations (but only because
@@ -1676,7 +1742,9 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size)
 	remaining_size = size;
 
 	for (i = 0; i < nr_iovecs; i++) {
-		page = mempool_alloc(&cc->page_pool, gfp_mask);
+		page = crypt_cached_page_alloc(cc);
+		if (!page)
+			page = mempool_alloc(&cc->page_pool, gfp_mask);
 		if (!page) {
 			crypt_free_buffer_pages(cc, clone);
 			bio_put(clone);
@@ -1711,7 +1779,7 @@ static void crypt_free_buffer_pages(struct crypt_config *cc, struct bio *clone)
 
 	bio_for_each_segment_all(bv, clone, iter_all) {
 		BUG_ON(!bv->bv_page);
-		mempool_free(bv->bv_page, &cc->page_pool);
+		crypt_cached_page_free(cc, bv->bv_page);
 	}
 }
 
@@ -1726,6 +1794,7 @@ static void crypt_io_init(struct dm_crypt_io *io, struct crypt_config *cc,
 	io->integrity_metadata = NULL;
 	io->integrity_metadata_from_pool = false;
 	io->in_tasklet = false;
+	io->start_ns = ktime_get_ns();
 	atomic_set(&io->io_pending, 0);
 }
 
@@ -1740,6 +1809,21 @@ static void kcryptd_io_bio_endio(struct work_struct *work)
 	bio_endio(io->base_bio);
 }
 
+static void crypt_account_io(struct crypt_config *cc, struct dm_crypt_io *io)
+{
+	int dir = bio_data_dir(io->base_bio);
+
+	/* completions can run in irq context, so don't use plain updates */
+	this_cpu_inc(cc->stats->ios[dir]);
+	this_cpu_add(cc->stats->bytes[dir], io->base_bio->bi_iter.bi_size);
+	this_cpu_add(cc->stats->latency_ns[dir], ktime_get_ns() - io->start_ns);
+}
+
+static void crypt_account_crypt(struct crypt_config *cc, int dir, u64 start)
+{
+	this_cpu_add(cc->stats->crypt_ns[dir], ktime_get_ns() - start);
+}
+
 /*
  * One of the bios was finished. Check for completion of
  * the whole request and correctly clean up the buffer.
@@ -1753,6 +1837,8 @@ static void crypt_dec_pending(struct dm_crypt_io *io)
 	if (!atomic_dec_and_test(&io->io_pending))
 		return;
 
+	crypt_account_io(cc, io);
+
 	if (io->ctx.r.req)
 		crypt_free_req(cc, io->ctx.r.req, base_bio);
 
@@ -2048,6 +2134,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 	struct bio *clone;
 	int crypt_finished;
 	sector_t sector = io->sector;
+	u64 start;
 	blk_status_t r;
 
 	/*
@@ -2068,8 +2155,10 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 	sector += bio_sectors(clone);
 
 	crypt_inc_pending(io);
+	start = ktime_get_ns();
 	r = crypt_convert(cc, ctx,
 			  test_bit(DM_CRYPT_NO_WRITE_WORKQUEUE, &cc->flags), true);
+	crypt_account_crypt(cc, WRITE, start);
 	/*
 	 * Crypto API backlogged the request, because its queue was full
 	 * and we're in softirq context, so continue from a workqueue
@@ -2126,6 +2215,7 @@ static void kcryptd_crypt_read_continue(struct work_struct *work)
 static void kcryptd_crypt_read_convert(struct dm_crypt_io *io)
 {
 	struct crypt_config *cc = io->cc;
+	u64 start = ktime_get_ns();
 	blk_status_t r;
 
 	crypt_inc_pending(io);
@@ -2135,6 +2225,7 @@ static void kcryptd_crypt_read_convert(struct dm_crypt_io *io)
 
 	r = crypt_convert(cc, &io->ctx,
 			  test_bit(DM_CRYPT_NO_READ_WORKQUEUE, &cc->flags), true);
+	crypt_account_crypt(cc, READ, start);
 	/*
 	 * Crypto API backlogged the request, because its queue was full
 	 * and we're in softirq context, so continue from a workqueue
@@ -2689,6 +2780,23 @@ static void crypt_page_free(void *page, void *pool_data)
 	percpu_counter_sub(&cc->n_allocated_pages, 1);
 }
 
+static void crypt_free_page_cache(struct crypt_config *cc)
+{
+	int cpu;
+
+	if (!cc->page_cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct crypt_page_cache *pc = per_cpu_ptr(cc->page_cache, cpu);
+
+		while (pc->nr)
+			crypt_page_free(pc->pages[--pc->nr], cc);
+	}
+	free_percpu(cc->page_cache);
+	cc->page_cache = NULL;
+}
+
 static void crypt_dtr(struct dm_target *ti)
 {
 	struct crypt_config *cc = ti->private;
@@ -2710,6 +2818,8 @@ static void crypt_dtr(struct dm_target *ti)
 
 	bioset_exit(&cc->bs);
 
+	crypt_free_page_cache(cc);
+	free_percpu(cc->stats);
 	mempool_exit(&cc->page_pool);
 	mempool_exit(&cc->req_pool);
 	mempool_exit(&cc->tag_pool);
@@ -3260,6 +3370,14 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	cc->page_cache = alloc_percpu(struct crypt_page_cache);
+	cc->stats = alloc_percpu(struct crypt_stats);
+	if (!cc->page_cache || !cc->stats) {
+		ti->error = "Cannot allocate per-CPU data";
+		ret = -ENOMEM;
+		goto bad;
+	}
+
 	ret = bioset_init(&cc->bs, MIN_IOS, 0, BIOSET_NEED_BVECS);
 	if (ret) {
 		ti->error = "Cannot allocate crypt bioset";
@@ -3444,6 +3562,38 @@ static char hex2asc(unsigned char c)
 	return c + '0' + ((unsigned)(9 - c) >> 4 & 0x27);
 }
 
+/*
+ * For reads and then writes: <ios> <bytes> <crypt_us> <latency_us>
+ *
+ * crypt_us is the time spent in the cipher, or handing requests to it for
+ * asynchronous ciphers, so crypt_us per MB of bytes gives the CPU cost of
+ * the current mode (workqueues, no_read_workqueue, no_write_workqueue).
+ */
+static void crypt_status_info(struct crypt_config *cc, char *result,
+			      unsigned maxlen)
+{
+	struct crypt_stats sum = {};
+	unsigned sz = 0;
+	int cpu, dir;
+
+	for_each_possible_cpu(cpu) {
+		struct crypt_stats *stats = per_cpu_ptr(cc->stats, cpu);
+
+		for (dir = READ; dir <= WRITE; dir++) {
+			sum.ios[dir] += READ_ONCE(stats->ios[dir]);
+			sum.bytes[dir] += READ_ONCE(stats->bytes[dir]);
+			sum.crypt_ns[dir] += READ_ONCE(stats->crypt_ns[dir]);
+			sum.latency_ns[dir] += READ_ONCE(stats->latency_ns[dir]);
+		}
+	}
+
+	for (dir = READ; dir <= WRITE; dir++)
+		DMEMIT("%s%llu %llu %llu %llu", dir == READ ? "" : " ",
+		       sum.ios[dir], sum.bytes[dir],
+		       div_u64(sum.crypt_ns[dir], NSEC_PER_USEC),
+		       div_u64(sum.latency_ns[dir], NSEC_PER_USEC));
+}
+
 static void crypt_status(struct dm_target *ti, status_type_t type,
 			 unsigned status_flags, char *result, unsigned maxlen)
 {
@@ -3453,7 +3603,7 @@ static void crypt_status(struct dm_target *ti, status_type_t type,
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		result[0] = '\0';
+		crypt_status_info(cc, result, maxlen);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -3634,7 +3784,7 @@ static void crypt_io_hints(struct dm_target *ti, struct queue_limits *limits)
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 23, 0},
+	.version = {1, 24, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
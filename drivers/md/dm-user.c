@@ -8,12 +8,16 @@
 #include <uapi/linux/dm-user.h>
 
 #include <linux/bio.h>
+#include <linux/bitmap.h>
 #include <linux/init.h>
+#include <linux/log2.h>
 #include <linux/mempool.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/poll.h>
 #include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 
@@ -55,6 +59,11 @@ MODULE_PARM_DESC(dm_user_daemon_timeout_msec,
  *  - dev_write(), which looks up a message (keyed by sequence number) and
  *    completes the corresponding BIO.
  *
+ * Channels that have set up a shared memory ring replace the last two with
+ * channel_ring_enter(), which completes every response userspace has put on
+ * the completion queue and then moves messages onto the submission queue,
+ * copying the BIO data through the ring's data slots instead of the IOV.
+ *
  * Lock ordering (outer to inner)
  *
  * 1) miscdevice's global lock.  This is held around dev_open, so it has to be
@@ -91,6 +100,9 @@ struct message {
 	struct delayed_work work;
 	bool delayed;
 	struct target *t;
+
+	/* Data slot owned by the message while it is on a ring channel. */
+	unsigned int slot;
 };
 
 struct target {
@@ -144,6 +156,14 @@ struct target {
 	struct kref references;
 	int dm_destroyed;
 	bool daemon_terminated;
+
+	/*
+	 * Reported by the target status, so that the throughput and the number
+	 * of syscalls per BIO of both transports can be compared.
+	 */
+	atomic64_t nr_bios;
+	atomic64_t nr_bytes;
+	atomic64_t nr_syscalls;
 };
 
 struct channel {
@@ -182,6 +202,23 @@ struct channel {
 	 * only ever be pointer to by from_user_cur, and will never have a BIO.
 	 */
 	struct message scratch_message_from_user;
+
+	/*
+	 * The shared memory ring, see DM_USER_IOCTL_RING_SETUP.  The ring is
+	 * published once and only freed with the channel, so mmap() can look
+	 * at it without the channel lock.  The kernel keeps its own copy of
+	 * the indices it produces or consumes, userspace can scribble over the
+	 * ones in the shared header.
+	 */
+	void *ring;
+	size_t ring_size;
+	unsigned int ring_entries;
+	struct dm_user_ring_sqe *sq;
+	struct dm_user_ring_cqe *cq;
+	void *ring_data;
+	u32 sq_tail;
+	u32 cq_head;
+	DECLARE_BITMAP(ring_slots, DM_USER_RING_MAX_ENTRIES);
 };
 
 static void message_kill(struct message *m, mempool_t *pool)
@@ -191,6 +228,12 @@ static void message_kill(struct message *m, mempool_t *pool)
 	mempool_free(m, pool);
 }
 
+static void message_account(struct target *t, struct message *m)
+{
+	atomic64_inc(&t->nr_bios);
+	atomic64_add(m->msg.len, &t->nr_bytes);
+}
+
 static inline bool is_user_space_thread_present(struct target *t)
 {
 	lockdep_assert_held(&t->lock);
@@ -764,6 +807,7 @@ static void channel_free(struct channel *c)
 	target_put(c->target);
 	mutex_unlock(&c->lock);
 	mutex_destroy(&c->lock);
+	vfree(c->ring);
 	kfree(c);
 }
 
@@ -803,8 +847,14 @@ static ssize_t dev_read(struct kiocb *iocb, struct iov_iter *to)
 	ssize_t total_processed = 0;
 	ssize_t processed;
 
+	atomic64_inc(&c->target->nr_syscalls);
 	mutex_lock(&c->lock);
 
+	if (unlikely(c->ring)) {
+		total_processed = -EBUSY;
+		goto cleanup_unlock;
+	}
+
 	if (unlikely(c->to_user_error)) {
 		total_processed = c->to_user_error;
 		goto cleanup_unlock;
@@ -898,8 +948,14 @@ static ssize_t dev_write(struct kiocb *iocb, struct iov_iter *from)
 	ssize_t total_processed = 0;
 	ssize_t processed;
 
+	atomic64_inc(&c->target->nr_syscalls);
 	mutex_lock(&c->lock);
 
+	if (unlikely(c->ring)) {
+		total_processed = -EBUSY;
+		goto cleanup_unlock;
+	}
+
 	if (unlikely(c->from_user_error)) {
 		total_processed = c->from_user_error;
 		goto cleanup_unlock;
@@ -987,6 +1043,7 @@ static ssize_t dev_write(struct kiocb *iocb, struct iov_iter *from)
 	 * has gone off the rails.
 	 */
 	WARN_ON(bio_size(c->cur_from_user->bio) != 0);
+	message_account(c->target, c->cur_from_user);
 	bio_endio(c->cur_from_user->bio);
 
 	/*
@@ -1004,6 +1061,321 @@ static ssize_t dev_write(struct kiocb *iocb, struct iov_iter *from)
 	return total_processed;
 }
 
+static inline void *channel_ring_slot(struct channel *c, unsigned int slot)
+{
+	return c->ring_data + (size_t)slot * DM_USER_RING_SLOT_SIZE;
+}
+
+static void bio_copy_to_slot(struct bio *bio, char *slot)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment (bvec, bio, iter) {
+		memcpy_from_bvec(slot, &bvec);
+		slot += bvec.bv_len;
+	}
+}
+
+static void bio_copy_from_slot(struct bio *bio, const char *slot)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment (bvec, bio, iter) {
+		memcpy_to_bvec(&bvec, slot);
+		slot += bvec.bv_len;
+	}
+}
+
+static long channel_ring_setup(struct channel *c,
+			       struct dm_user_ring_setup __user *arg)
+{
+	struct dm_user_ring_setup setup;
+	size_t sq_off, cq_off, data_off, size;
+	void *ring;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	if (!setup.entries || setup.entries > DM_USER_RING_MAX_ENTRIES ||
+	    !is_power_of_2(setup.entries) || setup.resv)
+		return -EINVAL;
+
+	sq_off = L1_CACHE_ALIGN(sizeof(struct dm_user_ring_header));
+	cq_off = sq_off + setup.entries * sizeof(struct dm_user_ring_sqe);
+	data_off = PAGE_ALIGN(cq_off +
+			      setup.entries * sizeof(struct dm_user_ring_cqe));
+	size = data_off + (size_t)setup.entries * DM_USER_RING_SLOT_SIZE;
+
+	ring = vmalloc_user(size);
+	if (ring == NULL)
+		return -ENOMEM;
+
+	/*
+	 * Messages that were already handed out through read() must still be
+	 * answered through write(), so only a fresh channel can switch over.
+	 */
+	mutex_lock(&c->lock);
+	if (c->ring || c->cur_to_user || !list_empty(&c->from_user) ||
+	    c->cur_from_user != &c->scratch_message_from_user ||
+	    c->scratch_message_from_user.posn_from_user) {
+		mutex_unlock(&c->lock);
+		vfree(ring);
+		return -EBUSY;
+	}
+
+	c->ring_size = size;
+	c->ring_entries = setup.entries;
+	c->sq = ring + sq_off;
+	c->cq = ring + cq_off;
+	c->ring_data = ring + data_off;
+	c->sq_tail = 0;
+	c->cq_head = 0;
+	bitmap_zero(c->ring_slots, DM_USER_RING_MAX_ENTRIES);
+	/* Pairs with the acquire in dev_mmap() */
+	smp_store_release(&c->ring, ring);
+	mutex_unlock(&c->lock);
+
+	setup.size = size;
+	setup.sq_off = sq_off;
+	setup.cq_off = cq_off;
+	setup.data_off = data_off;
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Completes the BIO of every response on the completion queue.  A response
+ * for a sequence number that is not outstanding on this channel is skipped
+ * and reported as -EINVAL once the rest of the queue has been reaped.
+ */
+static int channel_ring_reap(struct channel *c)
+{
+	struct dm_user_ring_header *hdr = c->ring;
+	struct target *t = target_from_channel(c);
+	u32 head = c->cq_head;
+	u32 tail;
+	int r = 0;
+
+	lockdep_assert_held(&c->lock);
+
+	/* Pairs with the release of cq_tail by userspace */
+	tail = smp_load_acquire(&hdr->cq_tail);
+	if (tail - head > c->ring_entries)
+		return -EINVAL;
+
+	while (head != tail) {
+		struct dm_user_ring_cqe *cqe;
+		struct message *m;
+		u64 seq;
+		u32 type;
+
+		cqe = &c->cq[head++ & (c->ring_entries - 1)];
+		seq = READ_ONCE(cqe->seq);
+		type = READ_ONCE(cqe->type);
+
+		m = msg_get_from_user(c, seq);
+		if (m == NULL) {
+			pr_info("user provided an invalid message seq of %llx\n",
+				seq);
+			r = -EINVAL;
+			continue;
+		}
+
+		if (type == DM_USER_RESP_SUCCESS) {
+			void *slot = channel_ring_slot(c, m->slot);
+
+			m->bio->bi_status = BLK_STS_OK;
+			if (bio_op(m->bio) == REQ_OP_READ)
+				bio_copy_from_slot(m->bio, slot);
+		} else {
+			m->bio->bi_status = BLK_STS_IOERR;
+		}
+
+		__clear_bit(m->slot, c->ring_slots);
+		message_account(t, m);
+		bio_endio(m->bio);
+		mempool_free(m, &t->message_pool);
+	}
+
+	c->cq_head = head;
+	smp_store_release(&hdr->cq_head, head);
+	return r;
+}
+
+static bool channel_ring_full(struct channel *c)
+{
+	struct dm_user_ring_header *hdr = c->ring;
+
+	return c->sq_tail - READ_ONCE(hdr->sq_head) >= c->ring_entries ||
+	       bitmap_full(c->ring_slots, c->ring_entries);
+}
+
+/*
+ * Moves as many messages from the target onto the submission queue as there
+ * is room for.  Messages are taken off the target under its lock, but their
+ * data is only copied into the slots after it has been dropped so user_map()
+ * is not held up behind the copies.  Returns the number of messages posted.
+ */
+static int channel_ring_post(struct channel *c)
+{
+	struct dm_user_ring_header *hdr = c->ring;
+	struct target *t = target_from_channel(c);
+	struct message *m, *tmp;
+	LIST_HEAD(batch);
+	unsigned int room;
+	int posted = 0;
+
+	lockdep_assert_held(&c->lock);
+
+	if (channel_ring_full(c))
+		return 0;
+	room = min_t(unsigned int,
+		     c->ring_entries - (c->sq_tail - READ_ONCE(hdr->sq_head)),
+		     c->ring_entries - bitmap_weight(c->ring_slots,
+						     c->ring_entries));
+
+	mutex_lock(&t->lock);
+	while (room-- && !list_empty(&t->to_user)) {
+		/* Pairs with the barrier in user_map(), as in dev_read() */
+		smp_rmb();
+		m = msg_get_to_user(t);
+		if (m == NULL)
+			break;
+		list_add_tail(&m->from_user, &batch);
+	}
+	mutex_unlock(&t->lock);
+
+	list_for_each_entry_safe (m, tmp, &batch, from_user) {
+		struct dm_user_ring_sqe *sqe;
+
+		m->slot = find_first_zero_bit(c->ring_slots, c->ring_entries);
+		__set_bit(m->slot, c->ring_slots);
+		if (bio_op(m->bio) == REQ_OP_WRITE)
+			bio_copy_to_slot(m->bio, channel_ring_slot(c, m->slot));
+
+		sqe = &c->sq[c->sq_tail++ & (c->ring_entries - 1)];
+		sqe->seq = m->msg.seq;
+		sqe->type = m->msg.type;
+		sqe->flags = m->msg.flags;
+		sqe->sector = m->msg.sector;
+		sqe->len = m->msg.len;
+		sqe->slot = m->slot;
+		sqe->resv = 0;
+
+		list_move_tail(&m->from_user, &c->from_user);
+		posted++;
+	}
+
+	/* Publishes the entries and the write data in the slots */
+	if (posted)
+		smp_store_release(&hdr->sq_tail, c->sq_tail);
+	return posted;
+}
+
+/*
+ * The ring doorbell: reaps every response and posts new requests, optionally
+ * sleeping until there is at least one to post.  Returns the number of
+ * requests posted.
+ */
+static long channel_ring_enter(struct channel *c, unsigned long flags)
+{
+	struct target *t = target_from_channel(c);
+	long r;
+
+	if (flags & ~DM_USER_RING_ENTER_WAIT)
+		return -EINVAL;
+
+	mutex_lock(&c->lock);
+
+	if (unlikely(c->ring == NULL)) {
+		r = -EINVAL;
+		goto cleanup_unlock;
+	}
+
+	r = channel_ring_reap(c);
+	if (unlikely(r))
+		goto cleanup_unlock;
+
+	for (;;) {
+		int e;
+
+		r = channel_ring_post(c);
+		if (r || channel_ring_full(c))
+			break;
+
+		/* As in dev_read(), lock the user out of a destroyed target. */
+		if (unlikely(READ_ONCE(t->dm_destroyed))) {
+			r = -ENOTBLK;
+			break;
+		}
+
+		if (!(flags & DM_USER_RING_ENTER_WAIT))
+			break;
+
+		mutex_unlock(&c->lock);
+		e = wait_event_interruptible(t->wq, target_poll(t));
+		mutex_lock(&c->lock);
+
+		if (unlikely(e != 0)) {
+			r = e;
+			break;
+		}
+	}
+
+cleanup_unlock:
+	mutex_unlock(&c->lock);
+	return r;
+}
+
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct channel *c = channel_from_file(file);
+
+	atomic64_inc(&c->target->nr_syscalls);
+
+	switch (cmd) {
+	case DM_USER_IOCTL_RING_SETUP:
+		return channel_ring_setup(c, (void __user *)arg);
+	case DM_USER_IOCTL_RING_ENTER:
+		return channel_ring_enter(c, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * This is called with mmap_lock held.  dev_read() and dev_write() may fault on
+ * the IOV, and so take mmap_lock, with the channel lock held, which is why this
+ * relies on the ring only ever being published once instead of taking it.
+ */
+static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct channel *c = channel_from_file(file);
+	void *ring = smp_load_acquire(&c->ring);
+
+	if (ring == NULL)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+static __poll_t dev_poll(struct file *file, poll_table *wait)
+{
+	struct channel *c = channel_from_file(file);
+	struct target *t = target_from_channel(c);
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &t->wq, wait);
+
+	/* Spurious wakeups are fine, see target_poll() */
+	if (target_poll(t))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
 static int dev_release(struct inode *inode, struct file *file)
 {
 	struct channel *c;
@@ -1021,6 +1393,10 @@ static const struct file_operations file_operations = {
 	.llseek = no_llseek,
 	.read_iter = dev_read,
 	.write_iter = dev_write,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = dev_mmap,
+	.poll = dev_poll,
 	.release = dev_release,
 };
 
@@ -1035,6 +1411,14 @@ static int user_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto cleanup_none;
 	}
 
+	/*
+	 * Ring channels hand data over in fixed size slots, so no IO may be
+	 * larger than a slot whichever channel ends up with it.
+	 */
+	r = dm_set_target_max_io_len(ti, DM_USER_RING_SLOT_SIZE >> SECTOR_SHIFT);
+	if (r)
+		goto cleanup_none;
+
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
 	if (t == NULL) {
 		r = -ENOMEM;
@@ -1147,6 +1531,7 @@ static int user_map(struct dm_target *ti, struct bio *bio)
 	struct message *entry;
 
 	t = target_from_target(ti);
+
 	/*
 	 * FIXME
 	 *
@@ -1253,13 +1638,38 @@ static int user_map(struct dm_target *ti, struct bio *bio)
 	return DM_MAPIO_SUBMITTED;
 }
 
+/*
+ * Status is "<completed bios> <completed bytes> <syscalls>", the last one
+ * counting read(), write() and ioctl() calls on all channels.
+ */
+static void user_status(struct dm_target *ti, status_type_t type,
+			unsigned int status_flags, char *result,
+			unsigned int maxlen)
+{
+	struct target *t = target_from_target(ti);
+	unsigned int sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%lld %lld %lld", atomic64_read(&t->nr_bios),
+		       atomic64_read(&t->nr_bytes),
+		       atomic64_read(&t->nr_syscalls));
+		break;
+	case STATUSTYPE_TABLE:
+	case STATUSTYPE_IMA:
+		*result = '\0';
+		break;
+	}
+}
+
 static struct target_type user_target = {
 	.name = "user",
-	.version = { 1, 0, 0 },
+	.version = { 1, 1, 0 },
 	.module = THIS_MODULE,
 	.ctr = user_ctr,
 	.dtr = user_dtr,
 	.map = user_map,
+	.status = user_status,
 };
 
 static int __init dm_user_init(void)
@@ -11,12 +11,20 @@
  * hash device. Setting this greatly improves performance when data and hash
  * are on the same disk on different partitions on devices with poor random
  * access behavior.
+ *
+ * With "/sys/module/dm_verity/parameters/adaptive_prefetch" enabled (the
+ * default), "prefetch_cluster" is the cluster used for a sequential reader
+ * that has just been detected. The cluster doubles (up to 4 times that
+ * value) while the reader stays sequential, and random reads only prefetch
+ * the hash blocks they need.
  */
 
 #include "dm-verity.h"
 #include "dm-verity-fec.h"
 #include "dm-verity-verify-sig.h"
+#include <linux/cpufreq.h>
 #include <linux/module.h>
+#include <linux/random.h>
 #include <linux/reboot.h>
 
 #define DM_MSG_PREFIX			"verity"
@@ -33,19 +41,37 @@
 #define DM_VERITY_OPT_PANIC		"panic_on_corruption"
 #define DM_VERITY_OPT_IGN_ZEROES	"ignore_zero_blocks"
 #define DM_VERITY_OPT_AT_MOST_ONCE	"check_at_most_once"
+#define DM_VERITY_OPT_STATS		"report_stats"
 
-#define DM_VERITY_OPTS_MAX		(3 + DM_VERITY_OPTS_FEC + \
+#define DM_VERITY_OPTS_MAX		(4 + DM_VERITY_OPTS_FEC + \
 					 DM_VERITY_ROOT_HASH_VERIFICATION_OPTS)
 
 static unsigned dm_verity_prefetch_cluster = DM_VERITY_DEFAULT_PREFETCH_SIZE;
 
 module_param_named(prefetch_cluster, dm_verity_prefetch_cluster, uint, S_IRUGO | S_IWUSR);
 
+static bool dm_verity_adaptive_prefetch = true;
+
+module_param_named(adaptive_prefetch, dm_verity_adaptive_prefetch, bool, S_IRUGO | S_IWUSR);
+
+/* maximum gap in data blocks between two reads of one sequential stream */
+#define DM_VERITY_STREAM_MAX_GAP	32
+/* how far a sequential stream's cluster may grow over prefetch_cluster */
+#define DM_VERITY_STREAM_MAX_SHIFT	2
+
+#define DM_VERITY_DEFAULT_HASH_CACHE_MAX	4
+
+static unsigned dm_verity_hash_cache_max = DM_VERITY_DEFAULT_HASH_CACHE_MAX;
+
+module_param_named(hash_cache_max, dm_verity_hash_cache_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hash_cache_max, "Number of unused verified hash block caches kept for reloaded tables (0 disables the cache)");
+
 struct dm_verity_prefetch_work {
 	struct work_struct work;
 	struct dm_verity *v;
 	sector_t block;
 	unsigned n_blocks;
+	unsigned cluster;	/* level 0 cluster in hash blocks, 0 for none */
 };
 
 /*
@@ -64,6 +90,205 @@ struct buffer_aux {
 	int hash_verified;
 };
 
+/*
+ * Verified hash block cache.
+ *
+ * buffer_aux->hash_verified is lost as soon as dm-bufio evicts the buffer,
+ * after which the next read of the block has to walk the tree up to a
+ * verified level, in the worst case the root. To avoid that, the digest of
+ * every hash block that has been verified is remembered here, together with
+ * a bit saying it is valid. An unverified buffer whose digest matches the
+ * cached one is as trustworthy as one verified through the tree, so only a
+ * single hash of the block itself is needed.
+ *
+ * Caches are keyed by the root digest and tree geometry and are kept on a
+ * global list after the table is destroyed, so that reloading the same
+ * tree (e.g. a remount) starts with a warm cache. At most hash_cache_max
+ * unused caches are retained.
+ *
+ * Like hash_verified, entries are only ever set. Two racing writers store
+ * the same digest, so no locking is needed beyond ordering the digest
+ * before the valid bit.
+ */
+struct dm_verity_hash_cache {
+	struct list_head list;
+	unsigned users;
+	char *alg_name;
+	u8 *root_digest;
+	u8 *salt;
+	unsigned salt_size;
+	unsigned digest_size;
+	unsigned char version;
+	unsigned char hash_dev_block_bits;
+	sector_t n_blocks;
+	unsigned long *valid;
+	u8 *digests;
+	atomic64_t hits;
+	atomic64_t misses;
+};
+
+static LIST_HEAD(verity_hash_caches);
+static DEFINE_MUTEX(verity_hash_caches_lock);
+
+static void verity_hash_cache_free(struct dm_verity_hash_cache *c)
+{
+	kvfree(c->digests);
+	kvfree(c->valid);
+	kfree(c->salt);
+	kfree(c->root_digest);
+	kfree(c->alg_name);
+	kfree(c);
+}
+
+static bool verity_hash_cache_match(struct dm_verity *v,
+				    struct dm_verity_hash_cache *c)
+{
+	return c->digest_size == v->digest_size &&
+	       c->version == v->version &&
+	       c->hash_dev_block_bits == v->hash_dev_block_bits &&
+	       c->n_blocks == v->hash_blocks - v->hash_start &&
+	       c->salt_size == v->salt_size &&
+	       !strcmp(c->alg_name, v->alg_name) &&
+	       !memcmp(c->root_digest, v->root_digest, v->digest_size) &&
+	       !memcmp(c->salt, v->salt, v->salt_size);
+}
+
+static struct dm_verity_hash_cache *verity_hash_cache_alloc(struct dm_verity *v)
+{
+	struct dm_verity_hash_cache *c;
+	sector_t n = v->hash_blocks - v->hash_start;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return NULL;
+
+	c->alg_name = kstrdup(v->alg_name, GFP_KERNEL);
+	c->root_digest = kmemdup(v->root_digest, v->digest_size, GFP_KERNEL);
+	c->salt = kmemdup(v->salt, v->salt_size, GFP_KERNEL);
+	c->valid = kvcalloc(BITS_TO_LONGS(n), sizeof(unsigned long),
+			    GFP_KERNEL | __GFP_NOWARN);
+	c->digests = kvmalloc_array(n, v->digest_size,
+				    GFP_KERNEL | __GFP_NOWARN);
+	if (!c->alg_name || !c->root_digest || (v->salt_size && !c->salt) ||
+	    !c->valid || !c->digests) {
+		verity_hash_cache_free(c);
+		return NULL;
+	}
+
+	c->salt_size = v->salt_size;
+	c->digest_size = v->digest_size;
+	c->version = v->version;
+	c->hash_dev_block_bits = v->hash_dev_block_bits;
+	c->n_blocks = n;
+	atomic64_set(&c->hits, 0);
+	atomic64_set(&c->misses, 0);
+
+	return c;
+}
+
+/*
+ * Attach a cache to the target, reusing the one of a previous table for
+ * the same tree if there is one. Failure just leaves the cache disabled.
+ */
+static void verity_hash_cache_get(struct dm_verity *v)
+{
+	struct dm_verity_hash_cache *c;
+
+	if (!READ_ONCE(dm_verity_hash_cache_max) ||
+	    v->hash_blocks - v->hash_start > INT_MAX)
+		return;
+
+	mutex_lock(&verity_hash_caches_lock);
+	list_for_each_entry(c, &verity_hash_caches, list) {
+		if (verity_hash_cache_match(v, c)) {
+			list_del(&c->list);
+			goto found;
+		}
+	}
+	c = verity_hash_cache_alloc(v);
+	if (!c)
+		goto out;
+found:
+	c->users++;
+	list_add(&c->list, &verity_hash_caches);
+	v->hash_cache = c;
+out:
+	mutex_unlock(&verity_hash_caches_lock);
+}
+
+static void verity_hash_cache_put(struct dm_verity *v)
+{
+	struct dm_verity_hash_cache *c = v->hash_cache, *tmp;
+	unsigned unused = 0;
+	LIST_HEAD(reap);
+
+	if (!c)
+		return;
+
+	mutex_lock(&verity_hash_caches_lock);
+	c->users--;
+	/* the list is in most recently used order, trim unused from the tail */
+	list_for_each_entry_safe(c, tmp, &verity_hash_caches, list) {
+		if (c->users)
+			continue;
+		if (++unused > READ_ONCE(dm_verity_hash_cache_max))
+			list_move(&c->list, &reap);
+	}
+	mutex_unlock(&verity_hash_caches_lock);
+
+	list_for_each_entry_safe(c, tmp, &reap, list)
+		verity_hash_cache_free(c);
+
+	v->hash_cache = NULL;
+}
+
+static void verity_hash_cache_add(struct dm_verity *v, sector_t hash_block,
+				  const u8 *digest)
+{
+	struct dm_verity_hash_cache *c = v->hash_cache;
+	sector_t idx = hash_block - v->hash_start;
+
+	if (!c || test_bit(idx, c->valid))
+		return;
+
+	memcpy(c->digests + idx * v->digest_size, digest, v->digest_size);
+	smp_wmb();
+	set_bit(idx, c->valid);
+}
+
+/*
+ * Return true if the unverified hash block data matches the cached digest
+ * of a previously verified copy.
+ */
+static bool verity_hash_cache_check(struct dm_verity *v,
+				    struct dm_verity_io *io,
+				    sector_t hash_block, const u8 *data)
+{
+	struct dm_verity_hash_cache *c = v->hash_cache;
+	sector_t idx = hash_block - v->hash_start;
+
+	if (!c)
+		return false;
+
+	if (!test_bit(idx, c->valid))
+		goto miss;
+	smp_rmb();
+
+	if (unlikely(verity_hash(v, verity_io_hash_req(v, io), data,
+				 1 << v->hash_dev_block_bits,
+				 verity_io_real_digest(v, io)) < 0))
+		goto miss;
+
+	if (likely(!memcmp(verity_io_real_digest(v, io),
+			   c->digests + idx * v->digest_size, v->digest_size))) {
+		atomic64_inc(&c->hits);
+		return true;
+	}
+miss:
+	atomic64_inc(&c->misses);
+	return false;
+}
+
 /*
  * Initialize struct buffer_aux for a freshly created buffer.
  */
@@ -169,8 +394,8 @@ static int verity_hash_final(struct dm_verity *v, struct ahash_request *req,
 	return r;
 }
 
-int verity_hash(struct dm_verity *v, struct ahash_request *req,
-		const u8 *data, size_t len, u8 *digest)
+static int verity_ahash(struct dm_verity *v, struct ahash_request *req,
+			const u8 *data, size_t len, u8 *digest)
 {
 	int r;
 	struct crypto_wait wait;
@@ -189,6 +414,51 @@ int verity_hash(struct dm_verity *v, struct ahash_request *req,
 	return r;
 }
 
+/*
+ * Synchronous fast path: start from the precomputed salted state instead of
+ * going through crypto_ahash_init() and a scatterlist for every block.
+ */
+static int verity_shash_init(struct dm_verity *v, struct shash_desc *desc)
+{
+	desc->tfm = v->shash_tfm;
+	return crypto_shash_import(desc, v->initial_hashstate);
+}
+
+static int verity_shash_final(struct dm_verity *v, struct shash_desc *desc,
+			      u8 *digest)
+{
+	if (unlikely(v->salt_size && (!v->version)))
+		return crypto_shash_finup(desc, v->salt, v->salt_size, digest);
+
+	return crypto_shash_final(desc, digest);
+}
+
+static int verity_shash(struct dm_verity *v, struct shash_desc *desc,
+			const u8 *data, size_t len, u8 *digest)
+{
+	int r;
+
+	r = verity_shash_init(v, desc);
+	if (unlikely(r))
+		return r;
+
+	r = crypto_shash_update(desc, data, len);
+	if (unlikely(r))
+		return r;
+
+	return verity_shash_final(v, desc, digest);
+}
+
+int verity_hash(struct dm_verity *v, struct ahash_request *req,
+		const u8 *data, size_t len, u8 *digest)
+{
+	if (v->shash_tfm)
+		return verity_shash(v, (struct shash_desc *)req, data, len,
+				    digest);
+
+	return verity_ahash(v, req, data, len, digest);
+}
+
 static void verity_hash_at_level(struct dm_verity *v, sector_t block, int level,
 				 sector_t *hash_block, unsigned *offset)
 {
@@ -291,10 +561,21 @@ static int verity_verify_level(struct dm_verity *v, struct dm_verity_io *io,
 
 	aux = dm_bufio_get_aux_data(buf);
 
+	if (!level && v->prefetched &&
+	    unlikely(test_bit(hash_block - v->hash_level_block[0],
+			      v->prefetched)) &&
+	    test_and_clear_bit(hash_block - v->hash_level_block[0],
+			       v->prefetched))
+		atomic64_inc(&v->prefetch_useful);
+
 	if (!aux->hash_verified) {
 		if (skip_unverified) {
-			r = 1;
-			goto release_ret_r;
+			if (!verity_hash_cache_check(v, io, hash_block, data)) {
+				r = 1;
+				goto release_ret_r;
+			}
+			aux->hash_verified = 1;
+			goto verified;
 		}
 
 		r = verity_hash(v, verity_io_hash_req(v, io),
@@ -316,8 +597,12 @@ static int verity_verify_level(struct dm_verity *v, struct dm_verity_io *io,
 			r = -EIO;
 			goto release_ret_r;
 		}
+
+		if (aux->hash_verified)
+			verity_hash_cache_add(v, hash_block, want_digest);
 	}
 
+verified:
 	data += offset;
 	memcpy(want_digest, data, v->digest_size);
 	r = 0;
@@ -336,22 +621,26 @@ int verity_hash_for_block(struct dm_verity *v, struct dm_verity_io *io,
 {
 	int r = 0, i;
 
-	if (likely(v->levels)) {
-		/*
-		 * First, we try to get the requested hash for
-		 * the current block. If the hash block itself is
-		 * verified, zero is returned. If it isn't, this
-		 * function returns 1 and we fall back to whole
-		 * chain verification.
-		 */
-		r = verity_verify_level(v, io, block, 0, true, digest);
+	/*
+	 * First, we try to get the requested hash from the lowest level
+	 * whose hash block is already verified, either because dm-bufio
+	 * still has it marked as verified or because it matches the
+	 * verified hash block cache. Usually that is the level just above
+	 * the data. If no level is verified, we fall back to whole chain
+	 * verification starting from the root.
+	 */
+	for (i = 0; i < v->levels; i++) {
+		r = verity_verify_level(v, io, block, i, true, digest);
 		if (likely(r <= 0))
-			goto out;
+			break;
 	}
+	if (unlikely(r < 0))
+		goto out;
 
-	memcpy(digest, v->root_digest, v->digest_size);
+	if (i == v->levels)
+		memcpy(digest, v->root_digest, v->digest_size);
 
-	for (i = v->levels - 1; i >= 0; i--) {
+	while (--i >= 0) {
 		r = verity_verify_level(v, io, block, i, false, digest);
 		if (unlikely(r))
 			goto out;
@@ -408,6 +697,68 @@ static int verity_for_io_block(struct dm_verity *v, struct dm_verity_io *io,
 	return 0;
 }
 
+/*
+ * Same as verity_for_io_block(), but feeds the pages straight to the
+ * synchronous hash instead of building an ahash request per segment.
+ */
+static int verity_shash_io_block(struct dm_verity *v, struct dm_verity_io *io,
+				 struct bvec_iter *iter, u8 *digest)
+{
+	unsigned int todo = 1 << v->data_dev_block_bits;
+	struct bio *bio = dm_bio_from_per_bio_data(io, v->ti->per_io_data_size);
+	struct shash_desc *desc = verity_io_hash_desc(v, io);
+	int r;
+
+	r = verity_shash_init(v, desc);
+	if (unlikely(r))
+		return r;
+
+	do {
+		u8 *page;
+		unsigned int len;
+		struct bio_vec bv = bio_iter_iovec(bio, *iter);
+
+		len = min(bv.bv_len, todo);
+		page = kmap_local_page(bv.bv_page);
+		r = crypto_shash_update(desc, page + bv.bv_offset, len);
+		kunmap_local(page);
+
+		if (unlikely(r)) {
+			DMERR("verity_shash_io_block crypto op failed: %d", r);
+			return r;
+		}
+
+		bio_advance_iter(bio, iter, len);
+		todo -= len;
+	} while (todo);
+
+	return verity_shash_final(v, desc, digest);
+}
+
+/*
+ * Hash one data block of the bio starting at iter into digest.
+ */
+static int verity_hash_io_block(struct dm_verity *v, struct dm_verity_io *io,
+				struct bvec_iter *iter, u8 *digest)
+{
+	struct ahash_request *req = verity_io_hash_req(v, io);
+	struct crypto_wait wait;
+	int r;
+
+	if (v->shash_tfm)
+		return verity_shash_io_block(v, io, iter, digest);
+
+	r = verity_hash_init(v, req, &wait);
+	if (unlikely(r < 0))
+		return r;
+
+	r = verity_for_io_block(v, io, iter, &wait);
+	if (unlikely(r < 0))
+		return r;
+
+	return verity_hash_final(v, req, digest, &wait);
+}
+
 /*
  * Calls function process for 1 << v->data_dev_block_bits bytes in the bio_vec
  * starting from iter.
@@ -465,22 +816,86 @@ static inline void verity_bv_skip_block(struct dm_verity *v,
 	bio_advance_iter(bio, iter, 1 << v->data_dev_block_bits);
 }
 
+struct verity_batch_entry {
+	sector_t block;
+	struct bvec_iter start;
+	u8 want_digest[HASH_MAX_DIGESTSIZE];
+	u8 real_digest[HASH_MAX_DIGESTSIZE];
+};
+
+/*
+ * Hash and check a batch of data blocks whose expected digests have already
+ * been looked up. Keeping the tree walk (which may sleep in dm-bufio) out of
+ * this loop lets the blocks be hashed back to back with the hash code and
+ * state hot in cache.
+ */
+static int verity_verify_batch(struct dm_verity *v, struct dm_verity_io *io,
+			       struct verity_batch_entry *batch, unsigned n)
+{
+	struct bio *bio = dm_bio_from_per_bio_data(io, v->ti->per_io_data_size);
+	unsigned i;
+	int r;
+
+	for (i = 0; i < n; i++) {
+		struct bvec_iter iter = batch[i].start;
+
+		r = verity_hash_io_block(v, io, &iter, batch[i].real_digest);
+		if (unlikely(r < 0))
+			return r;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct verity_batch_entry *e = &batch[i];
+
+		if (likely(memcmp(e->real_digest, e->want_digest,
+				  v->digest_size) == 0)) {
+			if (v->validated_blocks)
+				set_bit(e->block, v->validated_blocks);
+			continue;
+		}
+
+		/* FEC compares against the digests kept in the io */
+		memcpy(verity_io_want_digest(v, io), e->want_digest,
+		       v->digest_size);
+		memcpy(verity_io_real_digest(v, io), e->real_digest,
+		       v->digest_size);
+
+		if (verity_fec_decode(v, io, DM_VERITY_BLOCK_TYPE_DATA,
+				      e->block, NULL, &e->start) == 0)
+			continue;
+
+		if (bio->bi_status) {
+			/*
+			 * Error correction failed; Just return error
+			 */
+			return -EIO;
+		}
+		if (verity_handle_err(v, DM_VERITY_BLOCK_TYPE_DATA, e->block))
+			return -EIO;
+	}
+
+	return 0;
+}
+
 /*
  * Verify one "dm_verity_io" structure.
+ *
+ * Data blocks are verified in batches of up to DM_VERITY_MAX_BATCH: the
+ * expected digests are looked up first, then all blocks of the batch are
+ * hashed in one pass.
  */
 static int verity_verify_io(struct dm_verity_io *io)
 {
 	bool is_zero;
 	struct dm_verity *v = io->v;
-	struct bvec_iter start;
-	unsigned b;
-	struct crypto_wait wait;
+	struct verity_batch_entry batch[DM_VERITY_MAX_BATCH];
+	unsigned b, n = 0;
+	int r;
 	struct bio *bio = dm_bio_from_per_bio_data(io, v->ti->per_io_data_size);
 
 	for (b = 0; b < io->n_blocks; b++) {
-		int r;
 		sector_t cur_block = io->block + b;
-		struct ahash_request *req = verity_io_hash_req(v, io);
+		struct verity_batch_entry *e = &batch[n];
 
 		if (v->validated_blocks && bio->bi_status == BLK_STS_OK &&
 		    likely(test_bit(cur_block, v->validated_blocks))) {
@@ -488,8 +903,7 @@ static int verity_verify_io(struct dm_verity_io *io)
 			continue;
 		}
 
-		r = verity_hash_for_block(v, io, cur_block,
-					  verity_io_want_digest(v, io),
+		r = verity_hash_for_block(v, io, cur_block, e->want_digest,
 					  &is_zero);
 		if (unlikely(r < 0))
 			return r;
@@ -507,42 +921,21 @@ static int verity_verify_io(struct dm_verity_io *io)
 			continue;
 		}
 
-		r = verity_hash_init(v, req, &wait);
-		if (unlikely(r < 0))
-			return r;
-
-		start = io->iter;
-		r = verity_for_io_block(v, io, &io->iter, &wait);
-		if (unlikely(r < 0))
-			return r;
-
-		r = verity_hash_final(v, req, verity_io_real_digest(v, io),
-					&wait);
-		if (unlikely(r < 0))
-			return r;
+		e->block = cur_block;
+		e->start = io->iter;
+		verity_bv_skip_block(v, io, &io->iter);
 
-		if (likely(memcmp(verity_io_real_digest(v, io),
-				  verity_io_want_digest(v, io), v->digest_size) == 0)) {
-			if (v->validated_blocks)
-				set_bit(cur_block, v->validated_blocks);
-			continue;
-		}
-		else if (verity_fec_decode(v, io, DM_VERITY_BLOCK_TYPE_DATA,
-					   cur_block, NULL, &start) == 0)
-			continue;
-		else {
-			if (bio->bi_status) {
-				/*
-				 * Error correction failed; Just return error
-				 */
-				return -EIO;
-			}
-			if (verity_handle_err(v, DM_VERITY_BLOCK_TYPE_DATA,
-					      cur_block))
-				return -EIO;
+		if (++n == DM_VERITY_MAX_BATCH) {
+			r = verity_verify_batch(v, io, batch, n);
+			if (unlikely(r < 0))
+				return r;
+			n = 0;
 		}
 	}
 
+	if (n)
+		return verity_verify_batch(v, io, batch, n);
+
 	return 0;
 }
 
@@ -592,6 +985,23 @@ static void verity_end_io(struct bio *bio)
 	queue_work(io->v->verify_wq, &io->work);
 }
 
+/*
+ * Remember which level 0 hash blocks were only read because of the prefetch
+ * cluster, so that verity_verify_level() can tell useful from wasted
+ * prefetch.
+ */
+static void verity_mark_prefetched(struct dm_verity *v, sector_t start,
+				   sector_t end)
+{
+	sector_t b;
+
+	/* an aligned cluster may reach down into the level above */
+	start = max(start, v->hash_level_block[0]);
+	for (b = start; b < end; b++)
+		if (!test_and_set_bit(b - v->hash_level_block[0], v->prefetched))
+			atomic64_inc(&v->prefetch_issued);
+}
+
 /*
  * Prefetch buffers for the specified io.
  * The root buffer is not prefetched, it is assumed that it will be cached
@@ -610,19 +1020,22 @@ static void verity_prefetch_io(struct work_struct *work)
 		verity_hash_at_level(v, pw->block, i, &hash_block_start, NULL);
 		verity_hash_at_level(v, pw->block + pw->n_blocks - 1, i, &hash_block_end, NULL);
 		if (!i) {
-			unsigned cluster = READ_ONCE(dm_verity_prefetch_cluster);
+			unsigned cluster = pw->cluster;
+			sector_t start = hash_block_start, end = hash_block_end;
 
-			cluster >>= v->data_dev_block_bits;
-			if (unlikely(!cluster))
+			if (unlikely(cluster <= 1))
 				goto no_prefetch_cluster;
 
-			if (unlikely(cluster & (cluster - 1)))
-				cluster = 1 << __fls(cluster);
-
 			hash_block_start &= ~(sector_t)(cluster - 1);
 			hash_block_end |= cluster - 1;
 			if (unlikely(hash_block_end >= v->hash_blocks))
 				hash_block_end = v->hash_blocks - 1;
+
+			if (v->prefetched) {
+				verity_mark_prefetched(v, hash_block_start, start);
+				verity_mark_prefetched(v, end + 1,
+						       hash_block_end + 1);
+			}
 		}
 no_prefetch_cluster:
 		dm_bufio_prefetch(v->bufio, hash_block_start,
@@ -632,10 +1045,67 @@ static void verity_prefetch_io(struct work_struct *work)
 	kfree(pw);
 }
 
+/*
+ * Pick the level 0 prefetch cluster (in hash blocks) for an io.
+ *
+ * Like ondemand readahead, reads that continue where one of the recently
+ * seen streams stopped are treated as sequential and double the stream's
+ * cluster, up to prefetch_cluster << DM_VERITY_STREAM_MAX_SHIFT. Anything
+ * else replaces the least recently used stream and starts with no cluster,
+ * so random reads only fetch the hash blocks they need.
+ */
+static unsigned verity_prefetch_cluster(struct dm_verity *v,
+					struct dm_verity_io *io)
+{
+	unsigned base = READ_ONCE(dm_verity_prefetch_cluster);
+	struct dm_verity_prefetch_stream *s, *lru = NULL;
+	unsigned cluster;
+	int i;
+
+	base >>= v->data_dev_block_bits;
+	if (unlikely(!base))
+		return 0;
+
+	if (unlikely(base & (base - 1)))
+		base = 1 << __fls(base);
+
+	if (!READ_ONCE(dm_verity_adaptive_prefetch))
+		return base;
+
+	spin_lock(&v->prefetch_lock);
+	for (i = 0; i < DM_VERITY_PREFETCH_STREAMS; i++) {
+		s = &v->streams[i];
+		if (io->block >= s->next_block &&
+		    io->block - s->next_block <= DM_VERITY_STREAM_MAX_GAP &&
+		    s->last_used)
+			goto sequential;
+		if (!lru || time_before(s->last_used, lru->last_used))
+			lru = s;
+	}
+
+	s = lru;
+	s->cluster = 0;
+	goto out;
+
+sequential:
+	if (!s->cluster)
+		s->cluster = base;
+	else if (s->cluster < base << DM_VERITY_STREAM_MAX_SHIFT)
+		s->cluster <<= 1;
+out:
+	s->next_block = io->block + io->n_blocks;
+	s->last_used = jiffies ?: 1;
+	cluster = s->cluster;
+	spin_unlock(&v->prefetch_lock);
+
+	return cluster;
+}
+
 static void verity_submit_prefetch(struct dm_verity *v, struct dm_verity_io *io)
 {
 	sector_t block = io->block;
 	unsigned int n_blocks = io->n_blocks;
+	unsigned int cluster = verity_prefetch_cluster(v, io);
 	struct dm_verity_prefetch_work *pw;
 
 	if (v->validated_blocks) {
@@ -660,6 +1130,7 @@ static void verity_submit_prefetch(struct dm_verity *v, struct dm_verity_io *io)
 	pw->v = v;
 	pw->block = block;
 	pw->n_blocks = n_blocks;
+	pw->cluster = cluster;
 	queue_work(v->verify_wq, &pw->work);
 }
 
@@ -710,7 +1181,10 @@ static int verity_map(struct dm_target *ti, struct bio *bio)
 }
 
 /*
- * Status: V (valid) or C (corruption found)
+ * Status: V (valid) or C (corruption found). With the report_stats feature
+ * argument, followed by the verified hash block cache hits and misses (0 if
+ * the cache is disabled) and the number of hash blocks read by the prefetch
+ * cluster that were used and that were not used (yet).
  */
 static void verity_status(struct dm_target *ti, status_type_t type,
 			  unsigned status_flags, char *result, unsigned maxlen)
@@ -719,10 +1193,21 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 	unsigned args = 0;
 	unsigned sz = 0;
 	unsigned x;
+	unsigned long long issued, useful;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
 		DMEMIT("%c", v->hash_failed ? 'C' : 'V');
+		if (!v->report_stats)
+			break;
+		DMEMIT(" %llu %llu",
+		       v->hash_cache ?
+		       (unsigned long long)atomic64_read(&v->hash_cache->hits) : 0,
+		       v->hash_cache ?
+		       (unsigned long long)atomic64_read(&v->hash_cache->misses) : 0);
+		issued = atomic64_read(&v->prefetch_issued);
+		useful = atomic64_read(&v->prefetch_useful);
+		DMEMIT(" %llu %llu", useful, issued - min(useful, issued));
 		break;
 	case STATUSTYPE_TABLE:
 		DMEMIT("%u %s %s %u %u %llu %llu %s ",
@@ -751,6 +1236,8 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 			args++;
 		if (v->validated_blocks)
 			args++;
+		if (v->report_stats)
+			args++;
 		if (v->signature_key_desc)
 			args += DM_VERITY_ROOT_HASH_VERIFICATION_OPTS;
 		if (!args)
@@ -776,6 +1263,8 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 			DMEMIT(" " DM_VERITY_OPT_IGN_ZEROES);
 		if (v->validated_blocks)
 			DMEMIT(" " DM_VERITY_OPT_AT_MOST_ONCE);
+		if (v->report_stats)
+			DMEMIT(" " DM_VERITY_OPT_STATS);
 		sz = verity_fec_status_table(v, sz, result, maxlen);
 		if (v->signature_key_desc)
 			DMEMIT(" " DM_VERITY_ROOT_HASH_VERIFICATION_OPT_SIG_KEY
@@ -827,6 +1316,99 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 	}
 }
 
+/*
+ * Benchmark mode: "benchmark [<blocks>]" hashes <blocks> data blocks from
+ * memory through the ahash path and, if available, the synchronous fast
+ * path and reports MB/s for each. Cycles per byte are estimated from the
+ * current frequency of the CPU the run finished on, so pin the caller and
+ * fix the cpufreq governor for stable numbers.
+ */
+#define DM_VERITY_BENCH_BLOCKS		4096
+#define DM_VERITY_BENCH_MAX_BLOCKS	(1 << 20)
+
+static int verity_bench_run(struct dm_verity *v, bool fast, void *req,
+			    const u8 *data, unsigned blocks, u64 *ns,
+			    unsigned *khz)
+{
+	size_t len = 1 << v->data_dev_block_bits;
+	u8 digest[HASH_MAX_DIGESTSIZE];
+	unsigned i;
+	u64 start;
+	int r = 0;
+
+	start = ktime_get_ns();
+	for (i = 0; i < blocks && !r; i++) {
+		if (fast)
+			r = verity_shash(v, req, data, len, digest);
+		else
+			r = verity_ahash(v, req, data, len, digest);
+		if (!(i & 63))
+			cond_resched();
+	}
+	*ns = max_t(u64, ktime_get_ns() - start, 1);
+	*khz = cpufreq_quick_get(raw_smp_processor_id());
+
+	return r;
+}
+
+static int verity_benchmark(struct dm_verity *v, unsigned argc, char **argv,
+			    char *result, unsigned maxlen)
+{
+	unsigned blocks = DM_VERITY_BENCH_BLOCKS;
+	unsigned sz = 0;
+	void *req;
+	u8 *data;
+	int pass, r = 0;
+
+	if (argc > 1 && (kstrtouint(argv[1], 10, &blocks) || !blocks ||
+			 blocks > DM_VERITY_BENCH_MAX_BLOCKS))
+		return -EINVAL;
+
+	req = kmalloc(v->ahash_reqsize, GFP_KERNEL);
+	data = kmalloc(1 << v->data_dev_block_bits, GFP_KERNEL);
+	if (!req || !data) {
+		r = -ENOMEM;
+		goto out;
+	}
+	get_random_bytes(data, 1 << v->data_dev_block_bits);
+
+	for (pass = 0; pass < 2; pass++) {
+		bool fast = pass;
+		u64 bytes = (u64)blocks << v->data_dev_block_bits;
+		u64 ns, cpb;
+		unsigned khz;
+
+		if (fast && !v->shash_tfm)
+			break;
+
+		r = verity_bench_run(v, fast, req, data, blocks, &ns, &khz);
+		if (r)
+			goto out;
+
+		cpb = div64_u64(ns * khz, bytes * 10000);
+		DMEMIT("%s%s: %llu MB/s %llu.%02llu cycles/byte",
+		       pass ? " " : "", fast ? "shash" : "ahash",
+		       div64_u64(bytes * 1000, ns), cpb / 100, cpb % 100);
+	}
+	r = 1;
+out:
+	kfree(data);
+	kfree(req);
+	return r;
+}
+
+static int verity_message(struct dm_target *ti, unsigned argc, char **argv,
+			  char *result, unsigned maxlen)
+{
+	struct dm_verity *v = ti->private;
+
+	if (argc && !strcasecmp(argv[0], "benchmark"))
+		return verity_benchmark(v, argc, argv, result, maxlen);
+
+	DMERR("unrecognised message received.");
+	return -EINVAL;
+}
+
 static int verity_prepare_ioctl(struct dm_target *ti, struct block_device **bdev)
 {
 	struct dm_verity *v = ti->private;
@@ -870,11 +1452,19 @@ static void verity_dtr(struct dm_target *ti)
 	if (v->bufio)
 		dm_bufio_client_destroy(v->bufio);
 
+	verity_hash_cache_put(v);
+
 	kvfree(v->validated_blocks);
+	kvfree(v->prefetched);
 	kfree(v->salt);
 	kfree(v->root_digest);
 	kfree(v->zero_digest);
 
+	kfree(v->initial_hashstate);
+
+	if (v->shash_tfm)
+		crypto_free_shash(v->shash_tfm);
+
 	if (v->tfm)
 		crypto_free_ahash(v->tfm);
 
@@ -893,6 +1483,61 @@ static void verity_dtr(struct dm_target *ti)
 	kfree(v);
 }
 
+/*
+ * Use a synchronous shash when the selected hash implementation is not
+ * asynchronous anyway (e.g. the arm64 SHA-2 instructions). This avoids the
+ * ahash request and scatterlist setup for every block, and lets the state
+ * after hashing the salt be computed once and imported per block.
+ */
+static int verity_setup_shash(struct dm_verity *v)
+{
+	struct crypto_shash *shash;
+	struct shash_desc *desc;
+	int r;
+
+	shash = crypto_alloc_shash(v->alg_name, 0, 0);
+	if (IS_ERR(shash))
+		return 0;
+
+	if (strcmp(crypto_tfm_alg_driver_name(crypto_shash_tfm(shash)),
+		   crypto_ahash_driver_name(v->tfm))) {
+		/* the ahash is backed by a different (offload) driver */
+		crypto_free_shash(shash);
+		return 0;
+	}
+
+	v->initial_hashstate = kmalloc(crypto_shash_statesize(shash),
+				       GFP_KERNEL);
+	desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(shash),
+		       GFP_KERNEL);
+	if (!v->initial_hashstate || !desc) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	desc->tfm = shash;
+	r = crypto_shash_init(desc);
+	if (!r && v->salt_size && v->version >= 1)
+		r = crypto_shash_update(desc, v->salt, v->salt_size);
+	if (!r)
+		r = crypto_shash_export(desc, v->initial_hashstate);
+	if (r)
+		goto out;
+
+	v->shash_tfm = shash;
+	v->ahash_reqsize = max_t(unsigned int, v->ahash_reqsize,
+				 sizeof(*desc) + crypto_shash_descsize(shash));
+	DMINFO("%s using synchronous fast path", v->alg_name);
+out:
+	kfree(desc);
+	if (r) {
+		kfree(v->initial_hashstate);
+		v->initial_hashstate = NULL;
+		crypto_free_shash(shash);
+	}
+	return r;
+}
+
 static int verity_alloc_most_once(struct dm_verity *v)
 {
 	struct dm_target *ti = v->ti;
@@ -1012,6 +1657,10 @@ static int verity_parse_opt_args(struct dm_arg_set *as, struct dm_verity *v,
 				return r;
 			continue;
 
+		} else if (!strcasecmp(arg_name, DM_VERITY_OPT_STATS)) {
+			v->report_stats = true;
+			continue;
+
 		} else if (verity_is_fec_opt_arg(arg_name)) {
 			r = verity_fec_parse_opt_args(as, v, &argc, arg_name);
 			if (r)
@@ -1211,6 +1860,12 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		}
 	}
 
+	r = verity_setup_shash(v);
+	if (r) {
+		ti->error = "Cannot initialize hash state";
+		goto bad;
+	}
+
 	argv += 10;
 	argc -= 10;
 
@@ -1280,6 +1935,18 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad;
 	}
 
+	verity_hash_cache_get(v);
+
+	spin_lock_init(&v->prefetch_lock);
+	atomic64_set(&v->prefetch_issued, 0);
+	atomic64_set(&v->prefetch_useful, 0);
+	/* only level 0 uses a prefetch cluster, and only with 2+ levels */
+	if (v->levels >= 2)
+		v->prefetched = kvcalloc(BITS_TO_LONGS(v->hash_blocks -
+						       v->hash_level_block[0]),
+					 sizeof(unsigned long),
+					 GFP_KERNEL | __GFP_NOWARN);
+
 	/*
 	 * Using WQ_HIGHPRI improves throughput and completion latency by
 	 * reducing wait times when reading from a dm-verity device.
@@ -1321,12 +1988,13 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 static struct target_type verity_target = {
 	.name		= "verity",
 	.features	= DM_TARGET_IMMUTABLE,
-	.version	= {1, 8, 0},
+	.version	= {1, 10, 0},
 	.module		= THIS_MODULE,
 	.ctr		= verity_ctr,
 	.dtr		= verity_dtr,
 	.map		= verity_map,
 	.status		= verity_status,
+	.message	= verity_message,
 	.prepare_ioctl	= verity_prepare_ioctl,
 	.iterate_devices = verity_iterate_devices,
 	.io_hints	= verity_io_hints,
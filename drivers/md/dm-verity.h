@@ -17,6 +17,9 @@
 
 #define DM_VERITY_MAX_LEVELS		63
 
+/* the number of data blocks of one bio that are hashed back to back */
+#define DM_VERITY_MAX_BATCH		4
+
 enum verity_mode {
 	DM_VERITY_MODE_EIO,
 	DM_VERITY_MODE_LOGGING,
@@ -29,7 +32,17 @@ enum verity_block_type {
 	DM_VERITY_BLOCK_TYPE_METADATA
 };
 
+/* the number of concurrent sequential readers tracked for prefetch */
+#define DM_VERITY_PREFETCH_STREAMS	4
+
 struct dm_verity_fec;
+struct dm_verity_hash_cache;
+
+struct dm_verity_prefetch_stream {
+	sector_t next_block;	/* data block a sequential reader reads next */
+	unsigned cluster;	/* prefetch cluster in hash blocks, power of 2 */
+	unsigned long last_used;	/* jiffies */
+};
 
 struct dm_verity {
 	struct dm_dev *data_dev;
@@ -38,6 +51,8 @@ struct dm_verity {
 	struct dm_bufio_client *bufio;
 	char *alg_name;
 	struct crypto_ahash *tfm;
+	struct crypto_shash *shash_tfm;	/* synchronous fast path, or NULL */
+	u8 *initial_hashstate;	/* shash state after hashing the salt */
 	u8 *root_digest;	/* digest of the root block */
 	u8 *salt;		/* salt: its size is salt_size */
 	u8 *zero_digest;	/* digest for a zero block */
@@ -53,6 +68,7 @@ struct dm_verity {
 	unsigned char version;
 	unsigned digest_size;	/* digest size for the current hash algorithm */
 	unsigned int ahash_reqsize;/* the size of temporary space for crypto */
+				   /* (an ahash request or a shash desc) */
 	int hash_failed;	/* set to 1 if hash of any block failed */
 	enum verity_mode mode;	/* mode for handling verification errors */
 	unsigned corrupted_errs;/* Number of errors for corrupted blocks */
@@ -64,6 +80,15 @@ struct dm_verity {
 
 	struct dm_verity_fec *fec;	/* forward error correction */
 	unsigned long *validated_blocks; /* bitset blocks validated */
+	struct dm_verity_hash_cache *hash_cache; /* verified hash blocks */
+	bool report_stats;	/* append counters to the INFO status */
+
+	/* adaptive prefetch */
+	spinlock_t prefetch_lock;
+	struct dm_verity_prefetch_stream streams[DM_VERITY_PREFETCH_STREAMS];
+	unsigned long *prefetched; /* level 0 hash blocks prefetched, not used */
+	atomic64_t prefetch_issued;
+	atomic64_t prefetch_useful;
 
 	char *signature_key_desc; /* signature keyring reference */
 };
@@ -99,6 +124,16 @@ static inline struct ahash_request *verity_io_hash_req(struct dm_verity *v,
 	return (struct ahash_request *)(io + 1);
 }
 
+/*
+ * When the synchronous fast path is in use, the hash request area holds a
+ * shash descriptor instead of an ahash request.
+ */
+static inline struct shash_desc *verity_io_hash_desc(struct dm_verity *v,
+						     struct dm_verity_io *io)
+{
+	return (struct shash_desc *)(io + 1);
+}
+
 static inline u8 *verity_io_real_digest(struct dm_verity *v,
 					struct dm_verity_io *io)
 {
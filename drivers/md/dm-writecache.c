@@ -16,6 +16,7 @@
 #include <linux/pfn_t.h>
 #include <linux/libnvdimm.h>
 #include <linux/delay.h>
+#include <linux/hash.h>
 #include "dm-io-tracker.h"
 
 #define DM_MSG_PREFIX "writecache"
@@ -31,6 +32,9 @@
 #define MAX_AGE_DIV			16
 #define MAX_AGE_UNSPECIFIED		-1UL
 #define PAUSE_WRITEBACK			(HZ * 3)
+#define READ_PROMOTE_WINDOW_MSEC	1000
+#define READ_PROMOTE_HASH_BITS		12
+#define READ_PROMOTE_MAX_BLOCKS		16
 
 #define BITMAP_GRANULARITY	65536
 #if BITMAP_GRANULARITY < PAGE_SIZE
@@ -177,12 +181,21 @@ struct dm_writecache {
 	bool cleaner_set:1;
 	bool metadata_only:1;
 	bool pause_set:1;
+	bool read_promote_window_set:1;
 
 	unsigned high_wm_percent_value;
 	unsigned low_wm_percent_value;
 	unsigned autocommit_time_value;
 	unsigned max_age_value;
 	unsigned pause_value;
+	unsigned read_promote_window_value;
+
+	unsigned read_promote;
+	unsigned long read_promote_window;
+	struct wc_read_count *read_counts;
+	unsigned long origin_write_gen;
+	atomic_t origin_writes_in_flight;
+	atomic_t promotions_in_progress;
 
 	unsigned writeback_all;
 	struct workqueue_struct *writeback_wq;
@@ -218,9 +231,22 @@ struct dm_writecache {
 		unsigned long long writes_blocked_on_freelist;
 		unsigned long long flushes;
 		unsigned long long discards;
+		unsigned long long read_promotions;
+		unsigned long long read_promotions_aborted;
 	} stats;
 };
 
+/*
+ * Read admission: misses are counted in a small direct mapped table and a
+ * block that is read wc->read_promote times within the window is copied
+ * into the cache. Collisions simply restart the count.
+ */
+struct wc_read_count {
+	uint64_t block;
+	unsigned count;
+	unsigned long stamp;
+};
+
 #define WB_LIST_INLINE		16
 
 struct writeback_struct {
@@ -240,6 +266,15 @@ struct copy_struct {
 	int error;
 };
 
+struct promote_struct {
+	struct work_struct work;
+	struct dm_writecache *wc;
+	struct wc_entry *e;
+	uint64_t block;
+	unsigned long origin_write_gen;
+	int error;
+};
+
 DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(dm_writecache_throttle,
 					    "A percentage of time allocated for data copying");
 
@@ -747,6 +782,8 @@ static struct wc_entry *writecache_pop_from_freelist(struct dm_writecache *wc, s
 
 static void writecache_free_entry(struct dm_writecache *wc, struct wc_entry *e)
 {
+	/* the origin may now be newer than what an in-flight promotion read */
+	wc->origin_write_gen++;
 	writecache_unlink(wc, e);
 	writecache_add_to_freelist(wc, e);
 	clear_seq_count(wc, e);
@@ -881,6 +918,8 @@ static void writecache_discard(struct dm_writecache *wc, sector_t start, sector_
 	struct wc_entry *e;
 	bool discarded_something = false;
 
+	wc->origin_write_gen++;
+
 	e = writecache_find_entry(wc, start, WFE_RETURN_FOLLOWING | WFE_LOWEST_SEQ);
 	if (unlikely(!e))
 		return;
@@ -925,6 +964,9 @@ static void writecache_suspend(struct dm_target *ti)
 	struct dm_writecache *wc = ti->private;
 	bool flush_on_suspend;
 
+	wait_var_event(&wc->promotions_in_progress,
+		       !atomic_read(&wc->promotions_in_progress));
+
 	del_timer_sync(&wc->autocommit_timer);
 	del_timer_sync(&wc->max_age_timer);
 
@@ -1182,6 +1224,27 @@ static int process_clear_stats_mesg(unsigned argc, char **argv, struct dm_writec
 	return 0;
 }
 
+static int process_read_promote_mesg(unsigned argc, char **argv, struct dm_writecache *wc)
+{
+	unsigned read_promote;
+	char dummy;
+
+	if (argc != 2)
+		return -EINVAL;
+	if (sscanf(argv[1], "%u%c", &read_promote, &dummy) != 1)
+		return -EINVAL;
+
+	wc_lock(wc);
+	if (read_promote && !wc->read_counts) {
+		wc_unlock(wc);
+		return -EINVAL;
+	}
+	wc->read_promote = read_promote;
+	wc_unlock(wc);
+
+	return 0;
+}
+
 static int writecache_message(struct dm_target *ti, unsigned argc, char **argv,
 			      char *result, unsigned maxlen)
 {
@@ -1196,6 +1259,8 @@ static int writecache_message(struct dm_target *ti, unsigned argc, char **argv,
 		r = process_cleaner_mesg(argc, argv, wc);
 	else if (!strcasecmp(argv[0], "clear_stats"))
 		r = process_clear_stats_mesg(argc, argv, wc);
+	else if (!strcasecmp(argv[0], "read_promote"))
+		r = process_read_promote_mesg(argc, argv, wc);
 	else
 		DMERR("unrecognised message received: %s", argv[0]);
 
@@ -1298,6 +1363,8 @@ static int writecache_flush_thread(void *data)
 		if (bio_op(bio) == REQ_OP_DISCARD) {
 			writecache_discard(wc, bio->bi_iter.bi_sector,
 					   bio_end_sector(bio));
+			atomic_inc(&wc->origin_writes_in_flight);
+			bio->bi_private = (void *)3;
 			wc_unlock(wc);
 			bio_set_dev(bio, wc->dev->bdev);
 			submit_bio_noacct(bio);
@@ -1339,6 +1406,123 @@ static void writecache_map_remap_origin(struct dm_writecache *wc, struct bio *bi
 	}
 }
 
+static void writecache_promote_work(struct work_struct *work)
+{
+	struct promote_struct *p = container_of(work, struct promote_struct, work);
+	struct dm_writecache *wc = p->wc;
+	struct wc_entry *e = p->e;
+
+	wc_lock(wc);
+	if (unlikely(p->error) || writecache_has_error(wc) ||
+	    p->origin_write_gen != wc->origin_write_gen ||
+	    writecache_find_entry(wc, p->block, 0)) {
+		writecache_add_to_freelist(wc, e);
+		if (unlikely(waitqueue_active(&wc->freelist_wait)))
+			wake_up(&wc->freelist_wait);
+		wc->stats.read_promotions_aborted++;
+	} else {
+		/*
+		 * The block is now an ordinary dirty entry: the on-disk format
+		 * has no notion of clean blocks, so it will be written back
+		 * (with unchanged data) before it is reused.
+		 */
+		write_original_sector_seq_count(wc, e, p->block, wc->seq_count);
+		writecache_insert_entry(wc, e);
+		wc->stats.read_promotions++;
+		if (unlikely(++wc->uncommitted_blocks >= wc->autocommit_blocks)) {
+			wc->uncommitted_blocks = 0;
+			queue_work(wc->writeback_wq, &wc->flush_work);
+		} else {
+			writecache_schedule_autocommit(wc);
+		}
+	}
+	wc_unlock(wc);
+
+	kfree(p);
+	if (atomic_dec_and_test(&wc->promotions_in_progress))
+		wake_up_var(&wc->promotions_in_progress);
+}
+
+static void writecache_promote_endio(int read_err, unsigned long write_err, void *ptr)
+{
+	struct promote_struct *p = ptr;
+
+	p->error = likely(!(read_err | write_err)) ? 0 : -EIO;
+	queue_work(p->wc->writeback_wq, &p->work);
+}
+
+static void writecache_promote_block(struct dm_writecache *wc, uint64_t block)
+{
+	struct promote_struct *p;
+	struct dm_io_region from, to;
+	struct wc_entry *e;
+
+	/* never let clean data push the cache into writeback */
+	if (wc->freelist_size + wc->writeback_size <= wc->freelist_high_watermark + 1)
+		return;
+
+	/*
+	 * origin_write_gen is bumped when a write is submitted, so it can't
+	 * tell whether the copy below reads the origin before or after a write
+	 * that is already in flight.  Only promote while there is none.
+	 */
+	if (atomic_read(&wc->origin_writes_in_flight))
+		return;
+
+	p = kmalloc(sizeof(struct promote_struct), GFP_NOWAIT | __GFP_NOWARN);
+	if (unlikely(!p))
+		return;
+	e = writecache_pop_from_freelist(wc, (sector_t)-1);
+	if (unlikely(!e)) {
+		kfree(p);
+		return;
+	}
+
+	INIT_WORK(&p->work, writecache_promote_work);
+	p->wc = wc;
+	p->e = e;
+	p->block = block;
+	p->origin_write_gen = wc->origin_write_gen;
+	atomic_inc(&wc->promotions_in_progress);
+
+	from.bdev = wc->dev->bdev;
+	from.sector = block;
+	from.count = wc->block_size >> SECTOR_SHIFT;
+	to.bdev = wc->ssd_dev->bdev;
+	to.sector = cache_sector(wc, e);
+	to.count = from.count;
+
+	dm_kcopyd_copy(wc->dm_kcopyd, &from, 1, &to, 0, writecache_promote_endio, p);
+}
+
+static void writecache_read_admission(struct dm_writecache *wc, struct bio *bio)
+{
+	uint64_t block = bio->bi_iter.bi_sector;
+	unsigned n_blocks = bio->bi_iter.bi_size >> wc->block_size_bits;
+
+	/* large reads are streaming, keep them from flushing the cache */
+	if (n_blocks > READ_PROMOTE_MAX_BLOCKS)
+		return;
+	if (unlikely(wc->cleaner) || wc->metadata_only || writecache_has_error(wc))
+		return;
+
+	for (; n_blocks; n_blocks--, block += wc->block_size >> SECTOR_SHIFT) {
+		struct wc_read_count *rc =
+			&wc->read_counts[hash_64(block, READ_PROMOTE_HASH_BITS)];
+
+		if (rc->block != block ||
+		    time_after(jiffies, rc->stamp + wc->read_promote_window)) {
+			rc->block = block;
+			rc->count = 0;
+			rc->stamp = jiffies;
+		}
+		if (++rc->count < wc->read_promote)
+			continue;
+		rc->count = 0;
+		writecache_promote_block(wc, block);
+	}
+}
+
 static enum wc_map_op writecache_map_read(struct dm_writecache *wc, struct bio *bio)
 {
 	enum wc_map_op map_op;
@@ -1365,6 +1549,8 @@ static enum wc_map_op writecache_map_read(struct dm_writecache *wc, struct bio *
 	} else {
 		writecache_map_remap_origin(wc, bio, e);
 		wc->stats.reads += (bio->bi_iter.bi_size - wc->block_size) >> wc->block_size_bits;
+		if (wc->read_promote)
+			writecache_read_admission(wc, bio);
 		map_op = WC_MAP_REMAP_ORIGIN;
 	}
 
@@ -1457,6 +1643,7 @@ static enum wc_map_op writecache_map_write(struct dm_writecache *wc, struct bio
 		if (unlikely(!e)) {
 			if (!WC_MODE_PMEM(wc) && !found_entry) {
 direct_write:
+				wc->origin_write_gen++;
 				e = writecache_find_entry(wc, bio->bi_iter.bi_sector, WFE_RETURN_FOLLOWING);
 				writecache_map_remap_origin(wc, bio, e);
 				wc->stats.writes_around += bio->bi_iter.bi_size >> wc->block_size_bits;
@@ -1564,6 +1751,10 @@ static int writecache_map(struct dm_target *ti, struct bio *bio)
 done:
 	switch (map_op) {
 	case WC_MAP_REMAP_ORIGIN:
+		if (op_is_write(bio_op(bio))) {
+			atomic_inc(&wc->origin_writes_in_flight);
+			bio->bi_private = (void *)3;
+		}
 		if (likely(wc->pause != 0)) {
 			if (bio_op(bio) == REQ_OP_WRITE) {
 				dm_iot_io_begin(&wc->iot, 1);
@@ -1612,6 +1803,9 @@ static int writecache_end_io(struct dm_target *ti, struct bio *bio, blk_status_t
 				wake_up(&wc->bio_in_progress_wait[dir]);
 	} else if (bio->bi_private == (void *)2) {
 		dm_iot_io_end(&wc->iot, 1);
+		atomic_dec(&wc->origin_writes_in_flight);
+	} else if (bio->bi_private == (void *)3) {
+		atomic_dec(&wc->origin_writes_in_flight);
 	}
 	return 0;
 }
@@ -2205,6 +2399,8 @@ static void writecache_dtr(struct dm_target *ti)
 
 	vfree(wc->dirty_bitmap);
 
+	kvfree(wc->read_counts);
+
 	kfree(wc);
 }
 
@@ -2223,7 +2419,7 @@ static int writecache_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	struct wc_memory_superblock s;
 
 	static struct dm_arg _args[] = {
-		{0, 18, "Invalid number of feature args"},
+		{0, 22, "Invalid number of feature args"},
 	};
 
 	as.argc = argc;
@@ -2467,6 +2663,24 @@ static int writecache_ctr(struct dm_target *ti, unsigned argc, char **argv)
 			wc->pause = msecs_to_jiffies(pause_msecs);
 			wc->pause_set = true;
 			wc->pause_value = pause_msecs;
+		} else if (!strcasecmp(string, "read_promote") && opt_params >= 1) {
+			if (WC_MODE_PMEM(wc))
+				goto invalid_optional;
+			string = dm_shift_arg(&as), opt_params--;
+			if (sscanf(string, "%u%c", &wc->read_promote, &dummy) != 1)
+				goto invalid_optional;
+		} else if (!strcasecmp(string, "read_promote_window") && opt_params >= 1) {
+			unsigned window_msecs;
+			if (WC_MODE_PMEM(wc))
+				goto invalid_optional;
+			string = dm_shift_arg(&as), opt_params--;
+			if (sscanf(string, "%u%c", &window_msecs, &dummy) != 1)
+				goto invalid_optional;
+			if (!window_msecs || window_msecs > 3600000)
+				goto invalid_optional;
+			wc->read_promote_window = msecs_to_jiffies(window_msecs);
+			wc->read_promote_window_set = true;
+			wc->read_promote_window_value = window_msecs;
 		} else {
 invalid_optional:
 			r = -EINVAL;
@@ -2550,6 +2764,17 @@ static int writecache_ctr(struct dm_target *ti, unsigned argc, char **argv)
 			goto bad;
 		}
 
+		/* allocated even if disabled, so that it can be turned on by a message */
+		wc->read_counts = kvcalloc(1 << READ_PROMOTE_HASH_BITS,
+					   sizeof(struct wc_read_count), GFP_KERNEL);
+		if (!wc->read_counts) {
+			r = -ENOMEM;
+			ti->error = "Unable to allocate read admission table";
+			goto bad;
+		}
+		if (!wc->read_promote_window_set)
+			wc->read_promote_window = msecs_to_jiffies(READ_PROMOTE_WINDOW_MSEC);
+
 		r = writecache_read_metadata(wc, wc->block_size >> SECTOR_SHIFT);
 		if (r) {
 			ti->error = "Unable to read first block of metadata";
@@ -2664,7 +2889,7 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%ld %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		DMEMIT("%ld %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
 		       writecache_has_error(wc),
 		       (unsigned long long)wc->n_blocks, (unsigned long long)wc->freelist_size,
 		       (unsigned long long)wc->writeback_size,
@@ -2677,7 +2902,9 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 		       wc->stats.writes_allocate,
 		       wc->stats.writes_blocked_on_freelist,
 		       wc->stats.flushes,
-		       wc->stats.discards);
+		       wc->stats.discards,
+		       wc->stats.read_promotions,
+		       wc->stats.read_promotions_aborted);
 		break;
 	case STATUSTYPE_TABLE:
 		DMEMIT("%c %s %s %u ", WC_MODE_PMEM(wc) ? 'p' : 's',
@@ -2705,6 +2932,10 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 			extra_args++;
 		if (wc->pause_set)
 			extra_args += 2;
+		if (wc->read_promote)
+			extra_args += 2;
+		if (wc->read_promote_window_set)
+			extra_args += 2;
 
 		DMEMIT("%u", extra_args);
 		if (wc->start_sector_set)
@@ -2729,6 +2960,10 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 			DMEMIT(" metadata_only");
 		if (wc->pause_set)
 			DMEMIT(" pause_writeback %u", wc->pause_value);
+		if (wc->read_promote)
+			DMEMIT(" read_promote %u", wc->read_promote);
+		if (wc->read_promote_window_set)
+			DMEMIT(" read_promote_window %u", wc->read_promote_window_value);
 		break;
 	case STATUSTYPE_IMA:
 		*result = '\0';
@@ -2738,7 +2973,7 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 
 static struct target_type writecache_target = {
 	.name			= "writecache",
-	.version		= {1, 6, 0},
+	.version		= {1, 7, 0},
 	.module			= THIS_MODULE,
 	.ctr			= writecache_ctr,
 	.dtr			= writecache_dtr,
@@ -198,7 +198,7 @@ static void raid5_wakeup_stripe_thread(struct stripe_head *sh)
 	/* at least one worker should run to avoid race */
 	queue_work_on(sh->cpu, raid5_wq, &group->workers[0].work);
 
-	thread_cnt = group->stripes_cnt / MAX_STRIPE_BATCH - 1;
+	thread_cnt = group->stripes_cnt / READ_ONCE(conf->stripe_batch) - 1;
 	/* wakeup more workers */
 	for (i = 1; i < conf->worker_cnt_per_group && thread_cnt > 0; i++) {
 		if (group->workers[i].working == false) {
@@ -6373,9 +6373,10 @@ static int handle_active_stripes(struct r5conf *conf, int group,
 {
 	struct stripe_head *batch[MAX_STRIPE_BATCH], *sh;
 	int i, batch_size = 0, hash;
+	int max_batch = READ_ONCE(conf->stripe_batch);
 	bool release_inactive = false;
 
-	while (batch_size < MAX_STRIPE_BATCH &&
+	while (batch_size < max_batch &&
 			(sh = __get_priority_stripe(conf, group)) != NULL)
 		batch[batch_size++] = sh;
 
@@ -6813,6 +6814,56 @@ raid5_preread_bypass_threshold = __ATTR(preread_bypass_threshold,
 					raid5_show_preread_threshold,
 					raid5_store_preread_threshold);
 
+static ssize_t
+raid5_show_stripe_batch(struct mddev *mddev, char *page)
+{
+	struct r5conf *conf;
+	int ret = 0;
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf)
+		ret = sprintf(page, "%d\n", conf->stripe_batch);
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+/*
+ * Number of stripes raid5d and the workers take off the handle lists each
+ * time they drop device_lock. Large sequential writes on slow or few disks
+ * do better with bigger batches, as there is less lock traffic per stripe
+ * and batched full stripe writes are handled together.
+ */
+static ssize_t
+raid5_store_stripe_batch(struct mddev *mddev, const char *page, size_t len)
+{
+	struct r5conf *conf;
+	unsigned long new;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (kstrtoul(page, 10, &new))
+		return -EINVAL;
+	if (!new || new > MAX_STRIPE_BATCH)
+		return -EINVAL;
+
+	err = mddev_lock(mddev);
+	if (err)
+		return err;
+	conf = mddev->private;
+	if (!conf)
+		err = -ENODEV;
+	else
+		WRITE_ONCE(conf->stripe_batch, new);
+	mddev_unlock(mddev);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+raid5_stripe_batch = __ATTR(stripe_batch, S_IRUGO | S_IWUSR,
+			    raid5_show_stripe_batch,
+			    raid5_store_stripe_batch);
+
 static ssize_t
 raid5_show_skip_copy(struct mddev *mddev, char *page)
 {
@@ -6953,6 +7004,7 @@ static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_active.attr,
 	&raid5_preread_bypass_threshold.attr,
 	&raid5_group_thread_cnt.attr,
+	&raid5_stripe_batch.attr,
 	&raid5_skip_copy.attr,
 	&raid5_rmw_level.attr,
 	&raid5_stripe_size.attr,
@@ -7256,6 +7308,7 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	}
 
 	conf->bypass_threshold = BYPASS_THRESHOLD;
+	conf->stripe_batch = DEFAULT_STRIPE_BATCH;
 	conf->recovery_disabled = mddev->recovery_disabled - 1;
 
 	conf->raid_disks = mddev->raid_disks;
@@ -23,13 +23,17 @@
 
 /*
  * Structure allocated for each page or THP when block size < page size
- * to track sub-page uptodate status and I/O completions.
+ * to track sub-page uptodate and dirty status and I/O completions.
+ *
+ * The state bitmap holds one uptodate bit per block, followed by one
+ * dirty bit per block, so that writeback only has to write the blocks
+ * that were actually dirtied.
  */
 struct iomap_page {
 	atomic_t		read_bytes_pending;
 	atomic_t		write_bytes_pending;
-	spinlock_t		uptodate_lock;
-	unsigned long		uptodate[];
+	spinlock_t		state_lock;
+	unsigned long		state[];
 };
 
 static inline struct iomap_page *to_iomap_page(struct page *page)
@@ -57,15 +61,63 @@ iomap_page_create(struct inode *inode, struct page *page)
 	if (iop || nr_blocks <= 1)
 		return iop;
 
-	iop = kzalloc(struct_size(iop, uptodate, BITS_TO_LONGS(nr_blocks)),
+	iop = kzalloc(struct_size(iop, state, BITS_TO_LONGS(2 * nr_blocks)),
 			GFP_NOFS | __GFP_NOFAIL);
-	spin_lock_init(&iop->uptodate_lock);
+	spin_lock_init(&iop->state_lock);
 	if (PageUptodate(page))
-		bitmap_fill(iop->uptodate, nr_blocks);
+		bitmap_set(iop->state, 0, nr_blocks);
+	if (PageDirty(page))
+		bitmap_set(iop->state, nr_blocks, nr_blocks);
 	attach_page_private(page, iop);
 	return iop;
 }
 
+static inline bool iop_test_block_dirty(struct iomap_page *iop,
+		unsigned int nr_blocks, unsigned int block)
+{
+	return test_bit(nr_blocks + block, iop->state);
+}
+
+static void
+iomap_iop_set_range_dirty(struct page *page, struct iomap_page *iop,
+		unsigned off, unsigned len, bool dirty)
+{
+	struct inode *inode = page->mapping->host;
+	unsigned int nr_blocks = i_blocks_per_page(inode, page);
+	unsigned first = off >> inode->i_blkbits;
+	unsigned last = (off + len - 1) >> inode->i_blkbits;
+	unsigned long flags;
+
+	spin_lock_irqsave(&iop->state_lock, flags);
+	if (dirty)
+		bitmap_set(iop->state, nr_blocks + first, last - first + 1);
+	else
+		bitmap_clear(iop->state, nr_blocks + first, last - first + 1);
+	spin_unlock_irqrestore(&iop->state_lock, flags);
+}
+
+/*
+ * Mark the blocks covering [off, off + len) dirty, all in one go.  The page
+ * itself still has to be dirtied by the caller.
+ */
+static void
+iomap_set_range_dirty(struct page *page, unsigned off, unsigned len)
+{
+	struct iomap_page *iop = to_iomap_page(page);
+
+	if (iop && len)
+		iomap_iop_set_range_dirty(page, iop, off, len, true);
+}
+
+static void
+iomap_clear_range_dirty(struct page *page, unsigned off, unsigned len)
+{
+	struct iomap_page *iop = to_iomap_page(page);
+
+	if (iop && len)
+		iomap_iop_set_range_dirty(page, iop, off, len, false);
+}
+
 static void
 iomap_page_release(struct page *page)
 {
@@ -76,7 +128,7 @@ iomap_page_release(struct page *page)
 		return;
 	WARN_ON_ONCE(atomic_read(&iop->read_bytes_pending));
 	WARN_ON_ONCE(atomic_read(&iop->write_bytes_pending));
-	WARN_ON_ONCE(bitmap_full(iop->uptodate, nr_blocks) !=
+	WARN_ON_ONCE(bitmap_full(iop->state, nr_blocks) !=
 			PageUptodate(page));
 	kfree(iop);
 }
@@ -107,7 +159,7 @@ iomap_adjust_read_range(struct inode *inode, struct iomap_page *iop,
 
 		/* move forward for each leading block marked uptodate */
 		for (i = first; i <= last; i++) {
-			if (!test_bit(i, iop->uptodate))
+			if (!test_bit(i, iop->state))
 				break;
 			*pos += block_size;
 			poff += block_size;
@@ -117,7 +169,7 @@ iomap_adjust_read_range(struct inode *inode, struct iomap_page *iop,
 
 		/* truncate len if we find any trailing uptodate block(s) */
 		for ( ; i <= last; i++) {
-			if (test_bit(i, iop->uptodate)) {
+			if (test_bit(i, iop->state)) {
 				plen -= (last - i + 1) * block_size;
 				last = i - 1;
 				break;
@@ -150,11 +202,11 @@ iomap_iop_set_range_uptodate(struct page *page, unsigned off, unsigned len)
 	unsigned last = (off + len - 1) >> inode->i_blkbits;
 	unsigned long flags;
 
-	spin_lock_irqsave(&iop->uptodate_lock, flags);
-	bitmap_set(iop->uptodate, first, last - first + 1);
-	if (bitmap_full(iop->uptodate, i_blocks_per_page(inode, page)))
+	spin_lock_irqsave(&iop->state_lock, flags);
+	bitmap_set(iop->state, first, last - first + 1);
+	if (bitmap_full(iop->state, i_blocks_per_page(inode, page)))
 		SetPageUptodate(page);
-	spin_unlock_irqrestore(&iop->uptodate_lock, flags);
+	spin_unlock_irqrestore(&iop->state_lock, flags);
 }
 
 static void
@@ -448,7 +500,7 @@ iomap_is_partially_uptodate(struct page *page, unsigned long from,
 
 	if (iop) {
 		for (i = first; i <= last; i++)
-			if (!test_bit(i, iop->uptodate))
+			if (!test_bit(i, iop->state))
 				return 0;
 		return 1;
 	}
@@ -457,6 +509,19 @@ iomap_is_partially_uptodate(struct page *page, unsigned long from,
 }
 EXPORT_SYMBOL_GPL(iomap_is_partially_uptodate);
 
+/*
+ * ->set_page_dirty for iomap based filesystems.  Anyone dirtying the page
+ * through the generic code may have touched any part of it, so mark all
+ * the blocks dirty.
+ */
+int
+iomap_set_page_dirty(struct page *page)
+{
+	iomap_set_range_dirty(page, 0, thp_size(page));
+	return __set_page_dirty_nobuffers(page);
+}
+EXPORT_SYMBOL_GPL(iomap_set_page_dirty);
+
 int
 iomap_releasepage(struct page *page, gfp_t gfp_mask)
 {
@@ -670,6 +735,7 @@ static size_t __iomap_write_end(struct inode *inode, loff_t pos, size_t len,
 	if (unlikely(copied < len && !PageUptodate(page)))
 		return 0;
 	iomap_set_range_uptodate(page, offset_in_page(pos), len);
+	iomap_set_range_dirty(page, offset_in_page(pos), copied);
 	__set_page_dirty_nobuffers(page);
 	return copied;
 }
@@ -973,6 +1039,7 @@ static loff_t iomap_page_mkwrite_iter(struct iomap_iter *iter,
 		block_commit_write(page, 0, length);
 	} else {
 		WARN_ON_ONCE(!PageUptodate(page));
+		iomap_set_range_dirty(page, offset_in_page(iter->pos), length);
 		set_page_dirty(page);
 	}
 
@@ -1297,15 +1364,35 @@ iomap_writepage_map(struct iomap_writepage_ctx *wpc,
 		struct writeback_control *wbc, struct inode *inode,
 		struct page *page, u64 end_offset)
 {
-	struct iomap_page *iop = iomap_page_create(inode, page);
+	struct iomap_page *iop = to_iomap_page(page);
 	struct iomap_ioend *ioend, *next;
 	unsigned len = i_blocksize(inode);
+	unsigned nr_blocks = i_blocks_per_page(inode, page);
 	u64 file_offset; /* file offset of page */
 	int error = 0, count = 0, i;
+	bool all_dirty = false;
 	LIST_HEAD(submit_list);
 
+	/*
+	 * Without per-block state the whole page was dirtied, so the new
+	 * iomap_page has to say so before we look at it below.
+	 */
+	if (!iop && nr_blocks > 1) {
+		iop = iomap_page_create(inode, page);
+		iomap_set_range_dirty(page, 0, end_offset - page_offset(page));
+	}
+
 	WARN_ON_ONCE(iop && atomic_read(&iop->write_bytes_pending) != 0);
 
+	/*
+	 * A page dirtied behind our back (e.g. by set_page_dirty_lock() on a
+	 * filesystem that doesn't use iomap_set_page_dirty()) has no dirty
+	 * blocks recorded, so fall back to writing every uptodate block.
+	 */
+	if (iop && find_next_bit(iop->state, 2 * nr_blocks, nr_blocks) >=
+			2 * nr_blocks)
+		all_dirty = true;
+
 	/*
 	 * Walk through the page to find areas to write back. If we run off the
 	 * end of the current map or find the current map invalid, grab a new
@@ -1314,7 +1401,8 @@ iomap_writepage_map(struct iomap_writepage_ctx *wpc,
 	for (i = 0, file_offset = page_offset(page);
 	     i < (PAGE_SIZE >> inode->i_blkbits) && file_offset < end_offset;
 	     i++, file_offset += len) {
-		if (iop && !test_bit(i, iop->uptodate))
+		if (iop && (!test_bit(i, iop->state) || (!all_dirty &&
+			    !iop_test_block_dirty(iop, nr_blocks, i))))
 			continue;
 
 		error = wpc->ops->map_blocks(wpc, inode, file_offset);
@@ -1334,6 +1422,13 @@ iomap_writepage_map(struct iomap_writepage_ctx *wpc,
 	WARN_ON_ONCE(PageWriteback(page));
 	WARN_ON_ONCE(PageDirty(page));
 
+	/*
+	 * The page dirty bit was cleared for this writeback, the block bits
+	 * follow.  On a mapping error the page is either written out as far
+	 * as it got or invalidated, so there is nothing to keep either.
+	 */
+	iomap_clear_range_dirty(page, 0, thp_size(page));
+
 	/*
 	 * We cannot cancel the ioend directly here on error.  We may have
 	 * already set other pages under writeback and hence we have to run I/O
@@ -52,6 +52,12 @@ struct iomap_dio {
 	};
 };
 
+/*
+ * Bios for polled direct I/O come from a bio_set with a per-cpu cache, see
+ * iomap_dio_alloc_bio().
+ */
+static struct bio_set iomap_dio_bioset;
+
 int iomap_dio_iopoll(struct kiocb *kiocb, bool spin)
 {
 	struct request_queue *q = READ_ONCE(kiocb->private);
@@ -62,6 +68,24 @@ int iomap_dio_iopoll(struct kiocb *kiocb, bool spin)
 }
 EXPORT_SYMBOL_GPL(iomap_dio_iopoll);
 
+/*
+ * Polled bios are reaped from task context by whoever polls the queue, which
+ * is what allows them to be recycled through the per-cpu bio cache.  The
+ * cache is only used if the caller asked for it with IOCB_ALLOC_CACHE, and
+ * only for queues that will actually poll, as anything else completes from
+ * interrupt context.
+ */
+static struct bio *iomap_dio_alloc_bio(const struct iomap_iter *iter,
+		struct iomap_dio *dio, unsigned short nr_vecs)
+{
+	struct request_queue *q = bdev_get_queue(iter->iomap.bdev);
+
+	if ((dio->iocb->ki_flags & IOCB_HIPRI) &&
+	    test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+		return bio_alloc_kiocb(dio->iocb, nr_vecs, &iomap_dio_bioset);
+	return bio_alloc(GFP_KERNEL, nr_vecs);
+}
+
 static void iomap_dio_submit_bio(const struct iomap_iter *iter,
 		struct iomap_dio *dio, struct bio *bio, loff_t pos)
 {
@@ -162,6 +186,14 @@ static void iomap_dio_bio_end_io(struct bio *bio)
 	if (bio->bi_status)
 		iomap_dio_set_error(dio, blk_status_to_errno(bio->bi_status));
 
+	/*
+	 * A bio meant to be polled can still end up being completed from
+	 * interrupt context, e.g. when it fails or times out.  The per-cpu
+	 * cache must not be touched from there, so free it normally instead.
+	 */
+	if (!in_task())
+		bio_clear_flag(bio, BIO_PERCPU_CACHE);
+
 	if (atomic_dec_and_test(&dio->ref)) {
 		if (dio->wait_for_completion) {
 			struct task_struct *waiter = dio->submit.waiter;
@@ -193,7 +225,7 @@ static void iomap_dio_zero(const struct iomap_iter *iter, struct iomap_dio *dio,
 	int flags = REQ_SYNC | REQ_IDLE;
 	struct bio *bio;
 
-	bio = bio_alloc(GFP_KERNEL, 1);
+	bio = iomap_dio_alloc_bio(iter, dio, 1);
 	fscrypt_set_bio_crypt_ctx(bio, inode, pos >> inode->i_blkbits,
 				  GFP_KERNEL);
 	bio_set_dev(bio, iter->iomap.bdev);
@@ -314,7 +346,7 @@ static loff_t iomap_dio_bio_iter(const struct iomap_iter *iter,
 			goto out;
 		}
 
-		bio = bio_alloc(GFP_KERNEL, nr_pages);
+		bio = iomap_dio_alloc_bio(iter, dio, nr_pages);
 		fscrypt_set_bio_crypt_ctx(bio, inode, pos >> inode->i_blkbits,
 					  GFP_KERNEL);
 		bio_set_dev(bio, iomap->bdev);
@@ -513,6 +545,13 @@ __iomap_dio_rw(struct kiocb *iocb, struct iov_iter *iter,
 	dio->submit.cookie = BLK_QC_T_NONE;
 	dio->submit.last_queue = NULL;
 
+	/*
+	 * A synchronous polled dio reaps all of its bios from this task, so
+	 * let them be recycled through the per-cpu bio cache.
+	 */
+	if (is_sync_kiocb(iocb) && (iocb->ki_flags & IOCB_HIPRI))
+		iocb->ki_flags |= IOCB_ALLOC_CACHE;
+
 	if (iov_iter_rw(iter) == READ) {
 		if (iomi.pos >= dio->i_size)
 			goto out_free_dio;
@@ -683,3 +722,10 @@ iomap_dio_rw(struct kiocb *iocb, struct iov_iter *iter,
 	return iomap_dio_complete(dio);
 }
 EXPORT_SYMBOL_GPL(iomap_dio_rw);
+
+static int __init iomap_dio_init(void)
+{
+	return bioset_init(&iomap_dio_bioset, 4, 0,
+			   BIOSET_NEED_BVECS | BIOSET_PERCPU_CACHE);
+}
+fs_initcall(iomap_dio_init);
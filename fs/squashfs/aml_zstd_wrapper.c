@@ -6,6 +6,15 @@
  * All rights reserved.
  *
  * zstd_wrapper.c
+ *
+ * Blocks are normally decompressed in one shot straight into the destination
+ * pages, which are mapped contiguously with vm_map_ram() for the duration of
+ * the call.  This avoids both the copy out of the zstd stream's internal
+ * window buffer and any bounce buffer in the page actor.  If the output
+ * can't be mapped, the streaming decompressor is used instead.
+ *
+ * vm_map_ram() may sleep, so the direct path is not available with the
+ * per-cpu decompressor backend, which decompresses under a local_lock.
  */
 
 #include <linux/mutex.h>
@@ -13,6 +22,8 @@
 #include <linux/slab.h>
 #include <linux/zstd.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -20,30 +31,47 @@
 #include "decompressor.h"
 #include "page_actor.h"
 
+#define ZSTD_DIRECT_OUTPUT	(!IS_ENABLED(CONFIG_SQUASHFS_DECOMP_MULTI_PERCPU))
+
 struct workspace {
 	void *mem;
 	size_t mem_size;
 	size_t window_size;
+	void *input;		/* compressed block gathered from the bio */
+	struct page **pages;	/* destination pages of the block */
+	struct page *scratch;	/* stands in for pages that are not cached */
 };
 
+static void zstd_free(void *strm);
+
 static void *zstd_init(struct squashfs_sb_info *msblk, void *buff)
 {
-	struct workspace *wksp = kmalloc(sizeof(*wksp), GFP_KERNEL);
+	struct workspace *wksp = kzalloc(sizeof(*wksp), GFP_KERNEL);
 
 	if (wksp == NULL)
 		goto failed;
 	wksp->window_size = max_t(size_t,
 			msblk->block_size, SQUASHFS_METADATA_SIZE);
-	wksp->mem_size = zstd_dstream_workspace_bound(wksp->window_size);
+	/* the one shot and the streaming decompressor share the workspace */
+	wksp->mem_size = max(zstd_dstream_workspace_bound(wksp->window_size),
+			     zstd_dctx_workspace_bound());
 	wksp->mem = vmalloc(wksp->mem_size);
-	if (wksp->mem == NULL)
+	wksp->input = vmalloc(wksp->window_size);
+	if (ZSTD_DIRECT_OUTPUT) {
+		wksp->pages = kcalloc(wksp->window_size >> PAGE_SHIFT,
+				      sizeof(*wksp->pages), GFP_KERNEL);
+		if (!wksp->pages)
+			goto failed;
+	}
+	wksp->scratch = alloc_page(GFP_KERNEL);
+	if (!wksp->mem || !wksp->input || !wksp->scratch)
 		goto failed;
 
 	return wksp;
 
 failed:
 	ERROR("Failed to allocate zstd workspace\n");
-	kfree(wksp);
+	zstd_free(wksp);
 	return ERR_PTR(-ENOMEM);
 }
 
@@ -52,17 +80,20 @@ static void zstd_free(void *strm)
 {
 	struct workspace *wksp = strm;
 
-	if (wksp)
+	if (wksp) {
 		vfree(wksp->mem);
+		vfree(wksp->input);
+		kfree(wksp->pages);
+		if (wksp->scratch)
+			__free_page(wksp->scratch);
+	}
 	kfree(wksp);
 }
 
 
-static int zstd_uncompress(struct squashfs_sb_info *msblk, void *strm,
-	struct bio *bio, int offset, int length,
-	struct squashfs_page_actor *output)
+static int zstd_uncompress_stream(struct workspace *wksp, struct bio *bio,
+	int offset, int length, struct squashfs_page_actor *output)
 {
-	struct workspace *wksp = strm;
 	zstd_dstream *stream;
 	size_t total_out = 0;
 	int error = 0;
@@ -80,6 +111,8 @@ static int zstd_uncompress(struct squashfs_sb_info *msblk, void *strm,
 
 	out_buf.size = PAGE_SIZE;
 	out_buf.dst = squashfs_first_page(output);
+	if (IS_ERR(out_buf.dst))
+		out_buf.dst = page_address(wksp->scratch);
 
 	for (;;) {
 		size_t zstd_err;
@@ -104,7 +137,10 @@ static int zstd_uncompress(struct squashfs_sb_info *msblk, void *strm,
 
 		if (out_buf.pos == out_buf.size) {
 			out_buf.dst = squashfs_next_page(output);
-			if (out_buf.dst == NULL) {
+			if (IS_ERR(out_buf.dst))
+				/* Hole in the page cache, discard */
+				out_buf.dst = page_address(wksp->scratch);
+			else if (out_buf.dst == NULL) {
 				/* Shouldn't run out of pages
 				 * before stream is done.
 				 */
@@ -134,6 +170,88 @@ static int zstd_uncompress(struct squashfs_sb_info *msblk, void *strm,
 	return error ? error : total_out;
 }
 
+/*
+ * Decompress the whole block in one go into the mapped destination pages.
+ * Returns -EAGAIN, without having touched the bio or the actor, if the
+ * output can't be mapped.
+ */
+static int zstd_uncompress_direct(struct workspace *wksp, struct bio *bio,
+	int offset, int length, struct squashfs_page_actor *output)
+{
+	struct bvec_iter_all iter_all = {};
+	struct bio_vec *bvec = bvec_init_iter_all(&iter_all);
+	const void *src = NULL;
+	int nr_pages, copied = 0, total = length;
+	zstd_dctx *dctx;
+	size_t res;
+	void *dst;
+
+	if (!ZSTD_DIRECT_OUTPUT || length > wksp->window_size)
+		return -EAGAIN;
+
+	nr_pages = squashfs_page_actor_pages(output, wksp->pages,
+					     wksp->scratch);
+	if (!nr_pages)
+		return -EAGAIN;
+
+	dst = vm_map_ram(wksp->pages, nr_pages, NUMA_NO_NODE);
+	if (!dst)
+		return -EAGAIN;
+
+	/* Use the compressed data in place if it sits in one segment */
+	while (length) {
+		int avail;
+
+		if (!bio_next_segment(bio, &iter_all)) {
+			vm_unmap_ram(dst, nr_pages);
+			return -EIO;
+		}
+
+		avail = min(length, ((int)bvec->bv_len) - offset);
+		if (!copied && avail == total) {
+			src = bvec_virt(bvec) + offset;
+			break;
+		}
+		memcpy(wksp->input + copied, bvec_virt(bvec) + offset, avail);
+		copied += avail;
+		length -= avail;
+		offset = 0;
+	}
+
+	dctx = zstd_init_dctx(wksp->mem, wksp->mem_size);
+	if (!dctx) {
+		vm_unmap_ram(dst, nr_pages);
+		ERROR("Failed to initialize zstd decompressor\n");
+		return -EIO;
+	}
+
+	res = zstd_decompress_dctx(dctx, dst, (size_t)nr_pages << PAGE_SHIFT,
+				   src ?: wksp->input, total);
+	invalidate_kernel_vmap_range(dst, nr_pages << PAGE_SHIFT);
+	vm_unmap_ram(dst, nr_pages);
+
+	if (zstd_is_error(res)) {
+		ERROR("zstd decompression error: %d\n",
+				(int)zstd_get_error_code(res));
+		return -EIO;
+	}
+
+	return res;
+}
+
+static int zstd_uncompress(struct squashfs_sb_info *msblk, void *strm,
+	struct bio *bio, int offset, int length,
+	struct squashfs_page_actor *output)
+{
+	int res;
+
+	res = zstd_uncompress_direct(strm, bio, offset, length, output);
+	if (res != -EAGAIN)
+		return res;
+
+	return zstd_uncompress_stream(strm, bio, offset, length, output);
+}
+
 const struct squashfs_decompressor squashfs_zstd_comp_ops = {
 	.init = zstd_init,
 	.free = zstd_free,
@@ -21,6 +21,7 @@
 #include <linux/string.h>
 #include <linux/buffer_head.h>
 #include <linux/bio.h>
+#include <linux/ktime.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -339,11 +340,17 @@ int squashfs_read_data(struct super_block *sb, u64 index, int length,
 		goto out;
 
 	if (compressed) {
+		u64 start;
+
 		if (!msblk->stream) {
 			res = -EIO;
 			goto out_free_bio;
 		}
+		start = ktime_get_ns();
 		res = squashfs_decompress(msblk, bio, offset, length, output);
+		if (res > 0)
+			squashfs_decompress_account(msblk, res,
+						     ktime_get_ns() - start);
 	} else {
 		res = copy_bio_to_actor(bio, output, offset, length);
 	}
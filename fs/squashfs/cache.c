@@ -29,6 +29,14 @@
  * have been packed with it, these because of locality-of-reference may be read
  * in the near future. Temporarily caching them ensures they are available for
  * near future access without requiring an additional read and decompress.
+ *
+ * Separately, the data cache at the end of this file keeps recently
+ * decompressed datablocks that were read because of random access.  Once
+ * their page-cache pages are evicted, a later 4K read landing in the same
+ * block is served by copying from the cache instead of decompressing the
+ * whole block again.  It is hashed by block position, kept in LRU order,
+ * bounded in bytes by the data_cache_kb module parameter and reclaimable
+ * through a shrinker.
  */
 
 #include <linux/fs.h>
@@ -39,6 +47,12 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/debugfs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -446,3 +460,320 @@ void *squashfs_read_table(struct super_block *sb, u64 block, int length)
 	kfree(table);
 	return ERR_PTR(res);
 }
+
+
+#define SQUASHFS_DATA_CACHE_HASH_BITS	8
+
+static unsigned int data_cache_kb = 4096;
+module_param(data_cache_kb, uint, 0644);
+MODULE_PARM_DESC(data_cache_kb,
+	"Maximum KiB of decompressed datablocks cached by each mount, rounded "
+	"down to whole blocks (0 disables)");
+
+static atomic64_t data_cache_hits, data_cache_misses, data_cache_reclaimed;
+static atomic_t data_cache_blocks_used;
+
+static void squashfs_data_block_free(struct squashfs_data_block *d)
+{
+	int i;
+
+	for (i = 0; i < d->nr_pages; i++)
+		if (d->pages[i])
+			__free_page(d->pages[i]);
+	kfree(d);
+}
+
+/* Called with the cache lock held */
+static void squashfs_data_cache_evict(struct squashfs_data_cache *cache,
+	struct squashfs_data_block *d, struct list_head *reap)
+{
+	hlist_del(&d->hash);
+	list_del(&d->lru);
+	cache->nr--;
+	atomic_dec(&data_cache_blocks_used);
+	if (refcount_dec_and_test(&d->refcount))
+		list_add(&d->lru, reap);
+}
+
+static void squashfs_data_cache_reap(struct squashfs_data_cache *cache,
+	struct list_head *reap)
+{
+	struct squashfs_data_block *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, reap, lru)
+		squashfs_data_block_free(d);
+}
+
+static unsigned long squashfs_data_cache_count(struct shrinker *shrink,
+	struct shrink_control *sc)
+{
+	struct squashfs_data_cache *cache = container_of(shrink,
+		struct squashfs_data_cache, shrinker);
+
+	return READ_ONCE(cache->nr) ?: SHRINK_EMPTY;
+}
+
+static unsigned long squashfs_data_cache_scan(struct shrinker *shrink,
+	struct shrink_control *sc)
+{
+	struct squashfs_data_cache *cache = container_of(shrink,
+		struct squashfs_data_cache, shrinker);
+	struct squashfs_data_block *d;
+	unsigned long freed = 0;
+	LIST_HEAD(reap);
+
+	spin_lock(&cache->lock);
+	while (freed < sc->nr_to_scan && !list_empty(&cache->lru)) {
+		d = list_last_entry(&cache->lru, struct squashfs_data_block,
+			lru);
+		squashfs_data_cache_evict(cache, d, &reap);
+		freed++;
+	}
+	spin_unlock(&cache->lock);
+
+	squashfs_data_cache_reap(cache, &reap);
+	atomic64_add(freed, &data_cache_reclaimed);
+
+	return freed;
+}
+
+struct squashfs_data_cache *squashfs_data_cache_init(int block_size)
+{
+	struct squashfs_data_cache *cache;
+	int i;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (cache == NULL)
+		return NULL;
+
+	cache->hash = kcalloc(1 << SQUASHFS_DATA_CACHE_HASH_BITS,
+		sizeof(*cache->hash), GFP_KERNEL);
+	if (cache->hash == NULL)
+		goto failed;
+
+	for (i = 0; i < 1 << SQUASHFS_DATA_CACHE_HASH_BITS; i++)
+		INIT_HLIST_HEAD(&cache->hash[i]);
+	INIT_LIST_HEAD(&cache->lru);
+	spin_lock_init(&cache->lock);
+	cache->pages = DIV_ROUND_UP(block_size, PAGE_SIZE);
+
+	cache->shrinker.count_objects = squashfs_data_cache_count;
+	cache->shrinker.scan_objects = squashfs_data_cache_scan;
+	cache->shrinker.seeks = DEFAULT_SEEKS;
+	if (register_shrinker(&cache->shrinker))
+		goto failed;
+
+	return cache;
+
+failed:
+	ERROR("Failed to allocate data cache\n");
+	kfree(cache->hash);
+	kfree(cache);
+	return NULL;
+}
+
+void squashfs_data_cache_delete(struct squashfs_data_cache *cache)
+{
+	struct squashfs_data_block *d, *tmp;
+	LIST_HEAD(reap);
+
+	if (cache == NULL)
+		return;
+
+	unregister_shrinker(&cache->shrinker);
+
+	spin_lock(&cache->lock);
+	list_for_each_entry_safe(d, tmp, &cache->lru, lru)
+		squashfs_data_cache_evict(cache, d, &reap);
+	spin_unlock(&cache->lock);
+
+	squashfs_data_cache_reap(cache, &reap);
+	kfree(cache->hash);
+	kfree(cache);
+}
+
+static struct hlist_head *squashfs_data_cache_bucket(
+	struct squashfs_data_cache *cache, u64 block)
+{
+	return &cache->hash[hash_64(block, SQUASHFS_DATA_CACHE_HASH_BITS)];
+}
+
+/* Number of datablocks of this filesystem that fit in data_cache_kb */
+static unsigned int squashfs_data_cache_max(struct squashfs_data_cache *cache)
+{
+	return div_u64((u64)READ_ONCE(data_cache_kb) << 10,
+		cache->pages << PAGE_SHIFT);
+}
+
+/* Called with the cache lock held */
+static struct squashfs_data_block *squashfs_data_cache_find(
+	struct squashfs_data_cache *cache, u64 block)
+{
+	struct squashfs_data_block *d;
+
+	hlist_for_each_entry(d, squashfs_data_cache_bucket(cache, block), hash)
+		if (d->block == block)
+			return d;
+
+	return NULL;
+}
+
+/*
+ * Look up the decompressed datablock located at <block>.  On a hit the
+ * block is returned with a reference held, to be dropped with
+ * squashfs_data_cache_put() once the data has been copied out.
+ */
+struct squashfs_data_block *squashfs_data_cache_get(
+	struct squashfs_sb_info *msblk, u64 block)
+{
+	struct squashfs_data_cache *cache = msblk->data_cache;
+	struct squashfs_data_block *d;
+
+	if (cache == NULL || !squashfs_data_cache_max(cache))
+		return NULL;
+
+	spin_lock(&cache->lock);
+	d = squashfs_data_cache_find(cache, block);
+	if (d) {
+		refcount_inc(&d->refcount);
+		list_move(&d->lru, &cache->lru);
+	}
+	spin_unlock(&cache->lock);
+
+	if (d)
+		atomic64_inc(&data_cache_hits);
+	else
+		atomic64_inc(&data_cache_misses);
+
+	return d;
+}
+
+void squashfs_data_cache_put(struct squashfs_data_block *d)
+{
+	/* Only evicted blocks can drop their last reference here */
+	if (refcount_dec_and_test(&d->refcount))
+		squashfs_data_block_free(d);
+}
+
+/*
+ * Copy one page worth of the datablock starting at <offset> into <page>,
+ * zeroing whatever lies beyond the end of the block.
+ */
+void squashfs_data_cache_copy_page(struct page *page,
+	struct squashfs_data_block *d, int offset)
+{
+	int avail = clamp_t(int, d->length - offset, 0, PAGE_SIZE);
+
+	if (avail)
+		copy_highpage(page, d->pages[offset >> PAGE_SHIFT]);
+	if (avail < PAGE_SIZE)
+		memzero_page(page, avail, PAGE_SIZE - avail);
+}
+
+/*
+ * Allocate an unhashed datablock for <block> to be filled by the caller and
+ * then handed to squashfs_data_cache_add().  Returns NULL if the cache is
+ * disabled or memory is short; the cache is only an optimisation.
+ */
+struct squashfs_data_block *squashfs_data_cache_alloc(
+	struct squashfs_sb_info *msblk, u64 block, int length)
+{
+	struct squashfs_data_cache *cache = msblk->data_cache;
+	struct squashfs_data_block *d;
+	int i;
+
+	if (cache == NULL || !squashfs_data_cache_max(cache))
+		return NULL;
+
+	d = kzalloc(struct_size(d, pages, cache->pages), GFP_KERNEL |
+		__GFP_NORETRY | __GFP_NOWARN);
+	if (d == NULL)
+		return NULL;
+
+	d->nr_pages = cache->pages;
+	for (i = 0; i < d->nr_pages; i++) {
+		d->pages[i] = alloc_page(GFP_KERNEL | __GFP_NORETRY |
+			__GFP_NOWARN);
+		if (d->pages[i] == NULL) {
+			squashfs_data_block_free(d);
+			return NULL;
+		}
+	}
+
+	d->block = block;
+	d->length = length;
+	refcount_set(&d->refcount, 1);
+	return d;
+}
+
+/* Fill the part of a new datablock at <offset> from an uptodate page */
+void squashfs_data_cache_fill_page(struct squashfs_data_block *d,
+	struct page *page, int offset)
+{
+	copy_highpage(d->pages[offset >> PAGE_SHIFT], page);
+}
+
+/* Fill a new datablock from a read_page cache entry */
+void squashfs_data_cache_fill_entry(struct squashfs_data_block *d,
+	struct squashfs_cache_entry *entry)
+{
+	int offset;
+
+	for (offset = 0; offset < d->length; offset += PAGE_SIZE) {
+		void *addr = kmap_local_page(d->pages[offset >> PAGE_SHIFT]);
+
+		squashfs_copy_data(addr, entry, offset, PAGE_SIZE);
+		kunmap_local(addr);
+	}
+}
+
+/*
+ * Insert a filled datablock, evicting the least recently used blocks beyond
+ * the data_cache_kb limit.  If another reader inserted the same block
+ * first, the new copy is dropped.
+ */
+void squashfs_data_cache_add(struct squashfs_sb_info *msblk,
+	struct squashfs_data_block *d)
+{
+	struct squashfs_data_cache *cache = msblk->data_cache;
+	unsigned int max = squashfs_data_cache_max(cache);
+	LIST_HEAD(reap);
+
+	spin_lock(&cache->lock);
+	if (squashfs_data_cache_find(cache, d->block)) {
+		spin_unlock(&cache->lock);
+		squashfs_data_block_free(d);
+		return;
+	}
+
+	hlist_add_head(&d->hash, squashfs_data_cache_bucket(cache, d->block));
+	list_add(&d->lru, &cache->lru);
+	cache->nr++;
+	atomic_inc(&data_cache_blocks_used);
+
+	while (cache->nr > max)
+		squashfs_data_cache_evict(cache, list_last_entry(&cache->lru,
+			struct squashfs_data_block, lru), &reap);
+	spin_unlock(&cache->lock);
+
+	squashfs_data_cache_reap(cache, &reap);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int squashfs_data_cache_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "blocks %d\n", atomic_read(&data_cache_blocks_used));
+	seq_printf(m, "hits %lld\n", atomic64_read(&data_cache_hits));
+	seq_printf(m, "misses %lld\n", atomic64_read(&data_cache_misses));
+	seq_printf(m, "reclaimed %lld\n",
+		atomic64_read(&data_cache_reclaimed));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(squashfs_data_cache);
+
+void squashfs_data_cache_init_debugfs(struct dentry *dir)
+{
+	debugfs_create_file("data_cache", 0444, dir, NULL,
+		&squashfs_data_cache_fops);
+}
+#endif
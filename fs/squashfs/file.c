@@ -25,6 +25,10 @@
  * Larger files use multiple slots, with 1.75 TiB files using all 8 slots.
  * The index cache is designed to be memory efficient, and by default uses
  * 16 KiB.
+ *
+ * Readahead of a large window can decompress several datablocks at once: the
+ * "parallel=N" mount option lets up to N blocks be in flight, all but the
+ * first being decompressed on an unbound workqueue so they run on other CPUs.
  */
 
 #include <linux/fs.h>
@@ -34,12 +38,17 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
 #include "page_actor.h"
+#include "decompressor.h"
 
 /*
  * Locate cache slot in range [offset, index] for specified inode.  If
@@ -531,6 +540,255 @@ static int squashfs_readahead_fragment(struct page **page,
 	return error;
 }
 
+static struct workqueue_struct *squashfs_read_wq;
+
+#ifdef CONFIG_DEBUG_FS
+#define SQUASHFS_COMP_IDS	(ZSTD_COMPRESSION + 1)
+
+struct squashfs_stats {
+	atomic64_t blocks;
+	atomic64_t bytes;
+	atomic64_t ns;
+};
+
+/*
+ * Throughput per decompressor, in <debugfs>/squashfs/.  "readahead" covers
+ * the whole readahead path including I/O, "decompress" only the time spent
+ * in the decompressor itself, for every kind of block.
+ */
+static struct squashfs_stats squashfs_ra_stats[SQUASHFS_COMP_IDS];
+static struct squashfs_stats squashfs_decompress_stats[SQUASHFS_COMP_IDS];
+
+static void squashfs_stats_add(struct squashfs_stats *stats,
+	struct squashfs_sb_info *msblk, unsigned int blocks, u64 bytes, u64 ns)
+{
+	int id = msblk->decompressor->id;
+
+	if (!blocks || id >= SQUASHFS_COMP_IDS)
+		return;
+
+	atomic64_add(blocks, &stats[id].blocks);
+	atomic64_add(bytes, &stats[id].bytes);
+	atomic64_add(ns, &stats[id].ns);
+}
+
+static void squashfs_ra_account(struct squashfs_sb_info *msblk,
+	unsigned int blocks, u64 bytes, u64 ns)
+{
+	squashfs_stats_add(squashfs_ra_stats, msblk, blocks, bytes, ns);
+}
+
+void squashfs_decompress_account(struct squashfs_sb_info *msblk, u64 bytes,
+	u64 ns)
+{
+	squashfs_stats_add(squashfs_decompress_stats, msblk, 1, bytes, ns);
+}
+
+static int squashfs_stats_show(struct seq_file *m, void *v)
+{
+	struct squashfs_stats *stats = m->private;
+	int id;
+
+	seq_puts(m, "decompressor blocks bytes usec kib_per_sec\n");
+	for (id = 1; id < SQUASHFS_COMP_IDS; id++) {
+		u64 bytes = atomic64_read(&stats[id].bytes);
+		u64 usec = div_u64(atomic64_read(&stats[id].ns),
+				   NSEC_PER_USEC);
+
+		if (!bytes)
+			continue;
+		seq_printf(m, "%s %lld %llu %llu %llu\n",
+			   squashfs_lookup_decompressor(id)->name,
+			   atomic64_read(&stats[id].blocks),
+			   bytes, usec,
+			   div64_u64((bytes >> 10) * USEC_PER_SEC, usec ?: 1));
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(squashfs_stats);
+
+static ssize_t squashfs_stats_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct squashfs_stats *stats =
+		((struct seq_file *)file->private_data)->private;
+	int id;
+
+	for (id = 0; id < SQUASHFS_COMP_IDS; id++) {
+		atomic64_set(&stats[id].blocks, 0);
+		atomic64_set(&stats[id].bytes, 0);
+		atomic64_set(&stats[id].ns, 0);
+	}
+	return count;
+}
+
+static const struct file_operations squashfs_stats_rw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= squashfs_stats_open,
+	.read		= seq_read,
+	.write		= squashfs_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct dentry *squashfs_debugfs;
+
+static void squashfs_ra_stats_init(void)
+{
+	squashfs_debugfs = debugfs_create_dir("squashfs", NULL);
+	debugfs_create_file("readahead", 0600, squashfs_debugfs,
+			    squashfs_ra_stats, &squashfs_stats_rw_fops);
+	debugfs_create_file("decompress", 0600, squashfs_debugfs,
+			    squashfs_decompress_stats, &squashfs_stats_rw_fops);
+	squashfs_data_cache_init_debugfs(squashfs_debugfs);
+}
+
+static void squashfs_ra_stats_exit(void)
+{
+	debugfs_remove_recursive(squashfs_debugfs);
+}
+#else
+static inline void squashfs_ra_account(struct squashfs_sb_info *msblk,
+	unsigned int blocks, u64 bytes, u64 ns) { }
+void squashfs_decompress_account(struct squashfs_sb_info *msblk, u64 bytes,
+	u64 ns) { }
+static inline void squashfs_ra_stats_init(void) { }
+static inline void squashfs_ra_stats_exit(void) { }
+#endif /* CONFIG_DEBUG_FS */
+
+int __init squashfs_init_read_wq(void)
+{
+	squashfs_read_wq = alloc_workqueue("squashfs_read",
+					   WQ_UNBOUND | WQ_HIGHPRI |
+					   WQ_MEM_RECLAIM, 0);
+	if (!squashfs_read_wq)
+		return -ENOMEM;
+
+	squashfs_ra_stats_init();
+	return 0;
+}
+
+void squashfs_destroy_read_wq(void)
+{
+	squashfs_ra_stats_exit();
+	destroy_workqueue(squashfs_read_wq);
+}
+
+/* One datablock of a readahead window */
+struct squashfs_ra_job {
+	struct work_struct work;
+	struct completion done;
+	struct super_block *sb;
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int expected;
+	bool file_end;
+	bool cache_insert;
+	u64 block;
+	int bsize;
+	int res;
+};
+
+static void squashfs_ra_decompress(struct squashfs_ra_job *job)
+{
+	struct squashfs_sb_info *msblk = job->sb->s_fs_info;
+	unsigned int mask = (1 << (msblk->block_log - PAGE_SHIFT)) - 1;
+	struct squashfs_page_actor *actor;
+	struct squashfs_data_block *cached;
+	struct page *last_page;
+	int i;
+
+	cached = squashfs_data_cache_get(msblk, job->block);
+	if (cached) {
+		for (i = 0; i < job->nr_pages; i++)
+			squashfs_data_cache_copy_page(job->pages[i], cached,
+				(job->pages[i]->index & mask) << PAGE_SHIFT);
+		squashfs_data_cache_put(cached);
+		job->res = job->expected;
+		return;
+	}
+
+	actor = squashfs_page_actor_init_special(msblk, job->pages,
+						 job->nr_pages, job->expected);
+	if (!actor) {
+		job->res = -ENOMEM;
+		return;
+	}
+
+	job->res = squashfs_read_data(job->sb, job->block, job->bsize, NULL,
+				      actor);
+
+	last_page = squashfs_page_actor_free(actor);
+
+	if (job->res == job->expected) {
+		int bytes;
+
+		/* Last page (if present) may have trailing bytes not filled */
+		bytes = job->res % PAGE_SIZE;
+		if (job->file_end && bytes && last_page)
+			memzero_page(last_page, bytes,
+				     PAGE_SIZE - bytes);
+
+		if (job->cache_insert && job->nr_pages ==
+		    DIV_ROUND_UP(job->expected, PAGE_SIZE)) {
+			cached = squashfs_data_cache_alloc(msblk, job->block,
+							   job->expected);
+			if (!cached)
+				return;
+			for (i = 0; i < job->nr_pages; i++)
+				squashfs_data_cache_fill_page(cached,
+					job->pages[i], i << PAGE_SHIFT);
+			squashfs_data_cache_add(msblk, cached);
+		}
+	}
+}
+
+static void squashfs_ra_work(struct work_struct *work)
+{
+	struct squashfs_ra_job *job = container_of(work,
+						   struct squashfs_ra_job, work);
+
+	squashfs_ra_decompress(job);
+	complete(&job->done);
+}
+
+static void squashfs_ra_finish(struct squashfs_ra_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nr_pages; i++) {
+		if (job->res == job->expected) {
+			flush_dcache_page(job->pages[i]);
+			SetPageUptodate(job->pages[i]);
+		}
+		unlock_page(job->pages[i]);
+		put_page(job->pages[i]);
+	}
+}
+
+/*
+ * Decompress the first job on the reading thread and the others on
+ * squashfs_read_wq, then complete the pages in file order.
+ */
+static void squashfs_ra_run(struct squashfs_ra_job *jobs, int n)
+{
+	int i;
+
+	for (i = 1; i < n; i++) {
+		INIT_WORK(&jobs[i].work, squashfs_ra_work);
+		init_completion(&jobs[i].done);
+		queue_work(squashfs_read_wq, &jobs[i].work);
+	}
+
+	squashfs_ra_decompress(&jobs[0]);
+	squashfs_ra_finish(&jobs[0]);
+
+	for (i = 1; i < n; i++) {
+		wait_for_completion(&jobs[i].done);
+		squashfs_ra_finish(&jobs[i]);
+	}
+}
+
 static void squashfs_readahead(struct readahead_control *ractl)
 {
 	struct inode *inode = ractl->mapping->host;
@@ -539,24 +797,51 @@ static void squashfs_readahead(struct readahead_control *ractl)
 	unsigned short shift = msblk->block_log - PAGE_SHIFT;
 	loff_t start = readahead_pos(ractl) & ~mask;
 	size_t len = readahead_length(ractl) + readahead_pos(ractl) - start;
-	struct squashfs_page_actor *actor;
 	unsigned int nr_pages = 0;
 	struct page **pages;
 	int i, file_end = i_size_read(inode) >> msblk->block_log;
 	unsigned int max_pages = 1UL << shift;
+	int parallel = READ_ONCE(msblk->parallel_blocks);
+	struct squashfs_ra_job *jobs;
+	unsigned int n = 0, blocks = 0;
+	u64 bytes = 0, start_ns = ktime_get_ns();
+	bool cache_insert;
 
 	readahead_expand(ractl, start, (len | mask) + 1);
 
-	pages = kmalloc_array(max_pages, sizeof(void *), GFP_KERNEL);
-	if (!pages)
+	/* no point in more jobs than blocks in the window */
+	parallel = clamp_t(int, readahead_count(ractl) >> shift, 1, parallel);
+
+	/*
+	 * A window of a single block is most likely a random read (e.g. a
+	 * page fault), which is what the data cache is for.  Don't pollute
+	 * it with sequential streams.
+	 */
+	cache_insert = readahead_count(ractl) <= max_pages;
+
+	jobs = kcalloc(parallel, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs)
 		return;
 
+	pages = kmalloc_array(parallel * max_pages, sizeof(void *), GFP_KERNEL);
+	if (!pages) {
+		kfree(jobs);
+		return;
+	}
+
+	for (i = 0; i < parallel; i++) {
+		jobs[i].sb = inode->i_sb;
+		jobs[i].pages = pages + i * max_pages;
+	}
+
 	for (;;) {
 		pgoff_t index;
 		int res, bsize;
 		u64 block = 0;
 		unsigned int expected;
-		struct page *last_page;
+		struct squashfs_ra_job *job = &jobs[n];
+
+		pages = job->pages;
 
 		expected = start >> msblk->block_log == file_end ?
 			   (i_size_read(inode) & (msblk->block_size - 1)) :
@@ -578,6 +863,10 @@ static void squashfs_readahead(struct readahead_control *ractl)
 
 		if (index == file_end && squashfs_i(inode)->fragment_block !=
 						SQUASHFS_INVALID_BLK) {
+			if (n) {
+				squashfs_ra_run(jobs, n);
+				n = 0;
+			}
 			res = squashfs_readahead_fragment(pages, nr_pages,
 							  expected);
 			if (res)
@@ -589,45 +878,36 @@ static void squashfs_readahead(struct readahead_control *ractl)
 		if (bsize == 0)
 			goto skip_pages;
 
-		actor = squashfs_page_actor_init_special(msblk, pages, nr_pages,
-							 expected);
-		if (!actor)
-			goto skip_pages;
-
-		res = squashfs_read_data(inode->i_sb, block, bsize, NULL, actor);
-
-		last_page = squashfs_page_actor_free(actor);
-
-		if (res == expected) {
-			int bytes;
-
-			/* Last page (if present) may have trailing bytes not filled */
-			bytes = res % PAGE_SIZE;
-			if (index == file_end && bytes && last_page)
-				memzero_page(last_page, bytes,
-					     PAGE_SIZE - bytes);
-
-			for (i = 0; i < nr_pages; i++) {
-				flush_dcache_page(pages[i]);
-				SetPageUptodate(pages[i]);
-			}
-		}
-
-		for (i = 0; i < nr_pages; i++) {
-			unlock_page(pages[i]);
-			put_page(pages[i]);
+		job->nr_pages = nr_pages;
+		job->expected = expected;
+		job->file_end = index == file_end;
+		job->cache_insert = cache_insert;
+		job->block = block;
+		job->bsize = bsize;
+		blocks++;
+		bytes += expected;
+
+		if (++n == parallel) {
+			squashfs_ra_run(jobs, n);
+			n = 0;
 		}
 	}
 
-	kfree(pages);
-	return;
+	if (n)
+		squashfs_ra_run(jobs, n);
+	goto out;
 
 skip_pages:
+	if (n)
+		squashfs_ra_run(jobs, n);
 	for (i = 0; i < nr_pages; i++) {
 		unlock_page(pages[i]);
 		put_page(pages[i]);
 	}
-	kfree(pages);
+out:
+	squashfs_ra_account(msblk, blocks, bytes, ktime_get_ns() - start_ns);
+	kfree(jobs[0].pages);
+	kfree(jobs);
 }
 
 const struct address_space_operations squashfs_aops = {
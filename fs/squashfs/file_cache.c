@@ -21,16 +21,39 @@
 int squashfs_readpage_block(struct page *page, u64 block, int bsize, int expected)
 {
 	struct inode *i = page->mapping->host;
-	struct squashfs_cache_entry *buffer = squashfs_get_datablock(i->i_sb,
-		block, bsize);
-	int res = buffer->error;
+	struct squashfs_sb_info *msblk = i->i_sb->s_fs_info;
+	int mask = (1 << (msblk->block_log - PAGE_SHIFT)) - 1;
+	struct squashfs_data_block *cached = squashfs_data_cache_get(msblk,
+		block);
+	struct squashfs_cache_entry *buffer;
+	int res;
+
+	if (cached) {
+		squashfs_data_cache_copy_page(page, cached,
+			(page->index & mask) << PAGE_SHIFT);
+		squashfs_data_cache_put(cached);
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+		unlock_page(page);
+		return 0;
+	}
+
+	buffer = squashfs_get_datablock(i->i_sb, block, bsize);
+	res = buffer->error;
 
 	if (res)
 		ERROR("Unable to read page, block %llx, size %x\n", block,
 			bsize);
-	else
+	else {
 		squashfs_copy_cache(page, buffer, expected, 0);
 
+		cached = squashfs_data_cache_alloc(msblk, block, expected);
+		if (cached) {
+			squashfs_data_cache_fill_entry(cached, buffer);
+			squashfs_data_cache_add(msblk, cached);
+		}
+	}
+
 	squashfs_cache_put(buffer);
 	return res;
 }
@@ -30,15 +30,16 @@ int squashfs_readpage_block(struct page *target_page, u64 block, int bsize,
 	int mask = (1 << (msblk->block_log - PAGE_SHIFT)) - 1;
 	int start_index = target_page->index & ~mask;
 	int end_index = start_index | mask;
-	int i, n, pages, bytes, res = -ENOMEM;
+	int i, n, pages, block_pages, bytes, res = -ENOMEM;
 	struct page **page;
 	struct squashfs_page_actor *actor;
+	struct squashfs_data_block *cached;
 	void *pageaddr;
 
 	if (end_index > file_end)
 		end_index = file_end;
 
-	pages = end_index - start_index + 1;
+	pages = block_pages = end_index - start_index + 1;
 
 	page = kmalloc_array(pages, sizeof(void *), GFP_KERNEL);
 	if (page == NULL)
@@ -63,6 +64,16 @@ int squashfs_readpage_block(struct page *target_page, u64 block, int bsize,
 
 	pages = i;
 
+	/* A recently decompressed copy saves decompressing the block again */
+	cached = squashfs_data_cache_get(msblk, block);
+	if (cached) {
+		for (i = 0; i < pages; i++)
+			squashfs_data_cache_copy_page(page[i], cached,
+				(page[i]->index & mask) << PAGE_SHIFT);
+		squashfs_data_cache_put(cached);
+		goto uptodate;
+	}
+
 	/*
 	 * Create a "page actor" which will kmap and kunmap the
 	 * page cache pages appropriately within the decompressor
@@ -92,6 +103,21 @@ int squashfs_readpage_block(struct page *target_page, u64 block, int bsize,
 		kunmap_local(pageaddr);
 	}
 
+	/*
+	 * This is the random read path, keep the block around in case its
+	 * pages are evicted and read again.  Only complete blocks are cached.
+	 */
+	if (pages == block_pages) {
+		cached = squashfs_data_cache_alloc(msblk, block, expected);
+		if (cached) {
+			for (i = 0; i < pages; i++)
+				squashfs_data_cache_fill_page(cached, page[i],
+					i << PAGE_SHIFT);
+			squashfs_data_cache_add(msblk, cached);
+		}
+	}
+
+uptodate:
 	/* Mark pages as uptodate, unlock and release */
 	for (i = 0; i < pages; i++) {
 		flush_dcache_page(page[i]);
@@ -102,6 +102,57 @@ static void direct_finish_page(struct squashfs_page_actor *actor)
 		kunmap_local(actor->pageaddr);
 }
 
+/*
+ * Describe the whole output of a fresh actor as an array of pages, so that a
+ * decompressor that wants one contiguous output buffer can map them instead
+ * of decompressing into a bounce buffer.  A single page cache page that could
+ * not be grabbed is stood in for by @scratch.  The actor itself is left
+ * untouched, apart from last_page being set as if every page had been handed
+ * out.
+ *
+ * Returns the number of pages, or 0 if the output can't be described by
+ * pages or more than one page is missing, in which case the caller uses the
+ * first/next_page interface.
+ */
+int squashfs_page_actor_pages(struct squashfs_page_actor *actor,
+	struct page **pages, struct page *scratch)
+{
+	int i, n, holes;
+	int nr_pages = (actor->length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	pgoff_t index;
+
+	if (actor->squashfs_first_page != direct_first_page) {
+		if (nr_pages > actor->pages)
+			return 0;
+
+		for (i = 0; i < nr_pages; i++) {
+			if (offset_in_page(actor->buffer[i]) ||
+			    !virt_addr_valid(actor->buffer[i]))
+				return 0;
+			pages[i] = virt_to_page(actor->buffer[i]);
+		}
+		return nr_pages;
+	}
+
+	for (i = 0, n = 0, holes = 0, index = actor->next_index; i < nr_pages;
+	     i++, index++) {
+		if (n < actor->pages && actor->page[n]->index == index) {
+			pages[i] = actor->page[n++];
+		} else {
+			/*
+			 * The decompressor may use its output as the match
+			 * window, so two holes must never share one page.
+			 */
+			if (holes++)
+				return 0;
+			pages[i] = scratch;
+		}
+	}
+	actor->last_page = pages[nr_pages - 1] == scratch ? NULL :
+			   pages[nr_pages - 1];
+	return nr_pages;
+}
+
 struct squashfs_page_actor *squashfs_page_actor_init_special(struct squashfs_sb_info *msblk,
 	struct page **page, int pages, int length)
 {
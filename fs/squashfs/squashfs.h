@@ -32,6 +32,22 @@ extern struct squashfs_cache_entry *squashfs_get_fragment(struct super_block *,
 extern struct squashfs_cache_entry *squashfs_get_datablock(struct super_block *,
 				u64, int);
 extern void *squashfs_read_table(struct super_block *, u64, int);
+extern struct squashfs_data_cache *squashfs_data_cache_init(int);
+extern void squashfs_data_cache_delete(struct squashfs_data_cache *);
+extern struct squashfs_data_block *squashfs_data_cache_get(
+				struct squashfs_sb_info *, u64);
+extern void squashfs_data_cache_put(struct squashfs_data_block *);
+extern void squashfs_data_cache_copy_page(struct page *,
+				struct squashfs_data_block *, int);
+extern struct squashfs_data_block *squashfs_data_cache_alloc(
+				struct squashfs_sb_info *, u64, int);
+extern void squashfs_data_cache_fill_page(struct squashfs_data_block *,
+				struct page *, int);
+extern void squashfs_data_cache_fill_entry(struct squashfs_data_block *,
+				struct squashfs_cache_entry *);
+extern void squashfs_data_cache_add(struct squashfs_sb_info *,
+				struct squashfs_data_block *);
+extern void squashfs_data_cache_init_debugfs(struct dentry *);
 
 /* decompressor.c */
 extern const struct squashfs_decompressor *squashfs_lookup_decompressor(int);
@@ -57,6 +73,9 @@ extern __le64 *squashfs_read_fragment_index_table(struct super_block *,
 void squashfs_fill_page(struct page *, struct squashfs_cache_entry *, int, int);
 void squashfs_copy_cache(struct page *, struct squashfs_cache_entry *, int,
 				int);
+extern int squashfs_init_read_wq(void);
+extern void squashfs_decompress_account(struct squashfs_sb_info *, u64, u64);
+extern void squashfs_destroy_read_wq(void);
 
 /* file_xxx.c */
 extern int squashfs_readpage_block(struct page *, u64, int, int);
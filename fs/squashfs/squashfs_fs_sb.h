@@ -40,6 +40,29 @@ struct squashfs_cache_entry {
 	struct squashfs_page_actor	*actor;
 };
 
+/*
+ * Cache of decompressed datablocks, hashed by the block's position on disk
+ * and kept in LRU order so that the shrinker can reclaim the oldest first.
+ */
+struct squashfs_data_cache {
+	spinlock_t		lock;
+	struct hlist_head	*hash;
+	struct list_head	lru;
+	unsigned int		nr;
+	unsigned int		pages;
+	struct shrinker		shrinker;
+};
+
+struct squashfs_data_block {
+	struct hlist_node	hash;
+	struct list_head	lru;
+	refcount_t		refcount;
+	u64			block;
+	int			length;
+	int			nr_pages;
+	struct page		*pages[];
+};
+
 struct squashfs_sb_info {
 	const struct squashfs_decompressor	*decompressor;
 	int					devblksize;
@@ -47,6 +70,7 @@ struct squashfs_sb_info {
 	struct squashfs_cache			*block_cache;
 	struct squashfs_cache			*fragment_cache;
 	struct squashfs_cache			*read_page;
+	struct squashfs_data_cache		*data_cache;
 	struct address_space			*cache_mapping;
 	int					next_meta_index;
 	__le64					*id_table;
@@ -67,5 +91,6 @@ struct squashfs_sb_info {
 	unsigned int				xattr_ids;
 	unsigned int				ids;
 	bool					panic_on_errors;
+	int					parallel_blocks;
 };
 #endif
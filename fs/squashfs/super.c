@@ -46,10 +46,15 @@ enum Opt_errors {
 
 enum squashfs_param {
 	Opt_errors,
+	Opt_parallel,
 };
 
+/* upper limit for the number of datablocks decompressed concurrently */
+#define SQUASHFS_MAX_PARALLEL	16
+
 struct squashfs_mount_opts {
 	enum Opt_errors errors;
+	unsigned int parallel;
 };
 
 static const struct constant_table squashfs_param_errors[] = {
@@ -60,6 +65,7 @@ static const struct constant_table squashfs_param_errors[] = {
 
 static const struct fs_parameter_spec squashfs_fs_parameters[] = {
 	fsparam_enum("errors", Opt_errors, squashfs_param_errors),
+	fsparam_u32("parallel", Opt_parallel),
 	{}
 };
 
@@ -77,6 +83,12 @@ static int squashfs_parse_param(struct fs_context *fc, struct fs_parameter *para
 	case Opt_errors:
 		opts->errors = result.uint_32;
 		break;
+	case Opt_parallel:
+		if (result.uint_32 < 1 || result.uint_32 > SQUASHFS_MAX_PARALLEL)
+			return invalfc(fc, "parallel must be between 1 and %d",
+				       SQUASHFS_MAX_PARALLEL);
+		opts->parallel = result.uint_32;
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -134,6 +146,7 @@ static int squashfs_fill_super(struct super_block *sb, struct fs_context *fc)
 	msblk = sb->s_fs_info;
 
 	msblk->panic_on_errors = (opts->errors == Opt_errors_panic);
+	msblk->parallel_blocks = opts->parallel;
 
 	msblk->devblksize = sb_min_blocksize(sb, SQUASHFS_DEVBLK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
@@ -257,6 +270,9 @@ static int squashfs_fill_super(struct super_block *sb, struct fs_context *fc)
 		goto failed_mount;
 	}
 
+	/* The decompressed datablock cache is optional */
+	msblk->data_cache = squashfs_data_cache_init(msblk->block_size);
+
 	if (msblk->devblksize == PAGE_SIZE) {
 		struct inode *cache = new_inode(sb);
 
@@ -395,6 +411,7 @@ static int squashfs_fill_super(struct super_block *sb, struct fs_context *fc)
 	squashfs_cache_delete(msblk->block_cache);
 	squashfs_cache_delete(msblk->fragment_cache);
 	squashfs_cache_delete(msblk->read_page);
+	squashfs_data_cache_delete(msblk->data_cache);
 	squashfs_decompressor_destroy(msblk);
 	if (msblk->cache_mapping)
 		iput(msblk->cache_mapping->host);
@@ -423,6 +440,7 @@ static int squashfs_reconfigure(struct fs_context *fc)
 	fc->sb_flags |= SB_RDONLY;
 
 	msblk->panic_on_errors = (opts->errors == Opt_errors_panic);
+	WRITE_ONCE(msblk->parallel_blocks, opts->parallel);
 
 	return 0;
 }
@@ -449,6 +467,9 @@ static int squashfs_show_options(struct seq_file *s, struct dentry *root)
 	else
 		seq_puts(s, ",errors=continue");
 
+	if (msblk->parallel_blocks > 1)
+		seq_printf(s, ",parallel=%d", msblk->parallel_blocks);
+
 	return 0;
 }
 
@@ -460,6 +481,7 @@ static int squashfs_init_fs_context(struct fs_context *fc)
 	if (!opts)
 		return -ENOMEM;
 
+	opts->parallel = 1;
 	fc->fs_private = opts;
 	fc->ops = &squashfs_context_ops;
 	return 0;
@@ -492,6 +514,7 @@ static void squashfs_put_super(struct super_block *sb)
 		squashfs_cache_delete(sbi->block_cache);
 		squashfs_cache_delete(sbi->fragment_cache);
 		squashfs_cache_delete(sbi->read_page);
+		squashfs_data_cache_delete(sbi->data_cache);
 		squashfs_decompressor_destroy(sbi);
 		if (sbi->cache_mapping)
 			iput(sbi->cache_mapping->host);
@@ -545,8 +568,15 @@ static int __init init_squashfs_fs(void)
 	if (err)
 		return err;
 
+	err = squashfs_init_read_wq();
+	if (err) {
+		destroy_inodecache();
+		return err;
+	}
+
 	err = register_filesystem(&squashfs_fs_type);
 	if (err) {
+		squashfs_destroy_read_wq();
 		destroy_inodecache();
 		return err;
 	}
@@ -560,6 +590,7 @@ static int __init init_squashfs_fs(void)
 static void __exit exit_squashfs_fs(void)
 {
 	unregister_filesystem(&squashfs_fs_type);
+	squashfs_destroy_read_wq();
 	destroy_inodecache();
 }
 
@@ -161,5 +161,6 @@ static inline int fsverity_init_signature(void)
 
 int __init fsverity_init_workqueue(void);
 void __init fsverity_exit_workqueue(void);
+void __init fsverity_init_stats(void);
 
 #endif /* _FSVERITY_PRIVATE_H */
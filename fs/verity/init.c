@@ -49,6 +49,8 @@ static int __init fsverity_init(void)
 	if (err)
 		goto err_exit_workqueue;
 
+	fsverity_init_stats();
+
 	pr_debug("Initialized fs-verity\n");
 	return 0;
 
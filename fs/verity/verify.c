@@ -9,7 +9,9 @@
 
 #include <crypto/hash.h>
 #include <linux/bio.h>
+#include <linux/debugfs.h>
 #include <linux/ratelimit.h>
+#include <linux/seq_file.h>
 
 static struct workqueue_struct *fsverity_read_workqueue;
 
@@ -66,8 +68,92 @@ static inline int cmp_hashes(const struct fsverity_info *vi,
 	return -EBADMSG;
 }
 
+#ifdef CONFIG_DEBUG_FS
+#define FSVERITY_LAT_BUCKETS	16	/* <1us .. >=16ms */
+
+/* Statistics reported in <debugfs>/fsverity/stats */
+static struct {
+	atomic64_t bios;
+	atomic64_t pages;
+	atomic64_t ns;
+	atomic64_t hash_pages_verified;
+	atomic64_t hash_lookups_saved;
+	atomic64_t page_lat[FSVERITY_LAT_BUCKETS];
+} fsverity_stats;
+
+#define fsverity_stat_inc(field)	atomic64_inc(&fsverity_stats.field)
+
+static void fsverity_stat_bio(unsigned int pages, u64 ns)
+{
+	u64 per_page = pages ? div_u64(ns, pages) : 0;
+
+	atomic64_inc(&fsverity_stats.bios);
+	atomic64_add(pages, &fsverity_stats.pages);
+	atomic64_add(ns, &fsverity_stats.ns);
+	atomic64_add(pages, &fsverity_stats.page_lat[
+		min_t(unsigned int, fls64(per_page >> 10),
+		      FSVERITY_LAT_BUCKETS - 1)]);
+}
+
+static int fsverity_stats_show(struct seq_file *m, void *v)
+{
+	u64 pages = atomic64_read(&fsverity_stats.pages);
+	u64 ns = atomic64_read(&fsverity_stats.ns);
+	int i;
+
+	seq_printf(m, "bios %lld\n", atomic64_read(&fsverity_stats.bios));
+	seq_printf(m, "pages %llu\n", pages);
+	seq_printf(m, "hash_pages_verified %lld\n",
+		   atomic64_read(&fsverity_stats.hash_pages_verified));
+	seq_printf(m, "hash_lookups_saved %lld\n",
+		   atomic64_read(&fsverity_stats.hash_lookups_saved));
+	seq_printf(m, "throughput_kib_per_sec %llu\n",
+		   div64_u64((pages << (PAGE_SHIFT - 10)) * USEC_PER_SEC,
+			     div_u64(ns, NSEC_PER_USEC) ?: 1));
+	seq_printf(m, "page_avg_ns %llu\n", pages ? div64_u64(ns, pages) : 0);
+	seq_puts(m, "page_latency_us");
+	for (i = 0; i < FSVERITY_LAT_BUCKETS; i++)
+		seq_printf(m, " %lld",
+			   atomic64_read(&fsverity_stats.page_lat[i]));
+	seq_putc(m, '\n');
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fsverity_stats);
+
+void __init fsverity_init_stats(void)
+{
+	struct dentry *dir = debugfs_create_dir("fsverity", NULL);
+
+	debugfs_create_file("stats", 0444, dir, NULL, &fsverity_stats_fops);
+}
+#else
+#define fsverity_stat_inc(field)	do { } while (0)
+static inline void fsverity_stat_bio(unsigned int pages, u64 ns) { }
+void __init fsverity_init_stats(void) { }
+#endif /* CONFIG_DEBUG_FS */
+
 /*
- * Verify a single data page against the file's Merkle tree.
+ * The level 0 hash page most recently verified while verifying a run of data
+ * pages.  Consecutive data pages share a level 0 hash page, so keeping a
+ * reference to it lets them skip the page cache lookup and PageChecked test.
+ */
+struct verify_ctx {
+	struct page *hpage;
+	pgoff_t hindex;
+};
+
+static void verify_ctx_set(struct verify_ctx *ctx, struct page *hpage,
+			   pgoff_t hindex)
+{
+	if (ctx->hpage)
+		put_page(ctx->hpage);
+	ctx->hpage = hpage;
+	ctx->hindex = hindex;
+}
+
+/*
+ * Get the hash that data page @index must have into @want_hash, verifying the
+ * Merkle tree path to it as needed.
  *
  * In principle, we need to verify the entire path to the root node.  However,
  * for efficiency the filesystem may cache the hash pages.  Therefore we need
@@ -81,27 +167,33 @@ static inline int cmp_hashes(const struct fsverity_info *vi,
  * Note that multiple processes may race to verify a hash page and mark it
  * Checked, but it doesn't matter; the result will be the same either way.
  *
- * Return: true if the page is valid, else false.
+ * On success the verified level 0 hash page is left in @ctx.
  */
-static bool verify_page(struct inode *inode, const struct fsverity_info *vi,
-			struct ahash_request *req, struct page *data_page,
-			unsigned long level0_ra_pages)
+static int find_data_hash(struct inode *inode, const struct fsverity_info *vi,
+			  struct ahash_request *req, pgoff_t index,
+			  unsigned long level0_ra_pages, struct verify_ctx *ctx,
+			  u8 *want_hash)
 {
 	const struct merkle_tree_params *params = &vi->tree_params;
 	const unsigned int hsize = params->digest_size;
-	const pgoff_t index = data_page->index;
 	int level;
-	u8 _want_hash[FS_VERITY_MAX_DIGEST_SIZE];
-	const u8 *want_hash;
 	u8 real_hash[FS_VERITY_MAX_DIGEST_SIZE];
 	struct page *hpages[FS_VERITY_MAX_LEVELS];
 	unsigned int hoffsets[FS_VERITY_MAX_LEVELS];
-	int err;
+	pgoff_t hindexes[FS_VERITY_MAX_LEVELS];
+	int err = 0;
 
-	if (WARN_ON_ONCE(!PageLocked(data_page) || PageUptodate(data_page)))
-		return false;
+	if (params->num_levels && ctx->hpage) {
+		pgoff_t hindex;
+		unsigned int hoffset;
 
-	pr_debug_ratelimited("Verifying data page %lu...\n", index);
+		hash_at_level(params, index, 0, &hindex, &hoffset);
+		if (hindex == ctx->hindex) {
+			extract_hash(ctx->hpage, hoffset, hsize, want_hash);
+			fsverity_stat_inc(hash_lookups_saved);
+			return 0;
+		}
+	}
 
 	/*
 	 * Starting at the leaf level, ascend the tree saving hash pages along
@@ -129,9 +221,11 @@ static bool verify_page(struct inode *inode, const struct fsverity_info *vi,
 		}
 
 		if (PageChecked(hpage)) {
-			extract_hash(hpage, hoffset, hsize, _want_hash);
-			want_hash = _want_hash;
-			put_page(hpage);
+			extract_hash(hpage, hoffset, hsize, want_hash);
+			if (level == 0)
+				verify_ctx_set(ctx, hpage, hindex);
+			else
+				put_page(hpage);
 			pr_debug_ratelimited("Hash page already checked, want %s:%*phN\n",
 					     params->hash_alg->name,
 					     hsize, want_hash);
@@ -140,9 +234,10 @@ static bool verify_page(struct inode *inode, const struct fsverity_info *vi,
 		pr_debug_ratelimited("Hash page not yet checked\n");
 		hpages[level] = hpage;
 		hoffsets[level] = hoffset;
+		hindexes[level] = hindex;
 	}
 
-	want_hash = vi->root_hash;
+	memcpy(want_hash, vi->root_hash, hsize);
 	pr_debug("Want root hash: %s:%*phN\n",
 		 params->hash_alg->name, hsize, want_hash);
 descend:
@@ -158,23 +253,52 @@ static bool verify_page(struct inode *inode, const struct fsverity_info *vi,
 		if (err)
 			goto out;
 		SetPageChecked(hpage);
-		extract_hash(hpage, hoffset, hsize, _want_hash);
-		want_hash = _want_hash;
-		put_page(hpage);
+		fsverity_stat_inc(hash_pages_verified);
+		extract_hash(hpage, hoffset, hsize, want_hash);
+		if (level == 1)
+			verify_ctx_set(ctx, hpage, hindexes[0]);
+		else
+			put_page(hpage);
 		pr_debug("Verified hash page at level %d, now want %s:%*phN\n",
 			 level - 1, params->hash_alg->name, hsize, want_hash);
 	}
-
-	/* Finally, verify the data page */
-	err = fsverity_hash_page(params, inode, req, data_page, real_hash);
-	if (err)
-		goto out;
-	err = cmp_hashes(vi, want_hash, real_hash, index, -1);
 out:
 	for (; level > 0; level--)
 		put_page(hpages[level - 1]);
 
-	return err == 0;
+	return err;
+}
+
+/*
+ * Verify a single data page against the file's Merkle tree.
+ *
+ * Return: true if the page is valid, else false.
+ */
+static bool verify_page(struct inode *inode, const struct fsverity_info *vi,
+			struct ahash_request *req, struct page *data_page,
+			unsigned long level0_ra_pages, struct verify_ctx *ctx)
+{
+	const struct merkle_tree_params *params = &vi->tree_params;
+	const pgoff_t index = data_page->index;
+	u8 want_hash[FS_VERITY_MAX_DIGEST_SIZE];
+	u8 real_hash[FS_VERITY_MAX_DIGEST_SIZE];
+	int err;
+
+	if (WARN_ON_ONCE(!PageLocked(data_page) || PageUptodate(data_page)))
+		return false;
+
+	pr_debug_ratelimited("Verifying data page %lu...\n", index);
+
+	err = find_data_hash(inode, vi, req, index, level0_ra_pages, ctx,
+			     want_hash);
+	if (err)
+		return false;
+
+	/* Finally, verify the data page */
+	err = fsverity_hash_page(params, inode, req, data_page, real_hash);
+	if (err)
+		return false;
+	return cmp_hashes(vi, want_hash, real_hash, index, -1) == 0;
 }
 
 /**
@@ -191,13 +315,15 @@ bool fsverity_verify_page(struct page *page)
 	struct inode *inode = page->mapping->host;
 	const struct fsverity_info *vi = inode->i_verity_info;
 	struct ahash_request *req;
+	struct verify_ctx ctx = {};
 	bool valid;
 
 	/* This allocation never fails, since it's mempool-backed. */
 	req = fsverity_alloc_hash_request(vi->tree_params.hash_alg, GFP_NOFS);
 
-	valid = verify_page(inode, vi, req, page, 0);
+	valid = verify_page(inode, vi, req, page, 0, &ctx);
 
+	verify_ctx_set(&ctx, NULL, 0);
 	fsverity_free_hash_request(vi->tree_params.hash_alg, req);
 
 	return valid;
@@ -205,6 +331,34 @@ bool fsverity_verify_page(struct page *page)
 EXPORT_SYMBOL_GPL(fsverity_verify_page);
 
 #ifdef CONFIG_BLOCK
+/* Number of data pages whose hashes are looked up before hashing them */
+#define FS_VERITY_BATCH_PAGES	8
+
+struct verify_batch {
+	struct page *page;
+	u8 want_hash[FS_VERITY_MAX_DIGEST_SIZE];
+};
+
+/* Hash a batch of data pages back to back and check them */
+static void verify_data_batch(struct inode *inode,
+			      const struct fsverity_info *vi,
+			      struct ahash_request *req,
+			      struct verify_batch *batch, unsigned int n)
+{
+	u8 real_hash[FS_VERITY_MAX_DIGEST_SIZE];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct page *page = batch[i].page;
+
+		if (fsverity_hash_page(&vi->tree_params, inode, req, page,
+				       real_hash) ||
+		    cmp_hashes(vi, batch[i].want_hash, real_hash, page->index,
+			       -1))
+			SetPageError(page);
+	}
+}
+
 /**
  * fsverity_verify_bio() - verify a 'read' bio that has just completed
  * @bio: the bio to verify
@@ -214,6 +368,10 @@ EXPORT_SYMBOL_GPL(fsverity_verify_page);
  * that fail verification are set to the Error state.  Verification is skipped
  * for pages already in the Error state, e.g. due to fscrypt decryption failure.
  *
+ * The hashes of the data pages are looked up first, FS_VERITY_BATCH_PAGES at
+ * a time, so that each distinct hash page the bio needs is found and verified
+ * once; the data pages of the batch are then hashed in one go.
+ *
  * This is a helper function for use by the ->readpages() method of filesystems
  * that issue bios to read data directly into the page cache.  Filesystems that
  * populate the page cache without issuing bios (e.g. non block-based
@@ -229,6 +387,10 @@ void fsverity_verify_bio(struct bio *bio)
 	struct bio_vec *bv;
 	struct bvec_iter_all iter_all;
 	unsigned long max_ra_pages = 0;
+	struct verify_ctx ctx = {};
+	struct verify_batch batch[FS_VERITY_BATCH_PAGES];
+	unsigned int n = 0, pages = 0;
+	u64 start = ktime_get_ns();
 
 	/* This allocation never fails, since it's mempool-backed. */
 	req = fsverity_alloc_hash_request(params->hash_alg, GFP_NOFS);
@@ -254,12 +416,30 @@ void fsverity_verify_bio(struct bio *bio)
 		unsigned long level0_ra_pages =
 			min(max_ra_pages, params->level0_blocks - level0_index);
 
-		if (!PageError(page) &&
-		    !verify_page(inode, vi, req, page, level0_ra_pages))
+		if (PageError(page))
+			continue;
+
+		if (WARN_ON_ONCE(!PageLocked(page) || PageUptodate(page)) ||
+		    find_data_hash(inode, vi, req, page->index,
+				   level0_ra_pages, &ctx,
+				   batch[n].want_hash)) {
 			SetPageError(page);
+			continue;
+		}
+
+		batch[n++].page = page;
+		pages++;
+		if (n == FS_VERITY_BATCH_PAGES) {
+			verify_data_batch(inode, vi, req, batch, n);
+			n = 0;
+		}
 	}
+	verify_data_batch(inode, vi, req, batch, n);
 
+	verify_ctx_set(&ctx, NULL, 0);
 	fsverity_free_hash_request(params->hash_alg, req);
+
+	fsverity_stat_bio(pages, ktime_get_ns() - start);
 }
 EXPORT_SYMBOL_GPL(fsverity_verify_bio);
 #endif /* CONFIG_BLOCK */
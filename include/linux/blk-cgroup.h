@@ -126,6 +126,9 @@ struct blkcg_gq {
 
 	struct blkg_iostat_set __percpu	*iostat_cpu;
 	struct blkg_iostat_set		iostat;
+#ifdef CONFIG_BLK_LAT_HIST
+	struct blk_lat_hist __percpu	*lat_hist;
+#endif
 
 	struct blkg_policy_data		*pd[BLKCG_MAX_POLS];
 
@@ -165,6 +165,11 @@ struct blk_mq_hw_ctx {
 	struct dentry		*sched_debugfs_dir;
 #endif
 
+#ifdef CONFIG_BLK_LAT_HIST
+	/** @lat_hist: Per-cpu latency histograms of completed requests. */
+	struct blk_lat_hist __percpu *lat_hist;
+#endif
+
 	/**
 	 * @hctx_list: if this hctx is not in use, this is an entry in
 	 * q->unused_hctx_list.
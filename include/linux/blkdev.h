@@ -236,7 +236,8 @@ struct request {
 	rq_end_io_fn *end_io;
 	void *end_io_data;
 
-	ANDROID_KABI_RESERVE(1);
+	/* blkg whose latency histogram this request is accounted to */
+	ANDROID_KABI_USE(1, struct blkcg_gq *lat_blkg);
 };
 
 static inline int blk_validate_block_size(unsigned int bsize)
@@ -784,6 +784,7 @@ void cgroup_rstat_flush(struct cgroup *cgrp);
 void cgroup_rstat_flush_irqsafe(struct cgroup *cgrp);
 void cgroup_rstat_flush_hold(struct cgroup *cgrp);
 void cgroup_rstat_flush_release(void);
+bool cgroup_rstat_flushed_recently(struct cgroup *cgrp);
 
 /*
  * Basic resource stats.
@@ -113,6 +113,8 @@ enum hrtimer_restart {
  * @is_soft:	Set if hrtimer will be expired in soft interrupt context.
  * @is_hard:	Set if hrtimer will be expired in hard interrupt context
  *		even on RT.
+ * @slack_ns:	The slack requested when the expiry was set, so that slack
+ *		coalescing can realign a timer that is restarted.
  *
  * The hrtimer structure must be initialized by hrtimer_init()
  */
@@ -126,7 +128,7 @@ struct hrtimer {
 	u8				is_soft;
 	u8				is_hard;
 
-	ANDROID_KABI_RESERVE(1);
+	ANDROID_KABI_USE(1, u64 slack_ns);
 };
 
 /**
@@ -198,6 +200,11 @@ enum  hrtimer_base_type {
  * @nr_retries:		Total number of hrtimer interrupt retries
  * @nr_hangs:		Total number of hrtimer interrupt hangs
  * @max_hang_time:	Maximum time spent in hrtimer_interrupt
+ * @nr_aligned:		Total number of timers whose hard expiry was moved
+ *			onto a shared wake point by slack coalescing
+ * @nr_batched:		Total number of timers expired before their hard
+ *			expiry by another timer's interrupt, i.e. wakeups
+ *			avoided by using the slack window
  * @softirq_expiry_lock: Lock which is taken while softirq based hrtimer are
  *			 expired
  * @timer_waiters:	A hrtimer_cancel() invocation waits for the timer
@@ -228,6 +235,8 @@ struct hrtimer_cpu_base {
 	unsigned short			nr_retries;
 	unsigned short			nr_hangs;
 	unsigned int			max_hang_time;
+	unsigned int			nr_aligned;
+	unsigned int			nr_batched;
 #endif
 #ifdef CONFIG_PREEMPT_RT
 	spinlock_t			softirq_expiry_lock;
@@ -244,24 +253,28 @@ static inline void hrtimer_set_expires(struct hrtimer *timer, ktime_t time)
 {
 	timer->node.expires = time;
 	timer->_softexpires = time;
+	timer->slack_ns = 0;
 }
 
 static inline void hrtimer_set_expires_range(struct hrtimer *timer, ktime_t time, ktime_t delta)
 {
 	timer->_softexpires = time;
 	timer->node.expires = ktime_add_safe(time, delta);
+	timer->slack_ns = ktime_to_ns(delta);
 }
 
 static inline void hrtimer_set_expires_range_ns(struct hrtimer *timer, ktime_t time, u64 delta)
 {
 	timer->_softexpires = time;
 	timer->node.expires = ktime_add_safe(time, ns_to_ktime(delta));
+	timer->slack_ns = delta;
 }
 
 static inline void hrtimer_set_expires_tv64(struct hrtimer *timer, s64 tv64)
 {
 	timer->node.expires = tv64;
 	timer->_softexpires = tv64;
+	timer->slack_ns = 0;
 }
 
 static inline void hrtimer_add_expires(struct hrtimer *timer, ktime_t time)
@@ -102,7 +102,8 @@ struct work_struct {
 #ifdef CONFIG_LOCKDEP
 	struct lockdep_map lockdep_map;
 #endif
-	ANDROID_KABI_RESERVE(1);
+	/* when the work was last inserted, for CONFIG_WQ_LATENCY_STATS */
+	ANDROID_KABI_USE(1, u64 queued_ns);
 	ANDROID_KABI_RESERVE(2);
 };
 
@@ -7,13 +7,15 @@
 #ifndef _LINUX_DM_USER_H
 #define _LINUX_DM_USER_H
 
+#include <linux/ioctl.h>
 #include <linux/types.h>
 
 /*
  * dm-user proxies device mapper ops between the kernel and userspace.  It's
  * essentially just an RPC mechanism: all kernel calls create a request,
  * userspace handles that with a response.  Userspace obtains requests via
- * read() and provides responses via write().
+ * read() and provides responses via write(), or through a ring of requests
+ * and responses that is shared with the kernel (see below).
  *
  * See Documentation/block/dm-user.rst for more information.
  */
@@ -65,4 +67,68 @@ struct dm_user_message {
 	__u8 buf[];
 };
 
+/*
+ * Shared memory transport.  DM_USER_IOCTL_RING_SETUP switches a channel (an
+ * open file descriptor) over to a submission queue of requests filled by the
+ * kernel, a completion queue of responses filled by userspace and a data area
+ * of one slot per entry, all in a single mapping obtained by mmap() of the
+ * returned size at offset 0.  Once the ring is set up read() and write() fail
+ * with -EBUSY on that channel.
+ *
+ * The kernel copies write payloads into the request's slot before publishing
+ * it and copies read payloads out of the slot when the response is reaped, so
+ * no BIO data crosses the syscall boundary.  DM_USER_IOCTL_RING_ENTER is the
+ * doorbell: it reaps every posted response and then posts as many requests as
+ * there are free slots, returning the number posted.  With
+ * DM_USER_RING_ENTER_WAIT it sleeps until there is a request to post.  The
+ * channel also supports poll(), which signals readable whenever the target has
+ * requests waiting.
+ *
+ * Reads and writes are split by the kernel so that no request carries more
+ * than DM_USER_RING_SLOT_SIZE bytes.  Indices are free running, an entry's
+ * position in its queue is the index masked with entries - 1.
+ */
+#define DM_USER_RING_MAX_ENTRIES 128
+#define DM_USER_RING_SLOT_SIZE (128 * 1024)
+
+#define DM_USER_RING_ENTER_WAIT 0x1
+
+struct dm_user_ring_setup {
+	__u32 entries;		/* in: power of two, at most MAX_ENTRIES */
+	__u32 resv;
+	__u64 size;		/* out: length of the mapping */
+	__u64 sq_off;		/* out: offset of the submission queue */
+	__u64 cq_off;		/* out: offset of the completion queue */
+	__u64 data_off;		/* out: offset of the data slots */
+};
+
+/* Lives at offset 0 of the mapping */
+struct dm_user_ring_header {
+	__u32 sq_head;		/* written by userspace */
+	__u32 sq_tail;		/* written by the kernel */
+	__u32 cq_head;		/* written by the kernel */
+	__u32 cq_tail;		/* written by userspace */
+};
+
+struct dm_user_ring_sqe {
+	__u64 seq;
+	__u64 type;
+	__u64 flags;
+	__u64 sector;
+	__u64 len;
+	__u32 slot;		/* data is at data_off + slot * SLOT_SIZE */
+	__u32 resv;
+};
+
+struct dm_user_ring_cqe {
+	__u64 seq;
+	__u32 type;		/* DM_USER_RESP_* */
+	__u32 resv;
+};
+
+#define DM_USER_IOCTL_MAGIC 0xfd
+#define DM_USER_IOCTL_RING_SETUP \
+	_IOWR(DM_USER_IOCTL_MAGIC, 0x80, struct dm_user_ring_setup)
+#define DM_USER_IOCTL_RING_ENTER _IO(DM_USER_IOCTL_MAGIC, 0x81)
+
 #endif
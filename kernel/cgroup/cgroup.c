@@ -3647,6 +3647,10 @@ static int cgroup_stat_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "nr_dying_descendants %d\n",
 		   cgroup->nr_dying_descendants);
 
+	/* rstat flushing is global, report it once at the root */
+	if (!cgroup_parent(cgroup))
+		cgroup_rstat_stat_show(seq);
+
 	return 0;
 }
 
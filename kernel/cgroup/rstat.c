@@ -1,11 +1,29 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include "cgroup-internal.h"
 
+#include <linux/moduleparam.h>
+#include <linux/sched/clock.h>
 #include <linux/sched/cputime.h>
 
 static DEFINE_SPINLOCK(cgroup_rstat_lock);
 static DEFINE_PER_CPU(raw_spinlock_t, cgroup_rstat_cpu_lock);
 
+/*
+ * Readers of cpu.stat and memory.stat accept stats up to this many
+ * milliseconds stale. If the subtree or any of its ancestors was fully
+ * flushed within the interval, the flush is skipped. 0 disables it.
+ */
+static unsigned int cgroup_rstat_flush_interval_ms;
+module_param_named(flush_interval_ms, cgroup_rstat_flush_interval_ms,
+		   uint, 0644);
+
+/* flush accounting, protected by cgroup_rstat_lock */
+static u64 cgroup_rstat_nr_flushes;
+static u64 cgroup_rstat_nr_cpus_flushed;
+static u64 cgroup_rstat_flush_ns;
+static u64 cgroup_rstat_max_flush_ns;
+static atomic64_t cgroup_rstat_nr_skipped = ATOMIC64_INIT(0);
+
 static void cgroup_base_stat_flush(struct cgroup *cgrp, int cpu);
 
 static struct cgroup_rstat_cpu *cgroup_rstat_cpu(struct cgroup *cgrp, int cpu)
@@ -148,6 +166,8 @@ static struct cgroup *cgroup_rstat_cpu_pop_updated(struct cgroup *pos,
 static void cgroup_rstat_flush_locked(struct cgroup *cgrp, bool may_sleep)
 	__releases(&cgroup_rstat_lock) __acquires(&cgroup_rstat_lock)
 {
+	u64 start = local_clock();
+	u64 elapsed;
 	int cpu;
 
 	lockdep_assert_held(&cgroup_rstat_lock);
@@ -155,8 +175,19 @@ static void cgroup_rstat_flush_locked(struct cgroup *cgrp, bool may_sleep)
 	for_each_possible_cpu(cpu) {
 		raw_spinlock_t *cpu_lock = per_cpu_ptr(&cgroup_rstat_cpu_lock,
 						       cpu);
+		struct cgroup_rstat_cpu *rstatc = cgroup_rstat_cpu(cgrp, cpu);
 		struct cgroup *pos = NULL;
 
+		/*
+		 * Only walk CPUs with pending updates in this subtree.
+		 * Racing with cgroup_rstat_updated() here is no different
+		 * from the update arriving right after the flush.
+		 */
+		if (READ_ONCE(rstatc->updated_children) == cgrp &&
+		    !READ_ONCE(rstatc->updated_next))
+			continue;
+
+		cgroup_rstat_nr_cpus_flushed++;
 		raw_spin_lock(cpu_lock);
 		while ((pos = cgroup_rstat_cpu_pop_updated(pos, cgrp, cpu))) {
 			struct cgroup_subsys_state *css;
@@ -180,6 +211,39 @@ static void cgroup_rstat_flush_locked(struct cgroup *cgrp, bool may_sleep)
 			spin_lock_irq(&cgroup_rstat_lock);
 		}
 	}
+
+	cgrp->rstat_flush_time = local_clock();
+	elapsed = cgrp->rstat_flush_time - start;
+	cgroup_rstat_nr_flushes++;
+	cgroup_rstat_flush_ns += elapsed;
+	cgroup_rstat_max_flush_ns = max(cgroup_rstat_max_flush_ns, elapsed);
+}
+
+/**
+ * cgroup_rstat_flushed_recently - test whether @cgrp's stats are fresh enough
+ * @cgrp: target cgroup
+ *
+ * Return %true if @cgrp or one of its ancestors completed a flush within
+ * the last flush_interval_ms, in which case a reader that tolerates stale
+ * stats can skip flushing. The skipped flush is accounted.
+ */
+bool cgroup_rstat_flushed_recently(struct cgroup *cgrp)
+{
+	u64 interval = READ_ONCE(cgroup_rstat_flush_interval_ms) *
+		       (u64)NSEC_PER_MSEC;
+	u64 now;
+
+	if (!interval)
+		return false;
+
+	now = local_clock();
+	for (; cgrp; cgrp = cgroup_parent(cgrp)) {
+		if (now - READ_ONCE(cgrp->rstat_flush_time) < interval) {
+			atomic64_inc(&cgroup_rstat_nr_skipped);
+			return true;
+		}
+	}
+	return false;
 }
 
 /**
@@ -224,7 +288,8 @@ void cgroup_rstat_flush_irqsafe(struct cgroup *cgrp)
  * @cgrp: target cgroup
  *
  * Flush stats in @cgrp's subtree and prevent further flushes.  Must be
- * paired with cgroup_rstat_flush_release().
+ * paired with cgroup_rstat_flush_release().  The flush itself is skipped
+ * if the subtree was flushed within flush_interval_ms.
  *
  * This function may block.
  */
@@ -233,7 +298,8 @@ void cgroup_rstat_flush_hold(struct cgroup *cgrp)
 {
 	might_sleep();
 	spin_lock_irq(&cgroup_rstat_lock);
-	cgroup_rstat_flush_locked(cgrp, true);
+	if (!cgroup_rstat_flushed_recently(cgrp))
+		cgroup_rstat_flush_locked(cgrp, true);
 }
 
 /**
@@ -286,6 +352,25 @@ void cgroup_rstat_exit(struct cgroup *cgrp)
 	cgrp->rstat_cpu = NULL;
 }
 
+void cgroup_rstat_stat_show(struct seq_file *seq)
+{
+	u64 flushes, cpus, flush_ns, max_ns;
+
+	spin_lock_irq(&cgroup_rstat_lock);
+	flushes = cgroup_rstat_nr_flushes;
+	cpus = cgroup_rstat_nr_cpus_flushed;
+	flush_ns = cgroup_rstat_flush_ns;
+	max_ns = cgroup_rstat_max_flush_ns;
+	spin_unlock_irq(&cgroup_rstat_lock);
+
+	seq_printf(seq, "rstat_flushes %llu\n", flushes);
+	seq_printf(seq, "rstat_flushes_skipped %llu\n",
+		   (u64)atomic64_read(&cgroup_rstat_nr_skipped));
+	seq_printf(seq, "rstat_flush_cpus %llu\n", cpus);
+	seq_printf(seq, "rstat_flush_usec %llu\n", div_u64(flush_ns, NSEC_PER_USEC));
+	seq_printf(seq, "rstat_flush_max_usec %llu\n", div_u64(max_ns, NSEC_PER_USEC));
+}
+
 void __init cgroup_rstat_boot(void)
 {
 	int cpu;
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sampling lock contention profiler
+ *
+ * When CONFIG_LOCK_CONTENTION_PROFILE is enabled, the qspinlock, mutex and
+ * rwsem slow paths report contended acquisitions here. Everything is keyed
+ * by lock address in a fixed size, lockless open addressed table that is
+ * only allocated the first time the profiler is switched on. For every
+ * lock the table keeps the number of sampled acquisitions, the total and
+ * maximum wait time, a log2 wait time histogram and the call chain of the
+ * first acquisition that contended on it.
+ *
+ * Files under <debugfs>/lock_contention/:
+ *
+ *   enable       - write 1/0 to start/stop sampling
+ *   sample_rate  - account one in N contended acquisitions (default 1)
+ *   top          - locks sorted by total wait time, any write resets
+ *
+ * Nothing in here may take a lock: it runs from within the lock slow
+ * paths, including queued_spin_lock_slowpath() in any context.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/stacktrace.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+
+#include "lock_contention.h"
+
+#define LC_HASH_BITS	10
+#define LC_HASH_SIZE	(1 << LC_HASH_BITS)
+#define LC_STACK_DEPTH	6
+#define LC_BUCKETS	16	/* <1us .. >=16ms */
+#define LC_TOP_N	32
+
+struct lc_entry {
+	void		*lock;
+	unsigned int	type;
+	unsigned int	nr_stack;
+	unsigned long	stack[LC_STACK_DEPTH];
+	atomic_long_t	nr;
+	atomic64_t	wait_ns;
+	atomic64_t	max_wait_ns;
+	atomic_long_t	hist[LC_BUCKETS];
+};
+
+DEFINE_STATIC_KEY_FALSE(lock_contention_enabled);
+
+static struct lc_entry *lc_table;
+static atomic_long_t lc_dropped;
+static u32 lc_sample_rate = 1;
+static DEFINE_PER_CPU(u32, lc_sample_count);
+static DEFINE_MUTEX(lc_control_mutex);
+
+static const char * const lc_type_names[LC_NR_TYPES] = {
+	[LC_SPINLOCK]		= "spinlock",
+	[LC_MUTEX]		= "mutex",
+	[LC_RWSEM_READ]		= "rwsem_read",
+	[LC_RWSEM_WRITE]	= "rwsem_write",
+};
+
+u64 __lock_contention_begin(void)
+{
+	u32 rate = READ_ONCE(lc_sample_rate);
+
+	if (rate > 1 && this_cpu_inc_return(lc_sample_count) % rate)
+		return 0;
+	return local_clock() ?: 1;
+}
+
+static struct lc_entry *lc_lookup(void *lock, enum lock_contention_type type)
+{
+	unsigned int i, idx = hash_ptr(lock, LC_HASH_BITS);
+	struct lc_entry *table = READ_ONCE(lc_table);
+	struct lc_entry *e;
+	void *old;
+
+	for (i = 0; i < LC_HASH_SIZE; i++) {
+		e = &table[(idx + i) & (LC_HASH_SIZE - 1)];
+		old = READ_ONCE(e->lock);
+		if (old == lock)
+			return e;
+		if (old)
+			continue;
+		old = cmpxchg(&e->lock, NULL, lock);
+		if (old == lock)
+			return e;
+		if (!old) {
+			/* We own the slot, record who contended first. */
+			e->type = type;
+			e->nr_stack = stack_trace_save(e->stack,
+						       LC_STACK_DEPTH, 2);
+			return e;
+		}
+	}
+	atomic_long_inc(&lc_dropped);
+	return NULL;
+}
+
+void __lock_contention_end(void *lock, enum lock_contention_type type,
+			   u64 start)
+{
+	struct lc_entry *e;
+	u64 wait = local_clock() - start;
+	s64 max;
+
+	/*
+	 * The key is rechecked with preemption disabled so that a reset can
+	 * wait for every update that is still in progress, see lc_top_write().
+	 */
+	preempt_disable_notrace();
+	if (!static_branch_unlikely(&lock_contention_enabled))
+		goto out;
+
+	e = lc_lookup(lock, type);
+	if (!e)
+		goto out;
+
+	atomic_long_inc(&e->nr);
+	atomic64_add(wait, &e->wait_ns);
+	atomic_long_inc(&e->hist[min_t(unsigned int, fls64(wait >> 10),
+				       LC_BUCKETS - 1)]);
+
+	max = atomic64_read(&e->max_wait_ns);
+	while (wait > max) {
+		s64 prev = atomic64_cmpxchg(&e->max_wait_ns, max, wait);
+
+		if (prev == max)
+			break;
+		max = prev;
+	}
+out:
+	preempt_enable_notrace();
+}
+
+static int lc_cmp(const void *a, const void *b)
+{
+	s64 x = atomic64_read(&(*(struct lc_entry * const *)a)->wait_ns);
+	s64 y = atomic64_read(&(*(struct lc_entry * const *)b)->wait_ns);
+
+	return x > y ? -1 : x < y;
+}
+
+static int lc_top_show(struct seq_file *m, void *v)
+{
+	struct lc_entry **sorted;
+	struct lc_entry *table = READ_ONCE(lc_table);
+	int i, j, nr = 0;
+
+	seq_printf(m, "enabled %d sample_rate %u dropped %lu\n",
+		   static_key_enabled(&lock_contention_enabled),
+		   READ_ONCE(lc_sample_rate), atomic_long_read(&lc_dropped));
+	seq_puts(m, "histogram buckets: [0] <1us, [n] <2^n us, last open ended\n");
+	if (!table)
+		return 0;
+
+	sorted = kvmalloc_array(LC_HASH_SIZE, sizeof(*sorted), GFP_KERNEL);
+	if (!sorted)
+		return -ENOMEM;
+
+	for (i = 0; i < LC_HASH_SIZE; i++) {
+		if (READ_ONCE(table[i].lock) && atomic_long_read(&table[i].nr))
+			sorted[nr++] = &table[i];
+	}
+	sort(sorted, nr, sizeof(*sorted), lc_cmp, NULL);
+
+	for (i = 0; i < min(nr, LC_TOP_N); i++) {
+		struct lc_entry *e = sorted[i];
+		unsigned long cnt = atomic_long_read(&e->nr);
+
+		seq_printf(m, "%pS %s: contended %lu wait_us total %llu avg %llu max %llu\n",
+			   e->lock, lc_type_names[e->type], cnt,
+			   div_u64(atomic64_read(&e->wait_ns), NSEC_PER_USEC),
+			   div_u64(div_u64(atomic64_read(&e->wait_ns), cnt),
+				   NSEC_PER_USEC),
+			   div_u64(atomic64_read(&e->max_wait_ns),
+				   NSEC_PER_USEC));
+		seq_puts(m, "  hist");
+		for (j = 0; j < LC_BUCKETS; j++)
+			seq_printf(m, " %lu", atomic_long_read(&e->hist[j]));
+		seq_putc(m, '\n');
+		for (j = 0; j < e->nr_stack; j++)
+			seq_printf(m, "  %pS\n", (void *)e->stack[j]);
+	}
+	kvfree(sorted);
+	return 0;
+}
+
+static int lc_top_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lc_top_show, NULL);
+}
+
+/*
+ * Reset the table, releasing every slot. Sampling is switched off first and
+ * synchronize_rcu() waits for the updates that still saw it enabled, so that
+ * nobody writes to a slot while it is being cleared.
+ */
+static ssize_t lc_top_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	bool enabled;
+
+	mutex_lock(&lc_control_mutex);
+	if (lc_table) {
+		enabled = static_key_enabled(&lock_contention_enabled);
+		if (enabled) {
+			static_branch_disable(&lock_contention_enabled);
+			synchronize_rcu();
+		}
+		memset(lc_table, 0, array_size(LC_HASH_SIZE, sizeof(*lc_table)));
+		if (enabled)
+			static_branch_enable(&lock_contention_enabled);
+	}
+	atomic_long_set(&lc_dropped, 0);
+	mutex_unlock(&lc_control_mutex);
+	return count;
+}
+
+static const struct file_operations lc_top_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lc_top_open,
+	.read		= seq_read,
+	.write		= lc_top_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t lc_enable_read(struct file *file, char __user *user_buf,
+			      size_t count, loff_t *ppos)
+{
+	char buf[3];
+
+	buf[0] = static_key_enabled(&lock_contention_enabled) ? '1' : '0';
+	buf[1] = '\n';
+	buf[2] = '\0';
+	return simple_read_from_buffer(user_buf, count, ppos, buf, 2);
+}
+
+static ssize_t lc_enable_write(struct file *file, const char __user *user_buf,
+			       size_t count, loff_t *ppos)
+{
+	struct lc_entry *table;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(user_buf, count, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&lc_control_mutex);
+	if (enable && !lc_table) {
+		table = vzalloc(array_size(LC_HASH_SIZE, sizeof(*table)));
+		if (!table) {
+			mutex_unlock(&lc_control_mutex);
+			return -ENOMEM;
+		}
+		/* Publish the table before the static key can be seen set. */
+		smp_store_release(&lc_table, table);
+	}
+	if (enable)
+		static_branch_enable(&lock_contention_enabled);
+	else
+		static_branch_disable(&lock_contention_enabled);
+	mutex_unlock(&lc_control_mutex);
+	return count;
+}
+
+static const struct file_operations lc_enable_fops = {
+	.read		= lc_enable_read,
+	.write		= lc_enable_write,
+	.llseek		= default_llseek,
+};
+
+static int lc_sample_rate_set(void *data, u64 val)
+{
+	if (!val || val > U32_MAX)
+		return -EINVAL;
+	WRITE_ONCE(lc_sample_rate, val);
+	return 0;
+}
+
+static int lc_sample_rate_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(lc_sample_rate);
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(lc_sample_rate_fops, lc_sample_rate_get,
+			 lc_sample_rate_set, "%llu\n");
+
+static int __init init_lock_contention(void)
+{
+	struct dentry *d_dir = debugfs_create_dir("lock_contention", NULL);
+
+	debugfs_create_file("enable", 0600, d_dir, NULL, &lc_enable_fops);
+	debugfs_create_file_unsafe("sample_rate", 0600, d_dir, NULL,
+				   &lc_sample_rate_fops);
+	debugfs_create_file("top", 0600, d_dir, NULL, &lc_top_fops);
+	return 0;
+}
+fs_initcall(init_lock_contention);
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Sampling lock contention profiler
+ *
+ * The slow paths call lock_contention_begin() on entry and
+ * lock_contention_end() once the lock is owned. While the profiler is
+ * disabled both collapse to a static branch that is patched out.
+ */
+#ifndef __LOCKING_LOCK_CONTENTION_H
+#define __LOCKING_LOCK_CONTENTION_H
+
+#include <linux/jump_label.h>
+#include <linux/types.h>
+
+enum lock_contention_type {
+	LC_SPINLOCK,
+	LC_MUTEX,
+	LC_RWSEM_READ,
+	LC_RWSEM_WRITE,
+	LC_NR_TYPES,
+};
+
+#ifdef CONFIG_LOCK_CONTENTION_PROFILE
+
+DECLARE_STATIC_KEY_FALSE(lock_contention_enabled);
+
+u64 __lock_contention_begin(void);
+void __lock_contention_end(void *lock, enum lock_contention_type type,
+			   u64 start);
+
+/*
+ * Return the start timestamp of a sampled acquisition, or 0 if this one
+ * is not being sampled.
+ */
+static __always_inline u64 lock_contention_begin(void)
+{
+	if (static_branch_unlikely(&lock_contention_enabled))
+		return __lock_contention_begin();
+	return 0;
+}
+
+static __always_inline void lock_contention_end(void *lock,
+						enum lock_contention_type type,
+						u64 start)
+{
+	if (unlikely(start))
+		__lock_contention_end(lock, type, start);
+}
+
+#else  /* CONFIG_LOCK_CONTENTION_PROFILE */
+
+static __always_inline u64 lock_contention_begin(void)
+{
+	return 0;
+}
+
+static __always_inline void lock_contention_end(void *lock,
+						enum lock_contention_type type,
+						u64 start) { }
+
+#endif /* CONFIG_LOCK_CONTENTION_PROFILE */
+#endif /* __LOCKING_LOCK_CONTENTION_H */
@@ -584,6 +584,7 @@ __mutex_lock_common(struct mutex *lock, unsigned int state, unsigned int subclas
 {
 	struct mutex_waiter waiter;
 	struct ww_mutex *ww;
+	u64 lc_start;
 	int ret;
 
 	if (!use_ww_ctx)
@@ -611,6 +612,7 @@ __mutex_lock_common(struct mutex *lock, unsigned int state, unsigned int subclas
 #endif
 	}
 
+	lc_start = lock_contention_begin();
 	preempt_disable();
 	mutex_acquire_nest(&lock->dep_map, subclass, 0, nest_lock, ip);
 
@@ -618,6 +620,7 @@ __mutex_lock_common(struct mutex *lock, unsigned int state, unsigned int subclas
 	    mutex_optimistic_spin(lock, ww_ctx, NULL)) {
 		/* got the lock, yay! */
 		lock_acquired(&lock->dep_map, ip);
+		lock_contention_end(lock, LC_MUTEX, lc_start);
 		if (ww_ctx)
 			ww_mutex_set_context_fastpath(ww, ww_ctx);
 		trace_android_vh_record_mutex_lock_starttime(current, jiffies);
@@ -725,6 +728,7 @@ __mutex_lock_common(struct mutex *lock, unsigned int state, unsigned int subclas
 skip_wait:
 	/* got the lock - cleanup and rejoice! */
 	lock_acquired(&lock->dep_map, ip);
+	lock_contention_end(lock, LC_MUTEX, lc_start);
 
 	if (ww_ctx)
 		ww_mutex_lock_acquired(ww, ww_ctx);
@@ -27,6 +27,7 @@
  * Include queued spinlock statistics code
  */
 #include "qspinlock_stat.h"
+#include "lock_contention.h"
 
 /*
  * The basic principle of a queue-based spinlock can best be understood
@@ -315,6 +316,7 @@ static __always_inline u32  __pv_wait_head_or_lock(struct qspinlock *lock,
 void queued_spin_lock_slowpath(struct qspinlock *lock, u32 val)
 {
 	struct mcs_spinlock *prev, *next, *node;
+	u64 lc_start = lock_contention_begin();
 	u32 old, tail;
 	int idx;
 
@@ -388,6 +390,7 @@ void queued_spin_lock_slowpath(struct qspinlock *lock, u32 val)
 	 */
 	clear_pending_set_locked(lock);
 	lockevent_inc(lock_pending);
+	lock_contention_end(lock, LC_SPINLOCK, lc_start);
 	return;
 
 	/*
@@ -558,6 +561,7 @@ void queued_spin_lock_slowpath(struct qspinlock *lock, u32 val)
 	 * release the node
 	 */
 	__this_cpu_dec(qnodes[0].mcs.count);
+	lock_contention_end(lock, LC_SPINLOCK, lc_start);
 }
 EXPORT_SYMBOL(queued_spin_lock_slowpath);
 
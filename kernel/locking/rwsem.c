@@ -30,6 +30,7 @@
 
 #ifndef CONFIG_PREEMPT_RT
 #include "lock_events.h"
+#include "lock_contention.h"
 #include <trace/hooks/dtask.h>
 #include <trace/hooks/rwsem.h>
 
@@ -964,6 +965,7 @@ rwsem_down_read_slowpath(struct rw_semaphore *sem, long count, unsigned int stat
 	DEFINE_WAKE_Q(wake_q);
 	bool wake = false;
 	bool already_on_list = false;
+	u64 lc_start = lock_contention_begin();
 
 	/*
 	 * To prevent a constant stream of readers from starving a sleeping
@@ -1018,6 +1020,7 @@ rwsem_down_read_slowpath(struct rw_semaphore *sem, long count, unsigned int stat
 			raw_spin_unlock_irq(&sem->wait_lock);
 			rwsem_set_reader_owned(sem);
 			lockevent_inc(rwsem_rlock_fast);
+			lock_contention_end(sem, LC_RWSEM_READ, lc_start);
 			trace_android_vh_record_rwsem_lock_starttime(
 							current, jiffies);
 			return sem;
@@ -1075,6 +1078,7 @@ rwsem_down_read_slowpath(struct rw_semaphore *sem, long count, unsigned int stat
 	__set_current_state(TASK_RUNNING);
 	trace_android_vh_rwsem_read_wait_finish(sem);
 	lockevent_inc(rwsem_rlock);
+	lock_contention_end(sem, LC_RWSEM_READ, lc_start);
 	trace_android_vh_record_rwsem_lock_starttime(current, jiffies);
 	return sem;
 
@@ -1098,10 +1102,12 @@ rwsem_down_write_slowpath(struct rw_semaphore *sem, int state)
 	int null_owner_retries;
 	DEFINE_WAKE_Q(wake_q);
 	bool already_on_list = false;
+	u64 lc_start = lock_contention_begin();
 
 	/* do optimistic spinning and steal lock if possible */
 	if (rwsem_can_spin_on_owner(sem) && rwsem_optimistic_spin(sem)) {
 		/* rwsem_optimistic_spin() implies ACQUIRE on success */
+		lock_contention_end(sem, LC_RWSEM_WRITE, lc_start);
 		trace_android_vh_record_rwsem_lock_starttime(current, jiffies);
 		return sem;
 	}
@@ -1214,6 +1220,7 @@ rwsem_down_write_slowpath(struct rw_semaphore *sem, int state)
 	trace_android_vh_rwsem_write_wait_finish(sem);
 	raw_spin_unlock_irq(&sem->wait_lock);
 	lockevent_inc(rwsem_wlock);
+	lock_contention_end(sem, LC_RWSEM_WRITE, lc_start);
 	trace_android_vh_record_rwsem_lock_starttime(current, jiffies);
 	return sem;
 
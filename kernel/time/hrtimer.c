@@ -41,6 +41,8 @@
 #include <linux/timer.h>
 #include <linux/freezer.h>
 #include <linux/compat.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
 
 #include <linux/uaccess.h>
 
@@ -719,6 +721,72 @@ static int __init setup_hrtimer_hres(char *str)
 
 __setup("highres=", setup_hrtimer_hres);
 
+/*
+ * Slack coalescing
+ *
+ * Timers started with a slack range may expire anywhere between their
+ * soft and hard expiry. With "hrtimer_coalesce" enabled the hard expiry
+ * is pulled back onto a global grid, the largest power of two nanoseconds
+ * not exceeding the slack (capped at HRTIMER_COALESCE_MAX_NS). Unrelated
+ * periodic timers on any CPU thereby land on the same wake points instead
+ * of waking the system at their own distinct times, and the earlier timer
+ * interrupt picks up everything whose soft expiry has passed.
+ */
+#define HRTIMER_COALESCE_MIN_NS		(50 * NSEC_PER_USEC)
+#define HRTIMER_COALESCE_MAX_NS		(NSEC_PER_SEC)
+
+static bool hrtimer_coalesce_enabled __read_mostly;
+core_param(hrtimer_coalesce, hrtimer_coalesce_enabled, bool, 0644);
+
+static bool hrtimer_coalesce_expiry(struct hrtimer *timer, u64 delta_ns)
+{
+	ktime_t expires = hrtimer_get_expires(timer);
+	ktime_t aligned;
+	u64 gran;
+
+	if (!READ_ONCE(hrtimer_coalesce_enabled) ||
+	    delta_ns < HRTIMER_COALESCE_MIN_NS || expires == KTIME_MAX)
+		return false;
+
+	gran = rounddown_pow_of_two(min_t(u64, delta_ns,
+					  HRTIMER_COALESCE_MAX_NS));
+	aligned = expires & ~((ktime_t)gran - 1);
+	if (aligned == expires || aligned < hrtimer_get_softexpires(timer))
+		return false;
+
+	timer->node.expires = aligned;
+	return true;
+}
+
+/*
+ * A periodic timer moved on with hrtimer_forward() keeps the hard expiry
+ * of its previous, aligned period. Widen it back to the slack it asked
+ * for and align it again.
+ */
+static bool hrtimer_coalesce_restart(struct hrtimer *timer)
+{
+	if (!READ_ONCE(hrtimer_coalesce_enabled) ||
+	    timer->slack_ns < HRTIMER_COALESCE_MIN_NS)
+		return false;
+
+	timer->node.expires = ktime_add_safe(hrtimer_get_softexpires(timer),
+					     ns_to_ktime(timer->slack_ns));
+	return hrtimer_coalesce_expiry(timer, timer->slack_ns);
+}
+
+static inline void hrtimer_account_aligned(struct hrtimer_cpu_base *cpu_base)
+{
+	cpu_base->nr_aligned++;
+}
+
+static inline void hrtimer_account_batched(struct hrtimer_cpu_base *cpu_base,
+					   struct hrtimer *timer,
+					   ktime_t basenow)
+{
+	if (basenow < hrtimer_get_expires_tv64(timer))
+		cpu_base->nr_batched++;
+}
+
 /*
  * hrtimer_high_res_enabled - query, if the highres mode is enabled
  */
@@ -753,6 +821,16 @@ static void hrtimer_switch_to_hres(void)
 
 static inline int hrtimer_is_hres_enabled(void) { return 0; }
 static inline void hrtimer_switch_to_hres(void) { }
+static inline bool hrtimer_coalesce_expiry(struct hrtimer *timer,
+					   u64 delta_ns) { return false; }
+static inline bool hrtimer_coalesce_restart(struct hrtimer *timer)
+{
+	return false;
+}
+static inline void hrtimer_account_aligned(struct hrtimer_cpu_base *cpu_base) { }
+static inline void hrtimer_account_batched(struct hrtimer_cpu_base *cpu_base,
+					   struct hrtimer *timer,
+					   ktime_t basenow) { }
 
 #endif /* CONFIG_HIGH_RES_TIMERS */
 /*
@@ -1214,7 +1292,7 @@ static int __hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim,
 				    struct hrtimer_clock_base *base)
 {
 	struct hrtimer_clock_base *new_base;
-	bool force_local, first;
+	bool force_local, first, aligned;
 
 	/*
 	 * If the timer is on the local cpu base and is the first expiring
@@ -1246,6 +1324,7 @@ static int __hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim,
 	tim = hrtimer_update_lowres(timer, tim, mode);
 
 	hrtimer_set_expires_range_ns(timer, tim, delta_ns);
+	aligned = hrtimer_coalesce_expiry(timer, delta_ns);
 
 	/* Switch the timer base, if necessary: */
 	if (!force_local) {
@@ -1255,6 +1334,8 @@ static int __hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim,
 		new_base = base;
 	}
 
+	if (aligned)
+		hrtimer_account_aligned(new_base->cpu_base);
 	first = enqueue_hrtimer(timer, new_base, mode);
 	if (!force_local)
 		return first;
@@ -1698,8 +1779,11 @@ static void __run_hrtimer(struct hrtimer_cpu_base *cpu_base,
 	 * for us already.
 	 */
 	if (restart != HRTIMER_NORESTART &&
-	    !(timer->state & HRTIMER_STATE_ENQUEUED))
+	    !(timer->state & HRTIMER_STATE_ENQUEUED)) {
+		if (hrtimer_coalesce_restart(timer))
+			hrtimer_account_aligned(cpu_base);
 		enqueue_hrtimer(timer, base, HRTIMER_MODE_ABS);
+	}
 
 	/*
 	 * Separate the ->running assignment from the ->state assignment.
@@ -1746,6 +1830,7 @@ static void __hrtimer_run_queues(struct hrtimer_cpu_base *cpu_base, ktime_t now,
 			if (basenow < hrtimer_get_softexpires_tv64(timer))
 				break;
 
+			hrtimer_account_batched(cpu_base, timer, basenow);
 			__run_hrtimer(cpu_base, base, timer, &basenow, flags);
 			if (active_mask == HRTIMER_ACTIVE_SOFT)
 				hrtimer_sync_wait_running(cpu_base, flags);
@@ -51,6 +51,8 @@
 #include <linux/sched/isolation.h>
 #include <linux/nmi.h>
 #include <linux/kvm_para.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "workqueue_internal.h"
 
@@ -1348,6 +1350,254 @@ static int try_to_grab_pending(struct work_struct *work, bool is_dwork,
 	return -EAGAIN;
 }
 
+/*
+ * Work function latency statistics.
+ *
+ * With CONFIG_WQ_LATENCY_STATS every executed work item is accounted to
+ * its work function: how long it waited between being queued and starting
+ * to execute, how long it ran and how much CPU time it consumed.  Both
+ * latencies are kept as log2 histograms in microseconds.
+ *
+ * Work functions whose CPU time exceeds "workqueue.hog_thresh_us" are
+ * flagged as hogs.  If "workqueue.hog_offload" is set, subsequent
+ * executions of a flagged function are treated like WQ_CPU_INTENSIVE work
+ * and taken out of concurrency management, so they no longer hold back the
+ * other work items pending on the same per-cpu pool.
+ *
+ * The table is a fixed size, lockless open addressed hash keyed by the
+ * function pointer; entries are claimed with cmpxchg() and never released.
+ */
+#ifdef CONFIG_WQ_LATENCY_STATS
+
+#define WQ_STAT_HASH_BITS	8
+#define WQ_STAT_HASH_SIZE	(1 << WQ_STAT_HASH_BITS)
+#define WQ_STAT_BUCKETS		20	/* <1us .. >=2^18us (~262ms) */
+
+struct wq_func_stat {
+	work_func_t		func;
+	bool			hog;
+	atomic_long_t		nr_exec;
+	atomic_long_t		nr_hog;
+	atomic64_t		run_ns;
+	atomic64_t		max_run_ns;
+	atomic64_t		delay_ns;
+	atomic64_t		max_delay_ns;
+	atomic_long_t		run_hist[WQ_STAT_BUCKETS];
+	atomic_long_t		delay_hist[WQ_STAT_BUCKETS];
+};
+
+static struct wq_func_stat wq_func_stats[WQ_STAT_HASH_SIZE];
+static atomic_long_t wq_func_stats_dropped;
+
+static unsigned long wq_hog_thresh_us = 10 * USEC_PER_MSEC;
+module_param_named(hog_thresh_us, wq_hog_thresh_us, ulong, 0644);
+
+static bool wq_hog_offload;
+module_param_named(hog_offload, wq_hog_offload, bool, 0644);
+
+static struct wq_func_stat *wq_stat_lookup(work_func_t func)
+{
+	unsigned int i, idx = hash_ptr((void *)func, WQ_STAT_HASH_BITS);
+	struct wq_func_stat *stat;
+	work_func_t old;
+
+	for (i = 0; i < WQ_STAT_HASH_SIZE; i++) {
+		stat = &wq_func_stats[(idx + i) & (WQ_STAT_HASH_SIZE - 1)];
+		old = READ_ONCE(stat->func);
+		if (old == func)
+			return stat;
+		if (!old) {
+			old = cmpxchg(&stat->func, NULL, func);
+			if (!old || old == func)
+				return stat;
+		}
+	}
+	atomic_long_inc(&wq_func_stats_dropped);
+	return NULL;
+}
+
+static unsigned int wq_stat_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(div_u64(ns, NSEC_PER_USEC)),
+		     WQ_STAT_BUCKETS - 1);
+}
+
+static void wq_stat_max(atomic64_t *max, u64 val)
+{
+	s64 old = atomic64_read(max);
+
+	while (val > old) {
+		s64 prev = atomic64_cmpxchg(max, old, val);
+
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+static bool wq_stat_offload_hog(struct wq_func_stat *stat)
+{
+	return stat && READ_ONCE(stat->hog) && READ_ONCE(wq_hog_offload);
+}
+
+static void wq_stat_account(struct wq_func_stat *stat, u64 queued_ns,
+			    u64 start_ns, u64 cpu_ns)
+{
+	u64 delay_ns, run_ns;
+
+	if (!stat)
+		return;
+
+	run_ns = ktime_get_ns() - start_ns;
+	delay_ns = start_ns - min(queued_ns, start_ns);
+
+	atomic_long_inc(&stat->nr_exec);
+	atomic64_add(run_ns, &stat->run_ns);
+	atomic64_add(delay_ns, &stat->delay_ns);
+	atomic_long_inc(&stat->run_hist[wq_stat_bucket(run_ns)]);
+	atomic_long_inc(&stat->delay_hist[wq_stat_bucket(delay_ns)]);
+	wq_stat_max(&stat->max_run_ns, run_ns);
+	wq_stat_max(&stat->max_delay_ns, delay_ns);
+
+	if (cpu_ns > READ_ONCE(wq_hog_thresh_us) * NSEC_PER_USEC) {
+		atomic_long_inc(&stat->nr_hog);
+		if (!READ_ONCE(stat->hog)) {
+			WRITE_ONCE(stat->hog, true);
+			pr_info("workqueue: %ps hogged CPU for %lluus, consider WQ_UNBOUND or WQ_CPU_INTENSIVE\n",
+				stat->func, div_u64(cpu_ns, NSEC_PER_USEC));
+		}
+	}
+}
+
+static void wq_stat_show_hist(struct seq_file *m, const char *name,
+			      atomic_long_t *hist)
+{
+	int i;
+
+	seq_printf(m, "  %-5s", name);
+	for (i = 0; i < WQ_STAT_BUCKETS; i++)
+		seq_printf(m, " %lu", atomic_long_read(&hist[i]));
+	seq_putc(m, '\n');
+}
+
+static int wq_stat_show(struct seq_file *m, void *v)
+{
+	int i;
+
+	seq_printf(m, "hog_thresh_us %lu hog_offload %d dropped %lu\n",
+		   READ_ONCE(wq_hog_thresh_us), READ_ONCE(wq_hog_offload),
+		   atomic_long_read(&wq_func_stats_dropped));
+	seq_puts(m, "histogram buckets: [0] <1us, [n] <2^n us, last open ended\n");
+
+	for (i = 0; i < WQ_STAT_HASH_SIZE; i++) {
+		struct wq_func_stat *stat = &wq_func_stats[i];
+		unsigned long nr = atomic_long_read(&stat->nr_exec);
+
+		if (!READ_ONCE(stat->func) || !nr)
+			continue;
+
+		seq_printf(m, "%ps: exec %lu hog %lu%s avg_run_us %llu max_run_us %llu avg_delay_us %llu max_delay_us %llu\n",
+			   stat->func, nr, atomic_long_read(&stat->nr_hog),
+			   READ_ONCE(stat->hog) ? " [hog]" : "",
+			   div_u64(atomic64_read(&stat->run_ns), nr * NSEC_PER_USEC),
+			   div_u64(atomic64_read(&stat->max_run_ns), NSEC_PER_USEC),
+			   div_u64(atomic64_read(&stat->delay_ns), nr * NSEC_PER_USEC),
+			   div_u64(atomic64_read(&stat->max_delay_ns), NSEC_PER_USEC));
+		wq_stat_show_hist(m, "run", stat->run_hist);
+		wq_stat_show_hist(m, "delay", stat->delay_hist);
+	}
+	return 0;
+}
+
+static int wq_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wq_stat_show, NULL);
+}
+
+/* Any write clears the counters and hog flags, function slots are kept. */
+static ssize_t wq_stat_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	int i, j;
+
+	for (i = 0; i < WQ_STAT_HASH_SIZE; i++) {
+		struct wq_func_stat *stat = &wq_func_stats[i];
+
+		WRITE_ONCE(stat->hog, false);
+		atomic_long_set(&stat->nr_exec, 0);
+		atomic_long_set(&stat->nr_hog, 0);
+		atomic64_set(&stat->run_ns, 0);
+		atomic64_set(&stat->max_run_ns, 0);
+		atomic64_set(&stat->delay_ns, 0);
+		atomic64_set(&stat->max_delay_ns, 0);
+		for (j = 0; j < WQ_STAT_BUCKETS; j++) {
+			atomic_long_set(&stat->run_hist[j], 0);
+			atomic_long_set(&stat->delay_hist[j], 0);
+		}
+	}
+	atomic_long_set(&wq_func_stats_dropped, 0);
+	return count;
+}
+
+static const struct file_operations wq_stat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wq_stat_open,
+	.read		= seq_read,
+	.write		= wq_stat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init wq_stat_debugfs_init(void)
+{
+	struct dentry *dir = debugfs_create_dir("workqueue", NULL);
+
+	debugfs_create_file("latency", 0600, dir, NULL, &wq_stat_fops);
+	return 0;
+}
+late_initcall(wq_stat_debugfs_init);
+
+static inline void wq_stat_mark_queued(struct work_struct *work)
+{
+	work->queued_ns = ktime_get_ns();
+}
+
+static inline u64 wq_stat_queued(struct work_struct *work)
+{
+	return work->queued_ns;
+}
+
+static inline u64 wq_stat_now(void)
+{
+	return ktime_get_ns();
+}
+
+static inline u64 wq_stat_cpu_now(void)
+{
+	return READ_ONCE(current->se.sum_exec_runtime);
+}
+
+#else	/* CONFIG_WQ_LATENCY_STATS */
+
+struct wq_func_stat;
+
+static inline struct wq_func_stat *wq_stat_lookup(work_func_t func)
+{
+	return NULL;
+}
+static inline bool wq_stat_offload_hog(struct wq_func_stat *stat)
+{
+	return false;
+}
+static inline void wq_stat_account(struct wq_func_stat *stat, u64 queued_ns,
+				   u64 start_ns, u64 cpu_ns) { }
+static inline void wq_stat_mark_queued(struct work_struct *work) { }
+static inline u64 wq_stat_queued(struct work_struct *work) { return 0; }
+static inline u64 wq_stat_now(void) { return 0; }
+static inline u64 wq_stat_cpu_now(void) { return 0; }
+
+#endif	/* CONFIG_WQ_LATENCY_STATS */
+
 /**
  * insert_work - insert a work into a pool
  * @pwq: pwq @work belongs to
@@ -1371,6 +1621,7 @@ static void insert_work(struct pool_workqueue *pwq, struct work_struct *work,
 
 	/* we own @work, set data and link */
 	set_work_pwq(work, pwq, extra_flags);
+	wq_stat_mark_queued(work);
 	list_add_tail(&work->entry, head);
 	get_pwq(pwq);
 
@@ -2220,6 +2471,8 @@ __acquires(&pool->lock)
 	unsigned long work_data;
 	struct worker *collision;
 #endif
+	struct wq_func_stat *wq_stat;
+	u64 queued_ns, start_ns, cpu_ns;
 
 #ifdef CONFIG_LOCKDEP
 	/*
@@ -2259,6 +2512,12 @@ __acquires(&pool->lock)
 		return;
 	}
 
+	/* functions known to hog the CPU can be kept off concurrency management */
+	wq_stat = wq_stat_lookup(work->func);
+	if (wq_stat_offload_hog(wq_stat))
+		cpu_intensive = true;
+	queued_ns = wq_stat_queued(work);
+
 	/* claim and dequeue */
 	debug_work_deactivate(work);
 	hash_add(pool->busy_hash, &worker->hentry, (unsigned long)work);
@@ -2330,7 +2589,10 @@ __acquires(&pool->lock)
 	 */
 	lockdep_invariant_state(true);
 	trace_workqueue_execute_start(work);
+	start_ns = wq_stat_now();
+	cpu_ns = wq_stat_cpu_now();
 	worker->current_func(work);
+	wq_stat_account(wq_stat, queued_ns, start_ns, wq_stat_cpu_now() - cpu_ns);
 	/*
 	 * While we must be careful to not use "work" after this, the trace
 	 * point will only record its address.
@@ -685,7 +685,8 @@ static void __mem_cgroup_flush_stats(void)
 
 void mem_cgroup_flush_stats(void)
 {
-	if (atomic_read(&stats_flush_threshold) > num_online_cpus())
+	if (atomic_read(&stats_flush_threshold) > num_online_cpus() &&
+	    !cgroup_rstat_flushed_recently(root_mem_cgroup->css.cgroup))
 		__mem_cgroup_flush_stats();
 }
 